@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <argp.h>
+
+#include "utils.h"
+#include "libutils.h"
+#include "libpattern.h"
+#include "libverify.h"
+#include "version.h"
+
+/* Argp's global variables. */
+const char *argp_program_version = "F3 Bench " F3_STR_VERSION;
+
+/* Arguments. */
+static char adoc[] = "";
+
+static char doc[] = "F3 Bench -- measure the speed of the kernels "
+	"that generate and check the data of F3, without any I/O";
+
+static struct argp_option options[] = {
+	{"time",		't',	"MS",		0,
+		"Time spent measuring each kernel; the default is 250ms", 1},
+	{ 0 }
+};
+
+struct args {
+	long		time_ms;
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct args *args = state->input;
+	long l;
+
+	switch (key) {
+	case 't':
+		l = arg_to_long(state, arg);
+		if (l <= 0)
+			argp_error(state,
+				"MS must be greater than zero");
+		args->time_ms = l;
+		break;
+
+	case ARGP_KEY_ARG:
+		argp_error(state, "Too many arguments");
+		break;
+
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = {options, parse_opt, adoc, doc, NULL, NULL, NULL};
+
+/* Size of the buffers that the kernels go through. It is larger than
+ * the caches close to the cores of most processors, so the speeds
+ * include the memory, as they do in the tools.
+ */
+#define BUF_SIZE	(4 << 20)
+#define MAX_N_BLOCKS	(BUF_SIZE >> 9)
+
+/* Offset of the buffer in the file or drive. */
+#define BUF_OFFSET	(1ULL << 30)
+
+#define SALT		0x5a5a5a5a12345678ULL
+
+enum corruption {
+	/* The data expected. */
+	CR_GOOD,
+	/* Never written. */
+	CR_ZERO,
+	/* Data of F3, but written somewhere else. */
+	CR_OVERWRITTEN,
+	/* The data expected but a word in the middle of every sector
+	 * or block.
+	 */
+	CR_CHANGED,
+	CR_MAX
+};
+
+static const char *corruption_name[CR_MAX] = {
+	"all-good", "all-zero", "overwritten", "changed",
+};
+
+/* What a kernel goes through. */
+struct bench_buf {
+	char		*buf;
+	int		block_order;
+	int		n_blocks;
+
+	uint64_t	good[BLOCK_BITMAP_WORDS(MAX_N_BLOCKS)];
+	uint64_t	valid[BLOCK_BITMAP_WORDS(MAX_N_BLOCKS)];
+	uint64_t	found[MAX_N_BLOCKS];
+	struct file_stats stats;
+};
+
+/* Results are added here, so the compiler can't drop the kernels. */
+static volatile uint64_t sink;
+
+/* These are the kernels that f3write, f3read, f3probe, and f3brew
+ * run over every byte that they write or read.
+ */
+
+static void run_fill_buffer(struct bench_buf *bb)
+{
+	sink += fill_buffer(bb->buf, BUF_SIZE, BUF_OFFSET);
+}
+
+static void run_check_buffer(struct bench_buf *bb)
+{
+	sink += check_buffer(bb->buf, BUF_SIZE, BUF_OFFSET, &bb->stats);
+}
+
+static void run_fill_block(struct bench_buf *bb)
+{
+	const int block_size = 1 << bb->block_order;
+	uint64_t offset = BUF_OFFSET;
+	char *blk = bb->buf;
+	int i;
+
+	for (i = 0; i < bb->n_blocks; i++) {
+		fill_buffer_with_block(blk, bb->block_order, offset, SALT);
+		blk += block_size;
+		offset += block_size;
+	}
+}
+
+static void run_validate_block(struct bench_buf *bb)
+{
+	const int block_size = 1 << bb->block_order;
+	const char *blk = bb->buf;
+	uint64_t found_offset = 0;
+	int i;
+
+	for (i = 0; i < bb->n_blocks; i++) {
+		sink += validate_buffer_with_block(blk, bb->block_order,
+			&found_offset, SALT);
+		blk += block_size;
+	}
+	sink += found_offset;
+}
+
+static void run_validate_blocks(struct bench_buf *bb)
+{
+	sink += validate_buffer_with_blocks(bb->buf, bb->block_order,
+		bb->n_blocks, BUF_OFFSET, SALT, bb->good, bb->valid,
+		bb->found);
+}
+
+struct kernel {
+	const char	*name;
+	void		(*run)(struct bench_buf *bb);
+	/* True if the kernel checks data, so it is measured
+	 * with each corruption.
+	 */
+	bool		is_check;
+	/* True if the kernel works on blocks, so it is measured
+	 * with each block order; the others work on sectors.
+	 */
+	bool		is_block;
+};
+
+static const struct kernel kernels[] = {
+	{"fill_buffer",		run_fill_buffer,	false,	false},
+	{"check_buffer",	run_check_buffer,	true,	false},
+	{"fill_block",		run_fill_block,		false,	true},
+	{"validate_block",	run_validate_block,	true,	true},
+	{"validate_blocks",	run_validate_blocks,	true,	true},
+};
+
+#define N_KERNELS	((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static const int block_orders[] = {9, 12, 16, 20};
+
+#define N_BLOCK_ORDERS \
+	((int)(sizeof(block_orders) / sizeof(block_orders[0])))
+
+/* Write into @bb the data that a check kernel finds. */
+static void prepare(struct bench_buf *bb, const struct kernel *k,
+	enum corruption cr)
+{
+	const int unit_order = k->is_block ? bb->block_order : 9;
+	const uint64_t offset = cr == CR_OVERWRITTEN
+		? BUF_OFFSET + BUF_SIZE : BUF_OFFSET;
+	int i, n = BUF_SIZE >> unit_order;
+
+	if (cr == CR_ZERO) {
+		memset(bb->buf, 0, BUF_SIZE);
+		return;
+	}
+
+	if (k->is_block) {
+		for (i = 0; i < n; i++)
+			fill_buffer_with_block(bb->buf + (i << unit_order),
+				unit_order, offset + (i << unit_order), SALT);
+	} else {
+		fill_buffer(bb->buf, BUF_SIZE, offset);
+	}
+
+	if (cr == CR_CHANGED) {
+		for (i = 0; i < n; i++) {
+			uint64_t *words = (uint64_t *)
+				(bb->buf + (i << unit_order));
+			words[(1 << (unit_order - 3)) / 2] ^= 1;
+		}
+	}
+}
+
+/* Return the speed of @k over @bb in GB per second. */
+static double measure_kernel(struct bench_buf *bb, const struct kernel *k,
+	long time_ms)
+{
+	const uint64_t min_ns = time_ms * 1000000ULL;
+	uint64_t rounds = 0, t1, t2;
+
+	/* Warm the caches and the branch predictors up. */
+	k->run(bb);
+
+	t1 = now_ns();
+	do {
+		k->run(bb);
+		rounds++;
+		t2 = now_ns();
+	} while (t2 - t1 < min_ns);
+
+	return (double)rounds * BUF_SIZE / GIGABYTES / ((t2 - t1) / 1e9);
+}
+
+static void bench(struct bench_buf *bb, const struct kernel *k,
+	long time_ms)
+{
+	int cr;
+
+	if (!k->is_check) {
+		printf("%-7s %-16s %11i %-12s %8.2f GB/s\n",
+			pattern_version_name(pattern_get_version()), k->name,
+			bb->block_order, "-", measure_kernel(bb, k, time_ms));
+		fflush(stdout);
+		return;
+	}
+
+	for (cr = 0; cr < CR_MAX; cr++) {
+		prepare(bb, k, cr);
+		printf("%-7s %-16s %11i %-12s %8.2f GB/s\n",
+			pattern_version_name(pattern_get_version()), k->name,
+			bb->block_order, corruption_name[cr],
+			measure_kernel(bb, k, time_ms));
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct args args = {
+		/* Defaults. */
+		.time_ms	= 250,
+	};
+	struct bench_buf *bb;
+	int i, j, v;
+
+	/* Read parameters. */
+	argp_parse(&argp, argc, argv, 0, NULL, &args);
+	print_header(stdout, "bench");
+
+	bb = malloc(sizeof(*bb));
+	assert(bb);
+	assert(!posix_memalign((void **)&bb->buf, DIRECT_IO_ALIGN,
+		BUF_SIZE));
+
+	printf("Pattern kernel: %s\n\n", pattern_kernel_name());
+	printf("%-7s %-16s %11s %-12s %13s\n",
+		"Pattern", "Kernel", "Block order", "Data", "Speed");
+	for (v = 0; v < PATTERN_VERSION_MAX; v++) {
+		pattern_set_version(v);
+		for (i = 0; i < N_KERNELS; i++) {
+			const struct kernel *k = &kernels[i];
+			for (j = 0; j < (k->is_block ? N_BLOCK_ORDERS : 1);
+				j++) {
+				bb->block_order = k->is_block
+					? block_orders[j] : 9;
+				bb->n_blocks = BUF_SIZE >> bb->block_order;
+				zero_fstats(&bb->stats);
+				bench(bb, k, args.time_ms);
+			}
+		}
+	}
+
+	free(bb->buf);
+	free(bb);
+	return 0;
+}
@@ -5,11 +5,15 @@
 #include <string.h>
 #include <argp.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <err.h>
+#include <pthread.h>
 
 #include "version.h"
 #include "libutils.h"
+#include "libpattern.h"
 #include "libdevs.h"
+#include "libarena.h"
 
 /* Argp's global variables. */
 const char *argp_program_version = "F3 BREW " F3_STR_VERSION;
@@ -52,6 +56,18 @@ static struct argp_option options[] = {
 		"Do not write blocks",				0},
 	{"do-not-read",		'R',	NULL,		0,
 		"Do not read blocks",				0},
+	{"queue-depth",		'q',	"NUM",		0,
+		"Number of requests kept in flight; the default is 4",	0},
+	{"jobs",		'j',	"NUM",		0,
+		"Split the test into NUM regions tested in parallel",	0},
+	{"pattern",		'P',	"VERSION",	0,
+		"Version of the test pattern: v1 (default) or v2",	0},
+	{"hugepages",		'H',	NULL,		0,
+		"Back the I/O buffers with huge pages",		0},
+	{"discard",		'D',	"TYPE",		OPTION_ARG_OPTIONAL,
+		"Discard the blocks before writing them, so every run "
+		"starts from the same state; TYPE is plain (default) "
+		"or secure",						0},
 	{ 0 }
 };
 
@@ -66,7 +82,14 @@ struct args {
 	enum reset_type	reset_type;
 	bool test_write;
 	bool test_read;
-	/* 3 free bytes. */
+	/* 2 free bytes. */
+	int		queue_depth;
+	int		jobs;
+	enum pattern_version pattern;
+	/* Flags of create_arena(). */
+	int		arena_flags;
+	/* An enum discard_type, or -1 to not discard. */
+	int		discard;
 
 	/* Geometry. */
 	uint64_t	real_size_byte;
@@ -81,6 +104,9 @@ struct args {
 	uint64_t	last_block;
 };
 
+#define MAX_QUEUE_DEPTH	64
+#define MAX_JOBS	64
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct args *args = state->input;
@@ -179,6 +205,42 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->test_read = false;
 		break;
 
+	case 'q':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < 1 || ll > MAX_QUEUE_DEPTH)
+			argp_error(state,
+				"Queue depth must be in the interval [1, %i]",
+				MAX_QUEUE_DEPTH);
+		args->queue_depth = ll;
+		break;
+
+	case 'j':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < 1 || ll > MAX_JOBS)
+			argp_error(state,
+				"Number of jobs must be in the interval [1, %i]",
+				MAX_JOBS);
+		args->jobs = ll;
+		break;
+
+	case 'P':
+		ll = pattern_version_from_name(arg);
+		if (ll < 0)
+			argp_error(state, "Unknown pattern version `%s'", arg);
+		args->pattern = ll;
+		break;
+
+	case 'H':
+		args->arena_flags |= ARENA_HUGEPAGE;
+		break;
+
+	case 'D':
+		ll = arg ? discard_type_from_name(arg) : DISCARD_PLAIN;
+		if (ll < 0)
+			argp_error(state, "Unknown discard type `%s'", arg);
+		args->discard = ll;
+		break;
+
 	case ARGP_KEY_INIT:
 		args->filename = NULL;
 		break;
@@ -217,44 +279,76 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, adoc, doc, NULL, NULL, NULL};
 
-static void write_blocks(struct device *dev,
+/* Size of the arena of a sequential scan with @depth requests in flight. */
+static size_t scan_arena_size(int block_order, int depth)
+{
+	return arena_size(1, (size_t)depth * BIG_BLOCK_SIZE_BYTE,
+		block_order);
+}
+
+/* Take the buffers of a sequential scan with @depth requests in flight
+ * from @arena, whose size must be, at least, scan_arena_size().
+ * Give them back with arena_release(@arena, *@pmark).
+ */
+static char *alloc_scan_buffers(struct arena *arena, int block_order,
+	int depth, size_t *pmark)
+{
+	char *buffers;
+
+	*pmark = arena_mark(arena);
+	buffers = arena_alloc(arena, (size_t)depth * BIG_BLOCK_SIZE_BYTE,
+		block_order);
+	assert(buffers);
+	return buffers;
+}
+
+static void write_blocks(struct device *dev, int depth, struct arena *arena,
 	uint64_t first_block, uint64_t last_block)
 {
 	const int block_order = dev_get_block_order(dev);
 	const int block_size = dev_get_block_size(dev);
-	char stack[align_head(block_order) + BIG_BLOCK_SIZE_BYTE];
-	char *buffer = align_mem(stack, block_order);
-	char *stamp_blk = buffer;
-	char *flush_blk = buffer + BIG_BLOCK_SIZE_BYTE;
+	const uint64_t step = (BIG_BLOCK_SIZE_BYTE >> block_order) - 1;
+	struct dev_queue *q = create_dev_queue(dev, depth);
+	size_t mark;
+	char *buffers = alloc_scan_buffers(arena, block_order, depth, &mark);
 	uint64_t offset = first_block << block_order;
-	uint64_t pos, first_pos = first_block;
+	uint64_t next_pos = first_block;
+	int n_submitted = 0;
 
 	assert(BIG_BLOCK_SIZE_BYTE >= block_size);
-
-	for (pos = first_block; pos <= last_block; pos++) {
-		fill_buffer_with_block(stamp_blk, block_order, offset, 0);
-		stamp_blk += block_size;
-		offset += block_size;
-
-		if (stamp_blk == flush_blk || pos == last_block) {
-			if (dev_write_blocks(dev, buffer, first_pos, pos))
-				warn("Failed to write blocks from 0x%" PRIx64
-					" to 0x%" PRIx64, first_pos, pos);
-			stamp_blk = buffer;
-			first_pos = pos + 1;
+	assert(q);
+
+	while (next_pos <= last_block || dev_queue_pending(q)) {
+		uint64_t pos, first_pos, last_pos;
+
+		if (next_pos <= last_block && !dev_queue_is_full(q)) {
+			char *buffer = buffers + (n_submitted % depth) *
+				BIG_BLOCK_SIZE_BYTE;
+			char *stamp_blk = buffer;
+
+			last_pos = next_pos + step;
+			if (last_pos > last_block)
+				last_pos = last_block;
+			for (pos = next_pos; pos <= last_pos; pos++) {
+				fill_buffer_with_block(stamp_blk, block_order,
+					offset, 0);
+				stamp_blk += block_size;
+				offset += block_size;
+			}
+
+			dev_queue_submit_write(q, buffer, next_pos, last_pos);
+			n_submitted++;
+			next_pos = last_pos + 1;
+			continue;
 		}
+
+		if (dev_queue_complete(q, NULL, &first_pos, &last_pos))
+			warn("Failed to write blocks from 0x%" PRIx64
+				" to 0x%" PRIx64, first_pos, last_pos);
 	}
-}
 
-/* XXX Properly handle return errors. */
-static void test_write_blocks(struct device *dev,
-	uint64_t first_block, uint64_t last_block)
-{
-	printf("Writing blocks from 0x%" PRIx64 " to 0x%" PRIx64 "...",
-		first_block, last_block);
-	fflush(stdout);
-	write_blocks(dev, first_block, last_block);
-	printf(" Done\n\n");
+	free_dev_queue(q);
+	arena_release(arena, mark);
 }
 
 enum block_state {
@@ -320,25 +414,45 @@ static void print_block_range(const struct block_range *range)
 	printf("\n");
 }
 
-static void validate_block(uint64_t expected_sector_offset,
-	const char *probe_blk, int block_order, struct block_range *range)
+/* Finished ranges of a region; see test_regions(). */
+struct range_list {
+	struct block_range	*ranges;
+	int			n;
+	int			max;
+};
+
+/* Print @range if @list is NULL, otherwise add it to @list. */
+static void finish_range(const struct block_range *range,
+	struct range_list *list)
 {
-	uint64_t found_sector_offset;
-	enum block_state state;
-	bool push_range;
-
-	if (validate_buffer_with_block(probe_blk, block_order,
-		&found_sector_offset, 0))
-		state = bs_bad; /* Bad block. */
-	else if (expected_sector_offset == found_sector_offset)
-		state = bs_good; /* Good block. */
-	else
-		state = bs_overwritten; /* Overwritten block. */
+	if (!list) {
+		print_block_range(range);
+		return;
+	}
+	if (list->n >= list->max) {
+		list->max = list->max ? 2 * list->max : 64;
+		list->ranges = realloc(list->ranges,
+			list->max * sizeof(*list->ranges));
+		if (!list->ranges)
+			err(errno, "Can't allocate ranges");
+	}
+	list->ranges[list->n++] = *range;
+}
 
-	push_range = (range->state != state) || (
+/* Add the run of blocks from @start_sector_offset to @end_sector_offset,
+ * all in @state, to @range.
+ * @found_sector_offset is only used by state bs_overwritten, and is
+ * the offset found in the first block of the run.
+ * The range that the run ends is passed to finish_range() with @list.
+ */
+static void add_run(struct block_range *range, struct range_list *list,
+	enum block_state state, uint64_t start_sector_offset,
+	uint64_t end_sector_offset, uint64_t found_sector_offset)
+{
+	bool push_range = (range->state != state) || (
 			state == bs_overwritten
 			&& (
-				(expected_sector_offset
+				(start_sector_offset
 					- range->start_sector_offset)
 				!=
 				(found_sector_offset
@@ -348,26 +462,95 @@ static void validate_block(uint64_t expected_sector_offset,
 
 	if (push_range) {
 		if (range->state != bs_unknown)
-			print_block_range(range);
+			finish_range(range, list);
 		range->state = state;
-		range->start_sector_offset = expected_sector_offset;
-		range->end_sector_offset = expected_sector_offset;
+		range->start_sector_offset = start_sector_offset;
+		range->end_sector_offset = end_sector_offset;
 		range->found_sector_offset = found_sector_offset;
 	} else {
-		range->end_sector_offset = expected_sector_offset;
+		range->end_sector_offset = end_sector_offset;
 	}
 }
 
-static void read_blocks(struct device *dev,
-	uint64_t first_block, uint64_t last_block)
+static inline int test_bit(const uint64_t *bitmap, int i)
+{
+	return (bitmap[i >> 6] >> (i & 63)) & 1;
+}
+
+/* Return the length of the run of bits equal to @value in @bitmap
+ * that starts at bit @first and doesn't go beyond bit @n - 1.
+ */
+static int bitmap_run(const uint64_t *bitmap, int first, int n, int value)
+{
+	int i = first;
+
+	while (i < n) {
+		const int avail = 64 - (i & 63);
+		uint64_t word = value ? bitmap[i >> 6] : ~bitmap[i >> 6];
+		uint64_t stop = ~(word >> (i & 63));
+		int len = stop ? __builtin_ctzll(stop) : 64;
+
+		if (len > avail)
+			len = avail;
+		i += len;
+		if (len < avail)
+			break;
+	}
+
+	return (i < n ? i : n) - first;
+}
+
+/* Blocks have at least 512 bytes. */
+#define MAX_BLOCKS_PER_BUFFER	(BIG_BLOCK_SIZE_BYTE >> 9)
+
+/* Add the @n_blocks blocks in @buf to @range. */
+static void validate_blocks(const char *buf, int n_blocks,
+	uint64_t expected_sector_offset, int block_order,
+	struct block_range *range, struct range_list *list)
+{
+	uint64_t good[BLOCK_BITMAP_WORDS(MAX_BLOCKS_PER_BUFFER)];
+	uint64_t valid[BLOCK_BITMAP_WORDS(MAX_BLOCKS_PER_BUFFER)];
+	uint64_t found[MAX_BLOCKS_PER_BUFFER];
+	int i, len;
+
+	assert(n_blocks <= MAX_BLOCKS_PER_BUFFER);
+	validate_buffer_with_blocks(buf, block_order, n_blocks,
+		expected_sector_offset, 0, good, valid, found);
+
+	for (i = 0; i < n_blocks; i += len) {
+		uint64_t offset = expected_sector_offset +
+			((uint64_t)i << block_order);
+		enum block_state state;
+
+		if (test_bit(good, i)) {
+			state = bs_good;
+			len = bitmap_run(good, i, n_blocks, true);
+		} else if (!test_bit(valid, i)) {
+			state = bs_bad;
+			len = bitmap_run(valid, i, n_blocks, false);
+		} else {
+			state = bs_overwritten;
+			len = 1;
+		}
+
+		add_run(range, list, state, offset,
+			offset + ((uint64_t)(len - 1) << block_order),
+			found[i]);
+	}
+}
+
+static void read_blocks(struct device *dev, int depth, struct arena *arena,
+	uint64_t first_block, uint64_t last_block, struct range_list *list)
 {
 	const int block_size = dev_get_block_size(dev);
 	const int block_order = dev_get_block_order(dev);
-	char stack[align_head(block_order) + BIG_BLOCK_SIZE_BYTE];
-	char *buffer = align_mem(stack, block_order);
+	const uint64_t step = (BIG_BLOCK_SIZE_BYTE >> block_order) - 1;
+	struct dev_queue *q = create_dev_queue(dev, depth);
+	size_t mark;
+	char *buffers = alloc_scan_buffers(arena, block_order, depth, &mark);
 	uint64_t expected_sector_offset = first_block << block_order;
-	uint64_t first_pos = first_block;
-	uint64_t step = (BIG_BLOCK_SIZE_BYTE >> block_order) - 1;
+	uint64_t next_pos = first_block;
+	int n_submitted = 0;
 	struct block_range range = {
 		.state = bs_unknown,
 		.block_order = block_order,
@@ -377,39 +560,189 @@ static void read_blocks(struct device *dev,
 	};
 
 	assert(BIG_BLOCK_SIZE_BYTE >= block_size);
+	assert(q);
+
+	while (next_pos <= last_block || dev_queue_pending(q)) {
+		uint64_t first_pos, last_pos;
+		char *probe_blk;
+
+		if (next_pos <= last_block && !dev_queue_is_full(q)) {
+			last_pos = next_pos + step;
+			if (last_pos > last_block)
+				last_pos = last_block;
+			dev_queue_submit_read(q, buffers +
+				(n_submitted % depth) * BIG_BLOCK_SIZE_BYTE,
+				next_pos, last_pos);
+			n_submitted++;
+			next_pos = last_pos + 1;
+			continue;
+		}
 
-	while (first_pos <= last_block) {
-		char *probe_blk = buffer;
-		uint64_t pos, next_pos = first_pos + step;
-
-		if (next_pos > last_block)
-			next_pos = last_block;
-		if (dev_read_blocks(dev, buffer, first_pos, next_pos))
+		if (dev_queue_complete(q, &probe_blk, &first_pos, &last_pos))
 			warn("Failed to read blocks from 0x%" PRIx64
-				" to 0x%" PRIx64, first_pos, next_pos);
+				" to 0x%" PRIx64, first_pos, last_pos);
 
-		for (pos = first_pos; pos <= next_pos; pos++) {
-			validate_block(expected_sector_offset, probe_blk,
-				block_order, &range);
-			expected_sector_offset += block_size;
-			probe_blk += block_size;
-		}
-
-		first_pos = next_pos + 1;
+		validate_blocks(probe_blk, last_pos - first_pos + 1,
+			expected_sector_offset, block_order, &range, list);
+		expected_sector_offset += (last_pos - first_pos + 1) <<
+			block_order;
 	}
+	free_dev_queue(q);
+	arena_release(arena, mark);
+
 	if (range.state != bs_unknown)
-		print_block_range(&range);
+		finish_range(&range, list);
 	else
 		assert(first_block > last_block);
 }
 
-/* XXX Properly handle return errors. */
-static void test_read_blocks(struct device *dev,
+/* A region is a part of the test that a worker thread runs. */
+struct region {
+	struct device		*dev;
+	int			depth;
+	struct arena		*arena;
+	int			is_write;
+	uint64_t		first_block;
+	uint64_t		last_block;
+	struct range_list	*list;
+	pthread_t		thread;
+};
+
+static void *region_thread(void *arg)
+{
+	struct region *r = arg;
+	if (r->is_write)
+		write_blocks(r->dev, r->depth, r->arena, r->first_block,
+			r->last_block);
+	else
+		read_blocks(r->dev, r->depth, r->arena, r->first_block,
+			r->last_block, r->list);
+	return NULL;
+}
+
+/* Split the blocks from @first_block to @last_block into @jobs regions,
+ * and test them in parallel.
+ * Every region has its own queue and buffers, which come from
+ * the arena of its job in @arenas, and, when reading,
+ * @lists receives the ranges of each region.
+ * Regions are aligned to the requests of the scans, so the requests are
+ * the same as those of a single scan.
+ *
+ * When blocks of a fake drive alias each other, which of them survives
+ * depends on the order of the writes, so the overwritten blocks may
+ * differ from those of a single scan.
+ */
+static void test_regions(struct device *dev, int depth, int jobs,
+	struct arena **arenas, int is_write, uint64_t first_block,
+	uint64_t last_block, struct range_list *lists)
+{
+	const uint64_t step = BIG_BLOCK_SIZE_BYTE >> dev_get_block_order(dev);
+	const uint64_t n_steps = (last_block - first_block) / step + 1;
+	const uint64_t steps_per_region = (n_steps + jobs - 1) / jobs;
+	struct region regions[MAX_JOBS];
+	uint64_t next_block = first_block;
+	int i, n = 0;
+
+	assert(jobs <= MAX_JOBS);
+	for (i = 0; i < jobs && next_block <= last_block; i++) {
+		struct region *r = &regions[n++];
+		r->dev = dev;
+		r->depth = depth;
+		r->arena = arenas[i];
+		r->is_write = is_write;
+		r->first_block = next_block;
+		r->last_block = last_block - next_block >=
+			steps_per_region * step
+			? next_block + steps_per_region * step - 1
+			: last_block;
+		r->list = lists ? &lists[i] : NULL;
+		next_block = r->last_block + 1;
+		if (pthread_create(&r->thread, NULL, region_thread, r))
+			errx(1, "Can't create a thread to test blocks");
+	}
+
+	for (i = 0; i < n; i++)
+		assert(!pthread_join(regions[i].thread, NULL));
+}
+
+static void discard_blocks(struct device *dev, enum discard_type type,
 	uint64_t first_block, uint64_t last_block)
+{
+	int rc;
+
+	printf("Discarding (%s) blocks from 0x%" PRIx64 " to 0x%" PRIx64
+		"...", discard_type_to_name(type), first_block, last_block);
+	fflush(stdout);
+	rc = dev_discard_blocks(dev, first_block, last_block, type);
+	if (rc == EOPNOTSUPP)
+		printf(" Not supported by the device, so skipped\n\n");
+	else if (rc)
+		printf(" Failed: %s\n\n", strerror(rc));
+	else
+		printf(" Done\n\n");
+}
+
+/* XXX Properly handle return errors. */
+static void test_write_blocks(struct device *dev, int depth, int jobs,
+	struct arena **arenas, uint64_t first_block, uint64_t last_block)
+{
+	printf("Writing blocks from 0x%" PRIx64 " to 0x%" PRIx64 "...",
+		first_block, last_block);
+	fflush(stdout);
+	if (jobs > 1)
+		test_regions(dev, depth, jobs, arenas, true, first_block,
+			last_block, NULL);
+	else
+		write_blocks(dev, depth, arenas[0], first_block, last_block);
+	if (dev_flush(dev))
+		warn("Failed to flush the written blocks");
+	printf(" Done\n\n");
+}
+
+/* Print the ranges of the regions of @lists in order, and free them.
+ * Ranges across the border of two regions are merged, so the output is
+ * the same as the one of a single scan.
+ */
+static void print_regions(struct range_list *lists, int jobs,
+	int block_order)
+{
+	struct block_range range = {
+		.state = bs_unknown,
+		.block_order = block_order,
+		.start_sector_offset = 0,
+		.end_sector_offset = 0,
+		.found_sector_offset = 0,
+	};
+	int i, j;
+
+	for (i = 0; i < jobs; i++) {
+		for (j = 0; j < lists[i].n; j++) {
+			const struct block_range *r = &lists[i].ranges[j];
+			add_run(&range, NULL, r->state, r->start_sector_offset,
+				r->end_sector_offset, r->found_sector_offset);
+		}
+		free(lists[i].ranges);
+	}
+	if (range.state != bs_unknown)
+		print_block_range(&range);
+}
+
+/* XXX Properly handle return errors. */
+static void test_read_blocks(struct device *dev, int depth, int jobs,
+	struct arena **arenas, uint64_t first_block, uint64_t last_block)
 {
 	printf("Reading blocks from 0x%" PRIx64 " to 0x%" PRIx64 ":\n",
 		first_block, last_block);
-	read_blocks(dev, first_block, last_block);
+	if (jobs > 1) {
+		struct range_list lists[MAX_JOBS];
+		memset(lists, 0, sizeof(lists));
+		test_regions(dev, depth, jobs, arenas, false, first_block,
+			last_block, lists);
+		print_regions(lists, jobs, dev_get_block_order(dev));
+	} else {
+		read_blocks(dev, depth, arenas[0], first_block, last_block,
+			NULL);
+	}
 	printf("\n");
 }
 
@@ -422,6 +755,11 @@ int main(int argc, char **argv)
 		.reset_type	= RT_MANUAL_USB,
 		.test_write	= true,
 		.test_read	= true,
+		.queue_depth	= 4,
+		.jobs		= 1,
+		.pattern	= PATTERN_V1,
+		.arena_flags	= 0,
+		.discard	= -1,
 		.real_size_byte	= 1ULL << 31,
 		.fake_size_byte	= 1ULL << 34,
 		.wrap		= 31,
@@ -432,11 +770,15 @@ int main(int argc, char **argv)
 		.last_block	= -1ULL,
 	};
 	struct device *dev;
+	/* The buffers of each job last for the whole run. */
+	struct arena *arenas[MAX_JOBS];
 	uint64_t very_last_block;
+	int i;
 
 	/* Read parameters. */
 	argp_parse(&argp, argc, argv, 0, NULL, &args);
 	print_header(stdout, "brew");
+	pattern_set_version(args.pattern);
 
 	dev = args.debug
 		? create_file_device(args.filename, args.real_size_byte,
@@ -457,8 +799,21 @@ int main(int argc, char **argv)
 	if (args.last_block > very_last_block)
 		args.last_block = very_last_block;
 
+	for (i = 0; i < args.jobs; i++) {
+		arenas[i] = create_arena(scan_arena_size(
+			dev_get_block_order(dev), args.queue_depth),
+			args.arena_flags);
+		if (!arenas[i])
+			err(errno, "Can't allocate buffers");
+	}
+
+	if (args.test_write && args.discard >= 0)
+		discard_blocks(dev, args.discard, args.first_block,
+			args.last_block);
+
 	if (args.test_write)
-		test_write_blocks(dev, args.first_block, args.last_block);
+		test_write_blocks(dev, args.queue_depth, args.jobs, arenas,
+			args.first_block, args.last_block);
 
 	if (args.test_write && args.test_read) {
 		const char *final_dev_filename;
@@ -471,8 +826,11 @@ int main(int argc, char **argv)
 	}
 
 	if (args.test_read)
-		test_read_blocks(dev, args.first_block, args.last_block);
+		test_read_blocks(dev, args.queue_depth, args.jobs, arenas,
+			args.first_block, args.last_block);
 
+	for (i = 0; i < args.jobs; i++)
+		free_arena(arenas[i]);
 	free_device(dev);
 	return 0;
 }
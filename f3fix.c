@@ -1,10 +1,13 @@
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <argp.h>
 #include <parted/parted.h>
 
 #include "version.h"
 #include "libutils.h"
+#include "libdevs.h"
 
 /* Argp's global variables. */
 const char *argp_program_version = "F3 Fix " F3_STR_VERSION;
@@ -29,6 +32,10 @@ static struct argp_option options[] = {
 		"Sector where the partition starts",			0},
 	{"last-sec",		'l',	"SEC-NUM",	0,
 		"Sector where the partition ends",			0},
+	{"discard",		'D',	"TYPE",		OPTION_ARG_OPTIONAL,
+		"Discard the sectors after --last-sec, so the drive "
+		"releases the area that it cannot store; "
+		"TYPE is plain (default) or secure",			0},
 	{"list-disk-types",	'k',	NULL,		0,
 		"List all supported disk types",			3},
 	{"list-fs-types",	's',	NULL,		0,
@@ -42,7 +49,10 @@ struct args {
 
 	bool	boot;
 
-	/* 29 free bytes. */
+	/* 1 free byte. */
+
+	/* An enum discard_type, or -1 to not discard. */
+	int	discard;
 
 	const char		*dev_filename;
 	PedDiskType		*disk_type;
@@ -109,6 +119,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->last_sec = ll;
 		break;
 
+	case 'D':
+		ll = arg ? discard_type_from_name(arg) : DISCARD_PLAIN;
+		if (ll < 0)
+			argp_error(state, "Unknown discard type `%s'", arg);
+		args->discard = ll;
+		break;
+
 	case 'k':
 		args->list_disk_types = true;
 		break;
@@ -120,6 +137,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case ARGP_KEY_INIT:
 		args->dev_filename = NULL;
 		args->last_sec = -1;
+		args->discard = -1;
 		break;
 
 	case ARGP_KEY_ARG:
@@ -247,6 +265,48 @@ out:
 	return ret;
 }
 
+/* Discard the blocks of @filename that come after sector @last_sec.
+ *
+ * This runs before the partition table is written because the blocks
+ * of the fake area of some drives wrap onto the real area, so
+ * the table would be discarded as well.
+ */
+static void discard_fake_area(const char *filename, PedSector last_sec,
+	enum discard_type type)
+{
+	struct device *dev;
+	uint64_t first_pos, end_pos;
+	int block_order, ret;
+
+	dev = create_block_device(filename, RT_NONE);
+	if (!dev) {
+		fprintf(stderr, "Skipping the discard of `%s'\n", filename);
+		return;
+	}
+
+	block_order = dev_get_block_order(dev);
+	/* Round up to spare the block of @last_sec. */
+	first_pos = (((uint64_t)last_sec + 1) * 512 + (1 << block_order) - 1)
+		>> block_order;
+	end_pos = dev_get_size_byte(dev) >> block_order;
+	if (first_pos >= end_pos)
+		goto out;
+
+	printf("Discarding (%s) the sectors after sector %lli...",
+		discard_type_to_name(type), (long long)last_sec);
+	fflush(stdout);
+	ret = dev_discard_blocks(dev, first_pos, end_pos - 1, type);
+	if (!ret)
+		printf(" Done\n");
+	else if (ret == EOPNOTSUPP)
+		printf(" Not supported by the drive, so skipped\n");
+	else
+		printf(" Failed: %s\n", strerror(ret));
+
+out:
+	free_device(dev);
+}
+
 int main (int argc, char *argv[])
 {
 	struct args args = {
@@ -281,6 +341,10 @@ int main (int argc, char *argv[])
 		return 0;
 	}
 
+	if (args.discard >= 0)
+		discard_fake_area(args.dev_filename, args.last_sec,
+			args.discard);
+
 	/* XXX If @dev is a partition, refer the user to
 	 * the disk of this partition.
 	 */
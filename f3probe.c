@@ -7,21 +7,28 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <err.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "version.h"
 #include "libprobe.h"
+#include "libpattern.h"
 #include "libutils.h"
+#include "libjournal.h"
+#include "libarena.h"
 
 /* Argp's global variables. */
 const char *argp_program_version = "F3 Probe " F3_STR_VERSION;
 
 /* Arguments. */
-static char adoc[] = "<DISK_DEV>";
+static char adoc[] = "<DISK_DEV>...";
 
-static char doc[] = "F3 Probe -- probe a block device for "
+static char doc[] = "F3 Probe -- probe block devices for "
 	"counterfeit flash memory. If counterfeit, "
-	"f3probe identifies the fake type and real memory size";
+	"f3probe identifies the fake type and real memory size. "
+	"Multiple devices are probed in parallel";
 
 static struct argp_option options[] = {
 	{"debug",		'd',	NULL,		OPTION_HIDDEN,
@@ -42,7 +49,16 @@ static struct argp_option options[] = {
 	{"debug-keep-file",	'k',	NULL,		OPTION_HIDDEN,
 		"Don't remove file used for emulating the drive",	0},
 	{"debug-unit-test",	'u',	NULL,		OPTION_HIDDEN,
-		"Run a unit test; it ignores all other debug options",	0},
+		"Run a unit test; it ignores all other debug options "
+		"but --debug-memory",					0},
+	{"debug-benchmark",	'B',	NULL,		OPTION_HIDDEN,
+		"Probe a matrix of drives emulated in memory, and report "
+		"the cost of each probe as tab-separated values",	0},
+	{"debug-memory",	'm',	NULL,		OPTION_HIDDEN,
+		"Emulate the drive in memory instead of a file",	0},
+	{"debug-latency",	'L',	"R,W,Z,F",	OPTION_HIDDEN,
+		"Latencies in microseconds of the drive emulated in memory: "
+		"read and write per block, reset, and flush",		0},
 	{"destructive",		'n',	NULL,		0,
 		"Do not restore blocks of the device after probing it",	2},
 	{"min-memory",		'l',	NULL,		0,
@@ -51,23 +67,53 @@ static struct argp_option options[] = {
 		"Reset method to use during the probe",		0},
 	{"time-ops",		't',	NULL,		0,
 		"Time reads, writes, and resets",		0},
+	{"strategy",		'S',	"NAME",		0,
+		"How bisections choose the number of blocks written "
+		"per pass: heuristic (default) or cost-model, which "
+		"fits the costs of the operations",		0},
+	{"pattern",		'P',	"VERSION",	0,
+		"Version of the test pattern: v1 (default) or v2",	0},
+	{"journal",		'j',	"FILE",		0,
+		"Record the progress in FILE, and resume from it; "
+		"requires --destructive",			0},
+	{"hugepages",		'H',	NULL,		0,
+		"Back the I/O buffers with huge pages",		0},
+	{"numa-local",		'N',	NULL,		0,
+		"Place the I/O buffers of each device in the memory "
+		"next to the thread that probes it",		0},
+	{"discard",		'D',	"TYPE",		OPTION_ARG_OPTIONAL,
+		"Discard the blocks of the drive before probing it, so "
+		"probes start from the same state; TYPE is plain (default) "
+		"or secure; requires --destructive",		0},
 	{ 0 }
 };
 
 struct args {
-	char		*filename;
+	char		**filenames;
+	int		n_devs;
 
 	/* Debugging options. */
 	bool		debug;
 	bool		unit_test;
+	bool		benchmark;
 	bool		keep_file;
+	bool		memory;
+	struct mem_latency latency;
 
 	/* Behavior options. */
 	bool		save;
 	bool		min_mem;
 	enum reset_type	reset_type;
 	bool		time_ops;
-	/* 1 free bytes. */
+	/* 3 free bytes. */
+	enum probe_strategy strategy;
+	enum pattern_version pattern;
+	/* 4 free bytes. */
+	const char	*journal_filename;
+	/* Flags of create_arena(). */
+	int		arena_flags;
+	/* An enum discard_type, or -1 to not discard. */
+	int		discard;
 
 	/* Geometry. */
 	uint64_t	real_size_byte;
@@ -147,6 +193,31 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->unit_test = true;
 		break;
 
+	case 'B':
+		args->benchmark = true;
+		break;
+
+	case 'm':
+		args->memory = true;
+		args->debug = true;
+		break;
+
+	case 'L': {
+		unsigned long long r, w, z, f;
+		char c;
+		if (sscanf(arg, "%llu,%llu,%llu,%llu%c",
+			&r, &w, &z, &f, &c) != 4)
+			argp_error(state,
+				"Latencies must be four integers separated by commas");
+		args->latency.read_ns = r * 1000;
+		args->latency.write_ns = w * 1000;
+		args->latency.reset_ns = z * 1000;
+		args->latency.flush_ns = f * 1000;
+		args->memory = true;
+		args->debug = true;
+		break;
+	}
+
 	case 'n':
 		args->save = false;
 		break;
@@ -168,22 +239,72 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->time_ops = true;
 		break;
 
+	case 'S':
+		ll = probe_strategy_from_name(arg);
+		if (ll < 0)
+			argp_error(state, "Unknown strategy `%s'", arg);
+		args->strategy = ll;
+		break;
+
+	case 'j':
+		args->journal_filename = arg;
+		break;
+
+	case 'H':
+		args->arena_flags |= ARENA_HUGEPAGE;
+		break;
+
+	case 'N':
+		args->arena_flags |= ARENA_LOCAL;
+		break;
+
+	case 'D':
+		ll = arg ? discard_type_from_name(arg) : DISCARD_PLAIN;
+		if (ll < 0)
+			argp_error(state, "Unknown discard type `%s'", arg);
+		args->discard = ll;
+		break;
+
+	case 'P':
+		ll = pattern_version_from_name(arg);
+		if (ll < 0)
+			argp_error(state, "Unknown pattern version `%s'", arg);
+		args->pattern = ll;
+		break;
+
 	case ARGP_KEY_INIT:
-		args->filename = NULL;
+		args->filenames = NULL;
+		args->n_devs = 0;
 		break;
 
-	case ARGP_KEY_ARG:
-		if (args->filename)
-			argp_error(state,
-				"Wrong number of arguments; only one is allowed");
-		args->filename = arg;
+	case ARGP_KEY_ARGS:
+		args->filenames = state->argv + state->next;
+		args->n_devs = state->argc - state->next;
 		break;
 
 	case ARGP_KEY_END:
-		if (!args->filename)
+		/* The benchmark emulates its own drives. */
+		if (!args->n_devs && !args->benchmark)
 			argp_error(state,
 				"The disk device was not specified");
-		if (args->debug &&
+		if (args->unit_test && args->n_devs > 1)
+			argp_error(state,
+				"The unit test takes only one file");
+		/* The blocks saved during a probe are lost when
+		 * the probe is interrupted.
+		 */
+		if (args->journal_filename && args->save)
+			argp_error(state,
+				"Option --journal requires option --destructive");
+		if (args->journal_filename && args->n_devs > 1)
+			argp_error(state,
+				"Option --journal takes only one device");
+		/* Discarded blocks cannot be restored. */
+		if (args->discard >= 0 && args->save)
+			argp_error(state,
+				"Option --discard requires option --destructive");
+		/* The unit test has its own parameters. */
+		if (args->debug && !args->unit_test &&
 			!dev_param_valid(args->real_size_byte,
 				args->fake_size_byte, args->wrap,
 				args->block_order))
@@ -246,7 +367,25 @@ static const struct unit_test_item ftype_to_params[] = {
 #define UNIT_TEST_N_CASES \
 	((int)(sizeof(ftype_to_params)/sizeof(struct unit_test_item)))
 
-static int unit_test(const char *filename)
+/* Return true if the outcome of a probe matches the drive @item. */
+static int probe_is_perfect(const struct unit_test_item *item,
+	uint64_t real_size_byte, uint64_t announced_size_byte, int wrap,
+	uint64_t cache_size_block, int need_reset, int block_order)
+{
+	uint64_t item_cache_byte = item->cache_order < 0 ? 0 :
+		1ULL << (item->cache_order + item->block_order);
+	return real_size_byte == item->real_size_byte &&
+		announced_size_byte == item->fake_size_byte &&
+		wrap == item->wrap &&
+		/* probe_device() returns an upper bound of
+		 * the cache size.
+		 */
+		item_cache_byte <= (cache_size_block << block_order) &&
+		!need_reset &&
+		block_order == item->block_order;
+}
+
+static int unit_test(const struct args *args)
 {
 	int i, success = 0;
 	for (i = 0; i < UNIT_TEST_N_CASES; i++) {
@@ -268,13 +407,20 @@ static int unit_test(const char *filename)
 		int wrap, need_reset, block_order, max_probe_blocks;
 		struct device *dev;
 
-		dev = create_file_device(filename, item->real_size_byte,
-			item->fake_size_byte, item->wrap, item->block_order,
-			item->cache_order, item->strict_cache, false);
+		dev = args->memory
+			? create_memory_device(args->filenames[0],
+				item->real_size_byte, item->fake_size_byte,
+				item->wrap, item->block_order,
+				item->cache_order, item->strict_cache, NULL)
+			: create_file_device(args->filenames[0],
+				item->real_size_byte, item->fake_size_byte,
+				item->wrap, item->block_order,
+				item->cache_order, item->strict_cache, false);
 		assert(dev);
 		max_probe_blocks = probe_device_max_blocks(dev);
 		assert(!probe_device(dev, &real_size_byte, &announced_size_byte,
-			&wrap, &cache_size_block, &need_reset, &block_order));
+			&wrap, &cache_size_block, &need_reset, &block_order,
+			args->strategy, NULL, NULL, NULL));
 		free_device(dev);
 		fake_type = dev_param_to_type(real_size_byte,
 			announced_size_byte, wrap, block_order);
@@ -286,15 +432,8 @@ static int unit_test(const char *filename)
 			fake_type_to_name(origin_type),
 			f_real, unit_real, f_fake, unit_fake, item->wrap,
 			f_cache, unit_cache, item->block_order);
-		if (real_size_byte == item->real_size_byte &&
-			announced_size_byte == item->fake_size_byte &&
-			wrap == item->wrap &&
-			/* probe_device() returns an upper bound of
-			 * the cache size.
-			 */
-			item_cache_byte <= (cache_size_block << block_order) &&
-			!need_reset &&
-			block_order == item->block_order) {
+		if (probe_is_perfect(item, real_size_byte, announced_size_byte,
+			wrap, cache_size_block, need_reset, block_order)) {
 			success++;
 			printf("\t\tPerfect!\tMax # of probed blocks: %i\n\n",
 				max_probe_blocks);
@@ -323,47 +462,333 @@ static int unit_test(const char *filename)
 	return 0;
 }
 
-static void report_size(const char *prefix, uint64_t bytes, int block_order)
+/*
+ *	Benchmark
+ *
+ * The drives below are probed on the memory device, so the time of
+ * the probes is mostly time of the CPU. What a probe would cost on
+ * a real drive is simulated from the operations that it issues and
+ * the costs of a slow USB flash drive below.
+ *
+ * With --debug-latency, the memory device sleeps the latencies given,
+ * so the cost model of the probes sees them, and they replace
+ * the costs below in the simulation.
+ */
+
+#define BENCH_READ_NS_PER_KB	40000ULL	/* 25MB/s */
+#define BENCH_WRITE_NS_PER_KB	100000ULL	/* 10MB/s */
+#define BENCH_RESET_NS		1000000000ULL
+#define BENCH_FLUSH_NS		10000000ULL
+
+static const int bench_block_orders[] = {9, 12};
+/* Wraparound drives whose real size is below the largest cache
+ * that probe_device() looks for are taken for caches, so the real
+ * sizes below are at least 2GB.
+ */
+static const int bench_fake_orders[] = {34, 40};
+static const struct {
+	int	cache_order;
+	int	strict_cache;
+} bench_caches[] = {
+	{-1,	false},
+	{10,	true},
+	{16,	false},
+};
+
+#define BENCH_N(array)	((int)(sizeof(array) / sizeof((array)[0])))
+
+/* The types of fake drives in the order of enum fake_type. */
+#define BENCH_N_TYPES	FKTY_MAX
+
+/* Fill @item with the drive of type @type announcing 2^@fake_order
+ * bytes. The real sizes of limbo drives are not powers of two as
+ * those of real limbo drives.
+ */
+static void bench_drive(struct unit_test_item *item, enum fake_type type,
+	int fake_order)
+{
+	item->fake_size_byte = 1ULL << fake_order;
+	item->real_size_byte = 1ULL << (fake_order - 3);
+	item->wrap = fake_order;
+	switch (type) {
+	case FKTY_GOOD:
+		item->real_size_byte = item->fake_size_byte;
+		break;
+	case FKTY_BAD:
+		item->real_size_byte = 0;
+		break;
+	case FKTY_LIMBO:
+		item->real_size_byte += 1ULL << 20;
+		break;
+	case FKTY_WRAPAROUND:
+		item->wrap = fake_order - 3;
+		break;
+	case FKTY_CHAIN:
+		item->wrap = fake_order - 2;
+		break;
+	default:
+		assert(0);
+	}
+}
+
+/* Probe @item, print the row of case @n, and return false if
+ * the probe got the geometry of the drive wrong.
+ *
+ * Caches that never hold the only copy of a block, as those of
+ * good drives, can't be seen, so these probes are reported apart.
+ */
+static int bench_item(const struct unit_test_item *item,
+	enum probe_strategy strategy, const struct mem_latency *latency,
+	int n)
+{
+	struct device *dev, *pdev, *sdev;
+	uint64_t real_size_byte, announced_size_byte, cache_size_block;
+	int wrap, need_reset, block_order;
+	uint64_t read_count, write_count, reset_count, flush_count;
+	uint64_t sim_ns, sdev_byte;
+	struct timeval t1, t2;
+	struct unit_test_item no_cache;
+	const char *result;
+
+	dev = create_memory_device("benchmark", item->real_size_byte,
+		item->fake_size_byte, item->wrap, item->block_order,
+		item->cache_order, item->strict_cache, latency);
+	assert(dev);
+	pdev = create_perf_device(dev);
+	assert(pdev);
+	sdev = create_safe_device(pdev, probe_device_max_blocks(pdev), false);
+	assert(sdev);
+
+	assert(!gettimeofday(&t1, NULL));
+	assert(!probe_device(sdev, &real_size_byte, &announced_size_byte,
+		&wrap, &cache_size_block, &need_reset, &block_order,
+		strategy, NULL, NULL, NULL));
+	assert(!gettimeofday(&t2, NULL));
+
+	perf_device_sample(pdev, &read_count, NULL, &write_count, NULL,
+		&reset_count, NULL, &flush_count, NULL, NULL, NULL, NULL);
+	sdev_byte = sdev_used_memory_byte(sdev);
+	free_device(sdev);
+
+	sim_ns = latency
+		? read_count * latency->read_ns +
+			write_count * latency->write_ns +
+			reset_count * latency->reset_ns +
+			flush_count * latency->flush_ns
+		: ((read_count * BENCH_READ_NS_PER_KB +
+			write_count * BENCH_WRITE_NS_PER_KB) <<
+			item->block_order >> 10) +
+			reset_count * BENCH_RESET_NS +
+			flush_count * BENCH_FLUSH_NS;
+	no_cache = *item;
+	no_cache.cache_order = -1;
+	if (probe_is_perfect(item, real_size_byte, announced_size_byte,
+		wrap, cache_size_block, need_reset, block_order))
+		result = "ok";
+	else if (probe_is_perfect(&no_cache, real_size_byte,
+		announced_size_byte, wrap, cache_size_block, need_reset,
+		block_order))
+		result = "cache-unseen";
+	else
+		result = "wrong";
+
+	printf("%i\t%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%i\t%i\t%i\t%i"
+		"\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64
+		"\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+		n, probe_strategy_to_name(strategy),
+		fake_type_to_name(dev_param_to_type(item->real_size_byte,
+			item->fake_size_byte, item->wrap, item->block_order)),
+		item->real_size_byte, item->fake_size_byte, item->wrap,
+		item->block_order, item->cache_order, item->strict_cache,
+		sim_ns / 1000, diff_timeval_us(&t1, &t2),
+		read_count, write_count, reset_count, flush_count, sdev_byte,
+		result);
+	fflush(stdout);
+	return strcmp(result, "wrong");
+}
+
+/* Return the number of wrong probes, so scripts can tell that
+ * the benchmark failed.
+ * @latency is NULL to simulate the costs of the drive above.
+ */
+static int benchmark(const struct mem_latency *latency)
 {
-	double f = bytes;
-	const char *unit = adjust_unit(&f);
-	printf("%s %.2f %s (%" PRIu64 " blocks)\n", prefix, f, unit,
+	int b, f, t, c, s, n = 0, wrong = 0;
+
+	printf("# case\tstrategy\ttype\treal_size_byte\tfake_size_byte"
+		"\twrap\tblock_order\tcache_order\tstrict_cache"
+		"\tsim_time_us\twall_time_us\tread_blocks\twrite_blocks"
+		"\tresets\tflushes\tsaved_byte\tresult\n");
+	for (b = 0; b < BENCH_N(bench_block_orders); b++)
+	for (f = 0; f < BENCH_N(bench_fake_orders); f++)
+	for (t = 0; t < BENCH_N_TYPES; t++)
+	for (c = 0; c < BENCH_N(bench_caches); c++)
+	for (s = 0; s < PS_MAX; s++) {
+		struct unit_test_item item;
+		bench_drive(&item, t, bench_fake_orders[f]);
+		item.block_order = bench_block_orders[b];
+		item.cache_order = bench_caches[c].cache_order;
+		item.strict_cache = bench_caches[c].strict_cache;
+		wrong += !bench_item(&item, s, latency, ++n);
+	}
+	return wrong;
+}
+
+static void report_size(FILE *f, const char *prefix, uint64_t bytes,
+	int block_order)
+{
+	double d = bytes;
+	const char *unit = adjust_unit(&d);
+	fprintf(f, "%s %.2f %s (%" PRIu64 " blocks)\n", prefix, d, unit,
 		bytes >> block_order);
 }
 
-static void report_order(const char *prefix, int order)
+static void report_order(FILE *f, const char *prefix, int order)
 {
-	double f = (1ULL << order);
-	const char *unit = adjust_unit(&f);
-	printf("%s %.2f %s (2^%i Bytes)\n", prefix, f, unit, order);
+	double d = (1ULL << order);
+	const char *unit = adjust_unit(&d);
+	fprintf(f, "%s %.2f %s (2^%i Bytes)\n", prefix, d, unit, order);
 }
 
-static void report_cache(const char *prefix, uint64_t cache_size_block,
-	int need_reset, int order)
+static void report_cache(FILE *f, const char *prefix,
+	uint64_t cache_size_block, int need_reset, int order)
 {
-	double f = (cache_size_block << order);
-	const char *unit = adjust_unit(&f);
-	printf("%s %.2f %s (%" PRIu64 " blocks), need-reset=%s\n",
-		prefix, f, unit, cache_size_block,
+	double d = (cache_size_block << order);
+	const char *unit = adjust_unit(&d);
+	fprintf(f, "%s %.2f %s (%" PRIu64 " blocks), need-reset=%s\n",
+		prefix, d, unit, cache_size_block,
 		need_reset ? "yes" : "no");
 }
 
-static void report_probe_time(const char *prefix, uint64_t usec)
+static void report_probe_time(FILE *f, const char *prefix, uint64_t usec)
 {
 	char str[TIME_STR_SIZE];
 	usec_to_str(usec, str);
-	printf("%s %s\n", prefix, str);
+	fprintf(f, "%s %s\n", prefix, str);
 }
 
-static void report_ops(const char *op, uint64_t count, uint64_t time_us)
+static void report_ops(FILE *f, const char *op, uint64_t count,
+	uint64_t time_us)
 {
 	char str1[TIME_STR_SIZE], str2[TIME_STR_SIZE];
 	usec_to_str(time_us, str1);
 	usec_to_str(count > 0 ? time_us / count : 0, str2);
-	printf("%10s: %s / %" PRIu64 " = %s\n", op, str1, count, str2);
+	fprintf(f, "%10s: %s / %" PRIu64 " = %s\n", op, str1, count, str2);
 }
 
-static int test_device(struct args *args)
+static void report_lat(FILE *f, const char *op,
+	const struct lat_histogram *lat)
+{
+	char p50[TIME_STR_SIZE], p99[TIME_STR_SIZE], p999[TIME_STR_SIZE],
+		max[TIME_STR_SIZE];
+	usec_to_str(lat_percentile(lat, 0.5) / 1000, p50);
+	usec_to_str(lat_percentile(lat, 0.99) / 1000, p99);
+	usec_to_str(lat_percentile(lat, 0.999) / 1000, p999);
+	usec_to_str(lat->max / 1000, max);
+	fprintf(f, "%10s: %s / %s / %s / %s\n", op, p50, p99, p999, max);
+}
+
+/* Outcome of probing a device; see test_device(). */
+struct probe_result {
+	/* False if the device could not be probed. */
+	bool		probed;
+	enum fake_type	fake_type;
+	uint64_t	real_size_byte;
+	/* Exit code of f3probe if this were the only device. */
+	int		exit_code;
+};
+
+/* @x is either PRI or SCN. */
+#define CHECKPOINT_FORMAT(x) "checkpoint"				\
+	" %" x##u64 " %i %" x##u64 " %" x##u64 " %" x##u64		\
+	" %i %i %" x##u64 " %" x##u64 " %" x##u64 " %i"			\
+	" %i %i %" x##u64 " %" x##u64
+
+static void save_checkpoint(const struct probe_checkpoint *cp, void *arg)
+{
+	struct journal *journal = arg;
+	if (journal_append(journal, CHECKPOINT_FORMAT(PRI),
+		cp->dev_size_byte, cp->block_order, cp->salt, cp->rng,
+		cp->cache_size_block, cp->need_reset, cp->wrap, cp->reset_pos,
+		cp->left_pos, cp->right_pos, cp->in_bisect,
+		cp->stats.write_count, cp->stats.reset_count,
+		cp->stats.write_time_us, cp->stats.reset_time_us))
+		err(errno, "Can't update the journal");
+}
+
+/* Load into @cp the last checkpoint of the current probe in @journal.
+ * Return false if there is none.
+ */
+static int load_checkpoint(struct journal *journal,
+	struct probe_checkpoint *cp)
+{
+	char record[JOURNAL_MAX_RECORD];
+	struct probe_checkpoint c;
+	int found = false;
+
+	while (journal_next(journal, record)) {
+		/* A new probe starts after a finished one. */
+		if (!strcmp(record, "done")) {
+			found = false;
+			continue;
+		}
+		if (sscanf(record, CHECKPOINT_FORMAT(SCN),
+			&c.dev_size_byte, &c.block_order, &c.salt, &c.rng,
+			&c.cache_size_block, &c.need_reset, &c.wrap,
+			&c.reset_pos, &c.left_pos, &c.right_pos, &c.in_bisect,
+			&c.stats.write_count, &c.stats.reset_count,
+			&c.stats.write_time_us, &c.stats.reset_time_us) == 15) {
+			*cp = c;
+			found = true;
+		}
+	}
+	return found;
+}
+
+static int checkpoint_fits(const struct probe_checkpoint *cp,
+	struct device *dev)
+{
+	const int block_order = dev_get_block_order(dev);
+	const uint64_t first_pos = (1ULL << (20 - block_order)) - 1;
+	const uint64_t end_pos = dev_get_size_byte(dev) >> block_order;
+
+	return cp->dev_size_byte == dev_get_size_byte(dev) &&
+		cp->block_order == block_order &&
+		first_pos < cp->right_pos && cp->right_pos <= end_pos &&
+		(!cp->in_bisect || (first_pos <= cp->left_pos &&
+			cp->left_pos < cp->right_pos));
+}
+
+/* Discard all blocks of @dev but the first 1MB, which probe_device()
+ * never writes since it holds the partition table.
+ */
+static void discard_probe_blocks(struct device *dev, enum discard_type type,
+	FILE *f)
+{
+	const int block_order = dev_get_block_order(dev);
+	const uint64_t first_pos = (1ULL << 20) >> block_order;
+	const uint64_t end_pos = dev_get_size_byte(dev) >> block_order;
+	int ret;
+
+	if (first_pos >= end_pos)
+		return;
+
+	fprintf(f, "Discarding (%s) the blocks of the drive...",
+		discard_type_to_name(type));
+	fflush(f);
+	ret = dev_discard_blocks(dev, first_pos, end_pos - 1, type);
+	if (!ret)
+		fprintf(f, " Done\n\n");
+	else if (ret == EOPNOTSUPP)
+		fprintf(f, " Not supported by the drive, so skipped\n\n");
+	else
+		fprintf(f, " Failed: %s\n\n", strerror(ret));
+	fflush(f);
+}
+
+/* Probe device @filename, and write the report to @f. */
+static void test_device(const struct args *args, const char *filename,
+	FILE *f, struct probe_result *res)
 {
 	struct timeval t1, t2;
 	struct device *dev, *pdev, *sdev;
@@ -373,16 +798,30 @@ static int test_device(struct args *args)
 	uint64_t read_count, read_time_us;
 	uint64_t write_count, write_time_us;
 	uint64_t reset_count, reset_time_us;
+	uint64_t flush_count, flush_time_us;
+	struct lat_histogram read_lat, write_lat, reset_lat;
 	const char *final_dev_filename;
+	struct journal *journal;
+	struct probe_checkpoint cp;
+	const struct probe_checkpoint *resume;
 
-	dev = args->debug
-		? create_file_device(args->filename, args->real_size_byte,
+	res->probed = false;
+	res->exit_code = 1;
+
+	if (!args->debug)
+		dev = create_block_device(filename, args->reset_type);
+	else if (args->memory)
+		dev = create_memory_device(filename, args->real_size_byte,
+			args->fake_size_byte, args->wrap, args->block_order,
+			args->cache_order, args->strict_cache, &args->latency);
+	else
+		dev = create_file_device(filename, args->real_size_byte,
 			args->fake_size_byte, args->wrap, args->block_order,
-			args->cache_order, args->strict_cache, args->keep_file)
-		: create_block_device(args->filename, args->reset_type);
+			args->cache_order, args->strict_cache, args->keep_file);
 	if (!dev) {
-		fprintf(stderr, "\nApplication cannot continue, finishing...\n");
-		exit(1);
+		fprintf(stderr, "\nCannot probe device `%s'\n",
+			filename);
+		return;
 	}
 
 	if (args->time_ops) {
@@ -404,26 +843,62 @@ static int test_device(struct args *args)
 			else
 				fprintf(stderr, "Out of memory, try `f3probe --destructive %s'\nPlease back your data up before using option --destructive.\nAlternatively, you could use a machine with more memory to run f3probe.\n",
 					dev_get_filename(dev));
-			exit(1);
+			free_device(dev);
+			return;
 		}
 		dev = sdev;
 	}
+	/* The arena is created when the probe starts, that is,
+	 * in the thread that probes @dev.
+	 */
+	dev_set_arena_flags(dev, args->arena_flags);
+
+	journal = NULL;
+	resume = NULL;
+	if (args->journal_filename) {
+		journal = open_journal(args->journal_filename, "f3probe");
+		if (!journal) {
+			fprintf(stderr, "\nCannot open journal `%s': %s\n",
+				args->journal_filename, strerror(errno));
+			free_device(dev);
+			return;
+		}
+		if (!load_checkpoint(journal, &cp)) {
+			/* Nothing to resume. */
+		} else if (checkpoint_fits(&cp, dev)) {
+			resume = &cp;
+			fprintf(f, "Resuming the probe from journal %s\n\n",
+				args->journal_filename);
+		} else {
+			fprintf(f, "Journal %s does not fit `%s', so the probe starts over\n\n",
+				args->journal_filename, filename);
+		}
+		fflush(f);
+	}
 
-	printf("WARNING: Probing normally takes from a few seconds to 15 minutes, but\n");
-	printf("         it can take longer. Please be patient.\n\n");
+	if (args->discard >= 0 && !resume)
+		discard_probe_blocks(dev, args->discard, f);
 
 	assert(!gettimeofday(&t1, NULL));
 	/* XXX Have a better error handling to recover
 	 * the state of the drive.
 	 */
 	assert(!probe_device(dev, &real_size_byte, &announced_size_byte,
-		&wrap, &cache_size_block, &need_reset, &block_order));
+		&wrap, &cache_size_block, &need_reset, &block_order,
+		args->strategy, resume, journal ? save_checkpoint : NULL,
+		journal));
 	assert(!gettimeofday(&t2, NULL));
 
+	if (journal) {
+		if (journal_append(journal, "done"))
+			err(errno, "Can't update the journal");
+		close_journal(journal);
+	}
+
 	if (!args->debug && args->reset_type == RT_MANUAL_USB) {
-		printf("CAUTION\t\tCAUTION\t\tCAUTION\n");
-		printf("No more resets are needed, so do not unplug the drive\n");
-		fflush(stdout);
+		fprintf(f, "CAUTION\t\tCAUTION\t\tCAUTION\n");
+		fprintf(f, "No more resets are needed, so do not unplug the drive\n");
+		fflush(f);
 	}
 
 	/* Keep free_device() as close of probe_device() as possible to
@@ -434,16 +909,18 @@ static int test_device(struct args *args)
 		perf_device_sample(pdev,
 			&read_count, &read_time_us,
 			&write_count, &write_time_us,
-			&reset_count, &reset_time_us);
+			&reset_count, &reset_time_us,
+			&flush_count, &flush_time_us,
+			&read_lat, &write_lat, &reset_lat);
 	if (sdev) {
 		uint64_t very_last_pos = real_size_byte >> block_order;
-		printf("Probe finished, recovering blocks...");
-		fflush(stdout);
+		fprintf(f, "Probe finished, recovering blocks...");
+		fflush(f);
 		if (very_last_pos > 0) {
 			very_last_pos--;
 			sdev_recover(sdev, very_last_pos);
 		}
-		printf(" Done\n");
+		fprintf(f, " Done\n");
 		sdev_flush(sdev);
 	}
 
@@ -452,22 +929,22 @@ static int test_device(struct args *args)
 	free_device(dev);
 
 	if (args->save || (!args->debug && args->reset_type == RT_MANUAL_USB))
-		printf("\n");
+		fprintf(f, "\n");
 
-	if (strcmp(args->filename, final_dev_filename))
-		printf("WARNING: device `%s' moved to `%s' due to the resets\n\n",
-			args->filename, final_dev_filename);
+	if (strcmp(filename, final_dev_filename))
+		fprintf(f, "WARNING: device `%s' moved to `%s' due to the resets\n\n",
+			filename, final_dev_filename);
 
 	fake_type = dev_param_to_type(real_size_byte, announced_size_byte,
 		wrap, block_order);
 	switch (fake_type) {
 	case FKTY_GOOD:
-		printf("Good news: The device `%s' is the real thing\n",
+		fprintf(f, "Good news: The device `%s' is the real thing\n",
 			final_dev_filename);
 		break;
 
 	case FKTY_BAD:
-		printf("Bad news: The device `%s' is damaged\n",
+		fprintf(f, "Bad news: The device `%s' is damaged\n",
 			final_dev_filename);
 		break;
 
@@ -476,7 +953,7 @@ static int test_device(struct args *args)
 	case FKTY_CHAIN: {
 		uint64_t last_good_sector = (real_size_byte >> 9) - 1;
 		assert(block_order >= 9);
-		printf("Bad news: The device `%s' is a counterfeit of type %s\n\n"
+		fprintf(f, "Bad news: The device `%s' is a counterfeit of type %s\n\n"
 			"You can \"fix\" this device using the following command:\n"
 			"f3fix --last-sec=%" PRIu64 " %s\n",
 			final_dev_filename, fake_type_to_name(fake_type),
@@ -489,35 +966,128 @@ static int test_device(struct args *args)
 		break;
 	}
 
-	printf("\nDevice geometry:\n");
-	  report_size("\t         *Usable* size:", real_size_byte,
+	fprintf(f, "\nDevice geometry:\n");
+	  report_size(f, "\t         *Usable* size:", real_size_byte,
 		block_order);
-	  report_size("\t        Announced size:", announced_size_byte,
+	  report_size(f, "\t        Announced size:", announced_size_byte,
 		block_order);
-	 report_order("\t                Module:", wrap);
-	 report_cache("\tApproximate cache size:", cache_size_block,
+	 report_order(f, "\t                Module:", wrap);
+	 report_cache(f, "\tApproximate cache size:", cache_size_block,
 		need_reset, block_order);
-	 report_order("\t   Physical block size:", block_order);
-	report_probe_time("\nProbe time:", diff_timeval_us(&t1, &t2));
+	 report_order(f, "\t   Physical block size:", block_order);
+	report_probe_time(f, "\nProbe time:", diff_timeval_us(&t1, &t2));
 
 	if (args->time_ops) {
-		printf(" Operation: total time / count = avg time\n");
-		report_ops("Read", read_count, read_time_us);
-		report_ops("Write", write_count, write_time_us);
-		report_ops("Reset", reset_count, reset_time_us);
+		fprintf(f, " Operation: total time / count = avg time\n");
+		report_ops(f, "Read", read_count, read_time_us);
+		report_ops(f, "Write", write_count, write_time_us);
+		report_ops(f, "Reset", reset_count, reset_time_us);
+		report_ops(f, "Flush", flush_count, flush_time_us);
+		fprintf(f, "\n Operation: latency per block p50 / p99 / p99.9 / max\n");
+		report_lat(f, "Read", &read_lat);
+		report_lat(f, "Write", &write_lat);
+		report_lat(f, "Reset", &reset_lat);
 	}
 
 	free((void *)final_dev_filename);
-	return fake_type == FKTY_GOOD ? 0 : 100 + fake_type;
+	res->probed = true;
+	res->fake_type = fake_type;
+	res->real_size_byte = real_size_byte;
+	res->exit_code = fake_type == FKTY_GOOD ? 0 : 100 + fake_type;
+}
+
+struct probe_job {
+	const struct args	*args;
+	const char		*filename;
+	pthread_t		thread;
+
+	/* The report is kept in memory until all probes finish. */
+	FILE			*f;
+	char			*report;
+	size_t			report_size;
+
+	struct probe_result	res;
+};
+
+static void *probe_thread(void *arg)
+{
+	struct probe_job *job = arg;
+	test_device(job->args, job->filename, job->f, &job->res);
+	return NULL;
+}
+
+static void print_summary(const struct probe_job *jobs, int n)
+{
+	int i;
+
+	printf("SUMMARY:\n");
+	for (i = 0; i < n; i++) {
+		const struct probe_result *res = &jobs[i].res;
+		double f = res->real_size_byte;
+		const char *unit = adjust_unit(&f);
+
+		printf("\t%s: ", jobs[i].filename);
+		if (!res->probed)
+			printf("not probed\n");
+		else if (res->fake_type == FKTY_GOOD)
+			printf("good, %.2f %s\n", f, unit);
+		else
+			printf("%s, *usable* size %.2f %s\n",
+				fake_type_to_name(res->fake_type), f, unit);
+	}
+}
+
+/* Probe all devices at once, one thread per device.
+ * The exit code is the one of the first device that is not good.
+ */
+static int test_devices(const struct args *args)
+{
+	struct probe_job *jobs;
+	int i, exit_code = 0;
+
+	jobs = calloc(args->n_devs, sizeof(*jobs));
+	assert(jobs);
+
+	printf("Probing %i devices in parallel...\n\n", args->n_devs);
+	fflush(stdout);
+	for (i = 0; i < args->n_devs; i++) {
+		struct probe_job *job = &jobs[i];
+		job->args = args;
+		job->filename = args->filenames[i];
+		job->f = open_memstream(&job->report, &job->report_size);
+		assert(job->f);
+		if (pthread_create(&job->thread, NULL, probe_thread, job))
+			errx(1, "Can't create a thread to probe `%s'",
+				job->filename);
+	}
+
+	for (i = 0; i < args->n_devs; i++) {
+		struct probe_job *job = &jobs[i];
+		assert(!pthread_join(job->thread, NULL));
+		assert(!fclose(job->f));
+
+		printf("==> %s <==\n%s\n", job->filename, job->report);
+		free(job->report);
+		if (!exit_code)
+			exit_code = job->res.exit_code;
+	}
+
+	print_summary(jobs, args->n_devs);
+	free(jobs);
+	return exit_code;
 }
 
 int main(int argc, char **argv)
 {
+	struct probe_result res;
 	struct args args = {
 		/* Defaults. */
 		.debug		= false,
 		.unit_test	= false,
+		.benchmark	= false,
 		.keep_file	= false,
+		.memory		= false,
+		.latency	= { 0, 0, 0, 0 },
 		.save		= true,
 		.min_mem	= false,
 
@@ -539,6 +1109,11 @@ int main(int argc, char **argv)
 		.reset_type	= RT_NONE,
 
 		.time_ops	= false,
+		.strategy	= PS_HEURISTIC,
+		.pattern	= PATTERN_V1,
+		.journal_filename = NULL,
+		.arena_flags	= 0,
+		.discard	= -1,
 		.real_size_byte	= 1ULL << 31,
 		.fake_size_byte	= 1ULL << 34,
 		.wrap		= 31,
@@ -549,9 +1124,25 @@ int main(int argc, char **argv)
 
 	/* Read parameters. */
 	argp_parse(&argp, argc, argv, 0, NULL, &args);
+	pattern_set_version(args.pattern);
+
+	/* Keep the output of the benchmark machine readable. */
+	if (args.benchmark)
+		return !!benchmark(args.latency.read_ns ||
+			args.latency.write_ns || args.latency.reset_ns ||
+			args.latency.flush_ns ? &args.latency : NULL);
+
 	print_header(stdout, "probe");
 
 	if (args.unit_test)
-		return unit_test(args.filename);
-	return test_device(&args);
+		return unit_test(&args);
+
+	printf("WARNING: Probing normally takes from a few seconds to 15 minutes, but\n");
+	printf("         it can take longer. Please be patient.\n\n");
+
+	if (args.n_devs > 1)
+		return test_devices(&args);
+
+	test_device(&args, args.filenames[0], stdout, &res);
+	return res.exit_code;
 }
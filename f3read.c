@@ -7,6 +7,8 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <limits.h>
+#include <math.h>
+#include <time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -20,6 +22,10 @@
 
 #include "utils.h"
 #include "libflow.h"
+#include "libpattern.h"
+#include "libverify.h"
+#include "libjournal.h"
+#include "libarena.h"
 #include "version.h"
 
 /* Argp's global variables. */
@@ -40,6 +46,45 @@ static struct argp_option options[] = {
 		"Maximum read rate",					0},
 	{"show-progress",	'p',	"NUM",		0,
 		"Show progress if NUM is not zero",			0},
+	{"threads",		't',	"NUM",		0,
+		"Number of threads checking data; 0 means none",	0},
+	{"direct",		'd',	NULL,		0,
+		"Bypass the page cache when reading files",		0},
+	{"hugepages",		'H',	NULL,		0,
+		"Back the I/O buffers with huge pages",			0},
+	{"mmap",		'm',	NULL,		0,
+		"Check files through memory mappings instead of copies",
+									0},
+	{"raw",			'R',	NULL,		0,
+		"Read PATH as a device written by f3write --raw; "
+		"file NUM is then the NUMth region of the device",	0},
+	{"file-size",		'z',	"MB",		0,
+		"Size of the files, or regions, given to f3write; "
+		"the default comes from the files, or is 1024 for "
+		"regions",						0},
+	{"pattern",		'P',	"VERSION",	0,
+		"Version of the test pattern: v1 (default) or v2; "
+		"it must be the version given to f3write",		0},
+	{"journal",		'j',	"FILE",		0,
+		"Record validated files in FILE, and resume from it",	0},
+	{"sample",		'S',	"PERCENT",	0,
+		"Only read a random PERCENT of every file, and estimate "
+		"the results with confidence intervals",		0},
+	{"time-budget",		'B',	"SECONDS",	0,
+		"Stop sampling after SECONDS; implies --sample=100 "
+		"if --sample is not given",				0},
+	{"fail-threshold",	'T',	"PERCENT",	0,
+		"Stop sampling as soon as more than PERCENT of the data "
+		"is certainly lost; implies --sample=100 if --sample "
+		"is not given",						0},
+	{"flow",		'c',	"NAME",		0,
+		"How chunks between speed measurements are sized: "
+		"classic (default) or smooth, which flushes less often",
+									0},
+	{"stats-file",		'f',	"FILE",		0,
+		"Record every speed measurement into FILE",		0},
+	{"stats-format",	'F',	"FORMAT",	0,
+		"Format of the records: csv (default) or json",		0},
 	{ 0 }
 };
 
@@ -48,9 +93,46 @@ struct args {
 	long        end_at;
 	long        max_read_rate;
 	int	    show_progress;
+	int	    threads;
+	int	    direct;
+	/* Flags of create_arena(). */
+	int	    arena_flags;
+	int	    mmap;
+	int	    raw;
+	uint64_t    file_size;
+	int	    pattern;
+	/* Sampling; see sample_files(). */
+	double	    sample;
+	long	    time_budget;
+	double	    fail_threshold;
+	const char  *stats_filename;
+	int	    stats_format;
+	int	    flow;
+	const char  *journal_filename;
 	const char  *dev_path;
 };
 
+/* Return @arg as a percentage from 0 to 100. */
+static double arg_to_percent(const struct argp_state *state, const char *arg)
+{
+	char *end;
+	double d;
+
+	errno = 0;
+	d = strtod(arg, &end);
+	if (errno || end == arg || *end || !(d >= 0 && d <= 100))
+		argp_error(state,
+			"PERCENT must be a number from 0 to 100; `%s' is not",
+			arg);
+	return d;
+}
+
+static inline int is_sampling(const struct args *args)
+{
+	return args->sample > 0 || args->time_budget > 0 ||
+		args->fail_threshold >= 0;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct args *args = state->input;
@@ -85,6 +167,88 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->show_progress = !!arg_to_long(state, arg);
 		break;
 
+	case 't':
+		l = arg_to_long(state, arg);
+		if (l < 0 || l > MAX_THREADS)
+			argp_error(state,
+				"NUM must be in the interval [0, %i]",
+				MAX_THREADS);
+		args->threads = l;
+		break;
+
+	case 'd':
+		args->direct = true;
+		break;
+
+	case 'H':
+		args->arena_flags |= ARENA_HUGEPAGE;
+		break;
+
+	case 'm':
+		args->mmap = true;
+		break;
+
+	case 'R':
+		args->raw = true;
+		break;
+
+	case 'z':
+		l = arg_to_long(state, arg);
+		if (l <= 0 || l > MAX_FILE_SIZE_MB)
+			argp_error(state,
+				"MB must be in the interval [1, %i]",
+				MAX_FILE_SIZE_MB);
+		args->file_size = (uint64_t)l << 20;
+		break;
+
+	case 'j':
+		args->journal_filename = arg;
+		break;
+
+	case 'f':
+		args->stats_filename = arg;
+		break;
+
+	case 'F':
+		l = flow_stats_format_from_name(arg);
+		if (l < 0)
+			argp_error(state, "Unknown format `%s'", arg);
+		args->stats_format = l;
+		break;
+
+	case 'S':
+		args->sample = arg_to_percent(state, arg);
+		if (args->sample <= 0)
+			argp_error(state,
+				"PERCENT must be greater than zero");
+		break;
+
+	case 'B':
+		l = arg_to_long(state, arg);
+		if (l <= 0)
+			argp_error(state,
+				"SECONDS must be greater than zero");
+		args->time_budget = l;
+		break;
+
+	case 'T':
+		args->fail_threshold = arg_to_percent(state, arg);
+		break;
+
+	case 'c':
+		l = flow_controller_from_name(arg);
+		if (l < 0)
+			argp_error(state, "Unknown flow `%s'", arg);
+		args->flow = l;
+		break;
+
+	case 'P':
+		l = pattern_version_from_name(arg);
+		if (l < 0)
+			argp_error(state, "Unknown pattern version `%s'", arg);
+		args->pattern = l;
+		break;
+
 	case ARGP_KEY_INIT:
 		args->dev_path = NULL;
 		break;
@@ -103,6 +267,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		if (args->start_at > args->end_at)
 			argp_error(state,
 				"Option --start-at must be less or equal to option --end-at");
+		if (args->mmap && (args->threads > 0 || args->direct))
+			argp_error(state,
+				"Option --mmap cannot be combined with options --threads and --direct");
+		if (is_sampling(args) && (args->threads > 0 || args->mmap ||
+			args->journal_filename))
+			argp_error(state,
+				"Sampling cannot be combined with options --threads, --mmap, and --journal");
 		break;
 
 	default:
@@ -113,256 +284,214 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, adoc, doc, NULL, NULL, NULL};
 
-struct file_stats {
-	uint64_t secs_ok;
-	uint64_t secs_corrupted;
-	uint64_t secs_changed;
-	uint64_t secs_overwritten;
+/* Result of a file validated by a previous session. */
+struct journaled_file {
+	long			number;
+	int			saved_errno;
+	struct file_stats	stats;
+};
 
-	uint64_t bytes_read;
-	int read_all;
+struct journaled_files {
+	struct journaled_file	*files;
+	long			count;
+	/* Size of the files when the journal was started, or zero. */
+	uint64_t		file_size;
 };
 
-static inline void zero_fstats(struct file_stats *stats)
+/* To be used with qsort(3) and bsearch(3). */
+static int cmp_journaled_files(const void *p1, const void *p2)
 {
-	memset(stats, 0, sizeof(*stats));
+	long n1 = ((const struct journaled_file *)p1)->number;
+	long n2 = ((const struct journaled_file *)p2)->number;
+	return n1 < n2 ? -1 : n1 > n2;
 }
 
-#define TOLERANCE	2
-
-static void check_sector(char *_sector, uint64_t expected_offset,
-	struct file_stats *stats)
+static void load_journal(struct journal *journal, struct journaled_files *jf)
 {
-	uint64_t *sector = (uint64_t *)_sector;
-	uint64_t rn;
-	const int num_int64 = SECTOR_SIZE >> 3;
-	int error_count, i;
-
-	rn = sector[0];
-	error_count = 0;
-	for (i = 1; error_count <= TOLERANCE && i < num_int64; i++) {
-		rn = random_number(rn);
-		if (rn != sector[i])
-			error_count++;
+	char record[JOURNAL_MAX_RECORD];
+	long max_count = 0;
+
+	jf->files = NULL;
+	jf->count = 0;
+	jf->file_size = 0;
+	while (journal_next(journal, record)) {
+		struct journaled_file *f;
+		uint64_t ok, corrupted, changed, overwritten, bytes_read;
+		long number;
+		int saved_errno;
+
+		if (sscanf(record, "file-size %" SCNu64, &jf->file_size) == 1)
+			continue;
+		if (sscanf(record, "read %li %i %" SCNu64 " %" SCNu64
+			" %" SCNu64 " %" SCNu64 " %" SCNu64, &number,
+			&saved_errno, &ok, &corrupted, &changed, &overwritten,
+			&bytes_read) != 7)
+			continue;
+
+		if (jf->count >= max_count) {
+			max_count = max_count ? 2 * max_count : 64;
+			jf->files = realloc(jf->files,
+				max_count * sizeof(*jf->files));
+			assert(jf->files);
+		}
+		f = &jf->files[jf->count++];
+		f->number = number;
+		f->saved_errno = saved_errno;
+		f->stats.secs_ok = ok;
+		f->stats.secs_corrupted = corrupted;
+		f->stats.secs_changed = changed;
+		f->stats.secs_overwritten = overwritten;
+		f->stats.bytes_read = bytes_read;
+		/* Only files that were fully read are journaled. */
+		f->stats.read_all = true;
 	}
-
-	if (expected_offset == sector[0]) {
-		if (error_count == 0)
-			stats->secs_ok++;
-		else if (error_count <= TOLERANCE)
-			stats->secs_changed++;
-		else
-			stats->secs_corrupted++;
-	} else if (error_count <= TOLERANCE)
-		stats->secs_overwritten++;
-	else
-		stats->secs_corrupted++;
+	qsort(jf->files, jf->count, sizeof(*jf->files), cmp_journaled_files);
 }
 
-static uint64_t check_buffer(char *buf, size_t size, uint64_t expected_offset,
-	struct file_stats *stats)
+static const struct journaled_file *find_journaled_file(
+	const struct journaled_files *jf, long number)
 {
-	char *beyond_buf = buf + size;
-
-	assert(size % SECTOR_SIZE == 0);
-
-	while (buf < beyond_buf) {
-		check_sector(buf, expected_offset, stats);
-		buf += SECTOR_SIZE;
-		expected_offset += SECTOR_SIZE;
-	}
-	return expected_offset;
+	struct journaled_file key = { .number = number };
+	if (!jf->count)
+		return NULL;
+	return bsearch(&key, jf->files, jf->count, sizeof(*jf->files),
+		cmp_journaled_files);
 }
 
-static ssize_t read_all(int fd, char *buf, size_t count)
-{
-	size_t done = 0;
-	do {
-		ssize_t rc = read(fd, buf + done, count - done);
-		if (rc < 0) {
-			if (errno == EINTR)
-				continue;
-			return - errno;
-		}
-		if (rc == 0)
-			break;
-		done += rc;
-	} while (done < count);
-	return done;
-}
+/* The device read with option --raw. */
+struct raw_device {
+	int		fd;
+	uint64_t	size;
+	uint64_t	region_size;
+};
 
-static ssize_t check_chunk(int fd, uint64_t *p_expected_offset,
-	uint64_t chunk_size, struct file_stats *stats)
+/* Return the regions of @raw from @start_at to @end_at as
+ * ls_my_files() returns files.
+ */
+static const struct h2w_file *ls_raw_regions(const struct raw_device *raw,
+	long start_at, long end_at)
 {
-	char buf[MAX_BUFFER_SIZE];
-	ssize_t tot_bytes_read = 0;
-
-	while (chunk_size > 0) {
-		size_t turn_size = chunk_size <= MAX_BUFFER_SIZE
-			? chunk_size : MAX_BUFFER_SIZE;
-		ssize_t bytes_read = read_all(fd, buf, turn_size);
-
-		if (bytes_read < 0) {
-			stats->bytes_read += tot_bytes_read;
-			return bytes_read;
-		}
-
-		if (bytes_read == 0)
-			break;
-
-		tot_bytes_read += bytes_read;
-		chunk_size -= bytes_read;
-		*p_expected_offset = check_buffer(buf, bytes_read,
-			*p_expected_offset, stats);
+	struct h2w_file *regions;
+	long i, n;
+
+	const long n_regions = raw_n_regions(raw->size, raw->region_size);
+
+	if (end_at >= n_regions)
+		end_at = n_regions - 1;
+	n = start_at <= end_at ? end_at - start_at + 1 : 0;
+	regions = malloc((n + 1) * sizeof(*regions));
+	assert(regions);
+	for (i = 0; i < n; i++) {
+		regions[i].number = start_at + i;
+		regions[i].size = raw_region_size(raw->size,
+			raw->region_size, start_at + i);
 	}
-
-	stats->bytes_read += tot_bytes_read;
-	return tot_bytes_read;
-}
-
-static inline void print_status(const struct file_stats *stats)
-{
-	printf("%7" PRIu64 "/%9" PRIu64 "/%7" PRIu64 "/%7" PRIu64,
-		stats->secs_ok, stats->secs_corrupted, stats->secs_changed,
-		stats->secs_overwritten);
+	regions[n].number = -1;
+	regions[n].size = 0;
+	return regions;
 }
 
-static void validate_file(const char *path, int number, struct flow *fw,
-	struct file_stats *stats)
+static uint64_t get_total_size(const struct h2w_file *files,
+	const struct journaled_files *jf)
 {
-	char *full_fn;
-	const char *filename;
-	int fd, saved_errno;
-	ssize_t bytes_read;
-	uint64_t expected_offset;
-
-	zero_fstats(stats);
-
-	full_fn = full_fn_from_number(&filename, path, number);
-	assert(full_fn);
-	printf("Validating file %s ... ", filename);
-	fflush(stdout);
-#ifdef __CYGWIN__
-	/* We don't need write access, but some kernels require that
-	 * the file descriptor passed to fdatasync(2) to be writable.
-	 */
-	fd = open(full_fn, O_RDWR);
-#else
-	fd = open(full_fn, O_RDONLY);
-#endif
-	if (fd < 0)
-		err(errno, "Can't open file %s", full_fn);
-
-	/* If the kernel follows our advice, f3read won't ever read from cache
-	 * even when testing small memory cards without a remount, and
-	 * we should have a better reading-speed measurement.
-	 */
-	assert(!fdatasync(fd));
-	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
-
-	/* Help the kernel to help us. */
-	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
-
-	saved_errno = 0;
-	expected_offset = (uint64_t)number * GIGABYTES;
-	start_measurement(fw);
-	while (true) {
-		bytes_read = check_chunk(fd, &expected_offset,
-			get_rem_chunk_size(fw), stats);
-		if (bytes_read == 0)
-			break;
-		if (bytes_read < 0) {
-			saved_errno = - bytes_read;
-			break;
-		}
-		if (measure(fd, fw, bytes_read) < 0) {
-			saved_errno = errno;
-			break;
-		}
-	}
-	if (end_measurement(fd, fw) < 0) {
-		/* If a write failure has happened before, preserve it. */
-		if (!saved_errno)
-			saved_errno = errno;
-	}
+	uint64_t total_size = 0;
 
-	print_status(stats);
-	stats->read_all = bytes_read == 0;
-	if (!stats->read_all) {
-		assert(saved_errno);
-		printf(" - NOT fully read due to \"%s\"",
-			strerror(saved_errno));
-	} else if (saved_errno) {
-		printf(" - %s", strerror(saved_errno));
+	for (; files->number >= 0; files++) {
+		/* Journaled files are not read again. */
+		if (!find_journaled_file(jf, files->number))
+			total_size += files->size;
 	}
-	printf("\n");
-
-	close(fd);
-	free(full_fn);
-}
-
-static void report(const char *prefix, uint64_t i)
-{
-	double f = (double) (i * SECTOR_SIZE);
-	const char *unit = adjust_unit(&f);
-	printf("%s %.2f %s (%" PRIu64 " sectors)\n", prefix, f, unit, i);
+	return total_size;
 }
 
-static uint64_t get_total_size(const char *path, const long *files)
+static void check_file(const char *path, int number, struct flow *fw,
+	struct file_stats *stats, struct checker *checker, int *pdirect,
+	const struct journaled_files *jf, struct journal *journal,
+	const struct raw_device *raw)
 {
-	uint64_t total_size = 0;
+	const struct journaled_file *jfile;
+	int saved_errno;
 
-	while (*files >= 0) {
-		struct stat st;
-		int ret;
+	if (raw) {
+		printf("Validating region %i ... ", number + 1);
+	} else {
 		const char *filename;
-		char *full_fn = full_fn_from_number(&filename, path, *files);
+		char *full_fn = full_fn_from_number(&filename, "", number);
 		assert(full_fn);
-
-		ret = stat(full_fn, &st);
-		if (ret < 0)
-			err(errno, "Can't stat file %s", full_fn);
-		if ((st.st_mode & S_IFMT) != S_IFREG)
-			err(EINVAL, "File %s is not a regular file", full_fn);
-		assert(st.st_size >= 0);
-		total_size += st.st_size;
-
+		printf("Validating file %s ... ", filename);
 		free(full_fn);
-		files++;
 	}
-	return total_size;
-}
+	fflush(stdout);
 
-static inline void pr_avg_speed(double speed)
-{
-	const char *unit = adjust_unit(&speed);
-	printf("Average reading speed: %.2f %s/s\n", speed, unit);
+	jfile = find_journaled_file(jf, number);
+	if (jfile) {
+		*stats = jfile->stats;
+		print_file_status(stats, jfile->saved_errno);
+		return;
+	}
+
+	saved_errno = raw
+		? validate_region(raw->fd, raw->size, number, fw, stats,
+			checker, pdirect)
+		: validate_file(path, number, fw, stats, checker, pdirect);
+	/* A file that was not fully read is read again on resumption. */
+	if (journal && stats->read_all && journal_append(journal,
+		"read %i %i %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64, number, saved_errno, stats->secs_ok,
+		stats->secs_corrupted, stats->secs_changed,
+		stats->secs_overwritten, stats->bytes_read))
+		err(errno, "Can't update the journal");
+	print_file_status(stats, saved_errno);
 }
 
-static void iterate_files(const char *path, const long *files,
-	long start_at, long end_at, long max_read_rate, int progress)
+static void iterate_files(const char *path, const struct h2w_file *files,
+	long start_at, long end_at, long max_read_rate, int progress,
+	int threads, int direct, int use_mmap, uint64_t file_size,
+	int arena_flags, FILE *stats_file, int stats_format, int flow,
+	struct journal *journal, const struct raw_device *raw,
+	int has_direct_io)
 {
-	uint64_t tot_ok, tot_corrupted, tot_changed, tot_overwritten, tot_size;
-	int and_read_all = 1;
+	struct read_totals totals;
 	int or_missing_file = 0;
 	long number = start_at;
 	struct flow fw;
 	struct timeval t1, t2;
+	struct checker checker;
+	struct journaled_files jf = { NULL, 0, 0 };
 
 	UNUSED(end_at);
 
-	init_flow(&fw, get_total_size(path, files), max_read_rate,
-		progress, NULL);
-	tot_ok = tot_corrupted = tot_changed = tot_overwritten = tot_size = 0;
+	if (journal) {
+		load_journal(journal, &jf);
+		/* Results of files of another size cannot be reused. */
+		if (jf.file_size && jf.file_size != file_size)
+			errx(1, "The journal was started with files of %" PRIu64 " MB, not %" PRIu64 " MB; use option --file-size=%" PRIu64,
+				jf.file_size >> 20, file_size >> 20,
+				jf.file_size >> 20);
+		if (!jf.file_size && journal_append(journal,
+			"file-size %" PRIu64, file_size))
+			err(errno, "Can't update the journal");
+		if (jf.count)
+			printf("Results of up to %li files come from the journal\n\n",
+				jf.count);
+	}
+
+	init_checker(&checker, threads, use_mmap, file_size, arena_flags);
+	init_flow(&fw, get_total_size(files, &jf), max_read_rate, progress,
+		NULL);
+	flow_set_controller(&fw, flow);
+	if (stats_file)
+		flow_record_stats(&fw, stats_file, stats_format);
+	zero_totals(&totals);
 	printf("                  SECTORS "
 		"     ok/corrupted/changed/overwritten\n");
 
 	assert(!gettimeofday(&t1, NULL));
-	while (*files >= 0) {
+	while (files->number >= 0) {
 		struct file_stats stats;
 
-		or_missing_file = or_missing_file || (*files != number);
-		for (; number < *files; number++) {
+		or_missing_file = or_missing_file || (files->number != number);
+		for (; number < files->number; number++) {
 			const char *filename;
 			char *full_fn = full_fn_from_number(&filename, "",
 				number);
@@ -372,54 +501,402 @@ static void iterate_files(const char *path, const long *files,
 		}
 		number++;
 
-		validate_file(path, *files, &fw, &stats);
-		tot_ok += stats.secs_ok;
-		tot_corrupted += stats.secs_corrupted;
-		tot_changed += stats.secs_changed;
-		tot_overwritten += stats.secs_overwritten;
-		tot_size += stats.bytes_read;
-		and_read_all = and_read_all && stats.read_all;
+		check_file(path, files->number, &fw, &stats, &checker,
+			&has_direct_io, &jf, journal, raw);
+		add_to_totals(&totals, &stats);
 		files++;
 	}
 	assert(!gettimeofday(&t2, NULL));
-	assert(tot_size == SECTOR_SIZE *
-		(tot_ok + tot_corrupted + tot_changed + tot_overwritten));
+	free_checker(&checker);
+	free(jf.files);
 
 	/* Notice that not reporting `missing' files after the last file
 	 * in @files is important since @end_at could be very large.
 	 */
 
-	report("\n  Data OK:", tot_ok);
-	report("Data LOST:", tot_corrupted + tot_changed + tot_overwritten);
-	report("\t       Corrupted:", tot_corrupted);
-	report("\tSlightly changed:", tot_changed);
-	report("\t     Overwritten:", tot_overwritten);
+	print_totals(&totals);
 	if (or_missing_file)
 		printf("WARNING: Not all F3 files in the range %li to %li are available\n",
 			start_at + 1, number);
-	if (!and_read_all)
+	if (!totals.and_read_all)
 		printf("WARNING: Not all data was read due to I/O error(s)\n");
+	if (direct && !has_direct_io)
+		printf("WARNING: The file system does not support direct I/O, so the page cache was used\n");
 
-	/* Reading speed. */
-	if (has_enough_measurements(&fw)) {
-		pr_avg_speed(get_avg_speed(&fw));
-	} else {
-		/* If the drive is too fast for the measurements above,
-		 * try a coarse approximation of the reading speed.
+	print_read_speed(&fw, &t1, &t2);
+}
+
+/*
+ * Sampling
+ *
+ * Instead of reading whole files, sample_files() reads a stratified
+ * random sample of the chunks of SAMPLE_CHUNK_SIZE bytes of every file:
+ * the chunks of a file are split into as many strata as the file has
+ * samples, and a chunk is drawn at random from each stratum.
+ *
+ * The samples are read in bit-reversed order, so the samples read at
+ * any moment are spread over the whole drive. This is what allows
+ * options --time-budget and --fail-threshold to stop early and still
+ * have a sample of the whole drive; fake drives tend to lose data at
+ * the end, and reading the samples in order would miss that.
+ *
+ * The shares of sectors that are ok, corrupted, changed, and
+ * overwritten are estimated from the sampled sectors, each one weighed
+ * by the number of chunks of its stratum, and extrapolated to all
+ * files. Sectors of a chunk tend to share their fate, so the intervals
+ * count chunks instead of sectors as independent trials, which makes
+ * them conservative.
+ */
+
+#define SAMPLE_CHUNK_SIZE	(1 << 20)
+
+/* The intervals are at 95% confidence. */
+#define SAMPLE_Z		1.96
+
+struct sample {
+	long		number;
+	uint64_t	pos;
+	uint64_t	size;
+	/* Number of chunks that this sample stands for. */
+	uint64_t	weight;
+};
+
+/* This generator is SplitMix64, as in libprobe.c. */
+static uint64_t sample_rand(uint64_t *rng)
+{
+	return pattern_mix_v2(*rng += PATTERN_V2_GAMMA);
+}
+
+/* Draw about @fraction of the chunks of @files.
+ * Return the samples, and their number in @pn.
+ */
+static struct sample *plan_samples(const struct h2w_file *files,
+	double fraction, long *pn)
+{
+	uint64_t rng = (uint64_t)time(NULL) ^ (uint64_t)getpid();
+	struct sample *samples = NULL;
+	long n = 0, max_n = 0;
+
+	for (; files->number >= 0; files++) {
+		const uint64_t size = files->size;
+		uint64_t n_chunks = (size + SAMPLE_CHUNK_SIZE - 1) /
+			SAMPLE_CHUNK_SIZE;
+		uint64_t i, n_strata = ceil(fraction * n_chunks);
+
+		if (!n_chunks)
+			continue;
+		if (n_strata < 1)
+			n_strata = 1;
+		if (n_strata > n_chunks)
+			n_strata = n_chunks;
+
+		if (n + n_strata > (uint64_t)max_n) {
+			while (n + n_strata > (uint64_t)max_n)
+				max_n = max_n ? 2 * max_n : 1024;
+			samples = realloc(samples, max_n * sizeof(*samples));
+			assert(samples);
+		}
+
+		for (i = 0; i < n_strata; i++) {
+			uint64_t first = i * n_chunks / n_strata;
+			uint64_t next = (i + 1) * n_chunks / n_strata;
+			struct sample *s = &samples[n++];
+
+			s->number = files->number;
+			s->pos = (first + sample_rand(&rng) % (next - first)) *
+				SAMPLE_CHUNK_SIZE;
+			s->size = size - s->pos < SAMPLE_CHUNK_SIZE
+				? size - s->pos : SAMPLE_CHUNK_SIZE;
+			s->weight = next - first;
+		}
+	}
+
+	*pn = n;
+	return samples;
+}
+
+/* Return the @bits low bits of @i reversed. */
+static uint64_t reverse_bits(uint64_t i, int bits)
+{
+	uint64_t r = 0;
+	int j;
+	for (j = 0; j < bits; j++) {
+		r = (r << 1) | (i & 1);
+		i >>= 1;
+	}
+	return r;
+}
+
+/* Sectors of the samples read so far weighed by their strata. */
+struct sample_totals {
+	double		ok;
+	double		corrupted;
+	double		changed;
+	double		overwritten;
+	/* Number of chunks read, and of chunks in all files. */
+	long		n;
+	uint64_t	n_chunks;
+};
+
+static inline double sample_sectors(const struct sample_totals *st)
+{
+	return st->ok + st->corrupted + st->changed + st->overwritten;
+}
+
+/* Return in @plo and @phi the Wilson score interval of the share @p
+ * observed in the samples of @st.
+ */
+static void wilson_interval(const struct sample_totals *st, double p,
+	double *plo, double *phi)
+{
+	const double z2 = SAMPLE_Z * SAMPLE_Z;
+	double n, center, half;
+
+	if (!st->n) {
+		*plo = 0;
+		*phi = 1;
+		return;
+	}
+	if ((uint64_t)st->n >= st->n_chunks) {
+		/* Every chunk was read. */
+		*plo = *phi = p;
+		return;
+	}
+
+	/* The finite population correction shrinks the interval as
+	 * the sample covers more of the chunks.
+	 */
+	n = st->n * (st->n_chunks - 1.0) / (st->n_chunks - st->n);
+	center = (p + z2 / (2 * n)) / (1 + z2 / n);
+	half = SAMPLE_Z / (1 + z2 / n) *
+		sqrt(p * (1 - p) / n + z2 / (4 * n * n));
+	*plo = center - half > 0 ? center - half : 0;
+	*phi = center + half < 1 ? center + half : 1;
+}
+
+static double lost_share(const struct sample_totals *st)
+{
+	double sectors = sample_sectors(st);
+	return sectors > 0
+		? (st->corrupted + st->changed + st->overwritten) / sectors
+		: 0;
+}
+
+static void report_estimate(const char *prefix,
+	const struct sample_totals *st, double sectors,
+	uint64_t total_sectors)
+{
+	double p = sample_sectors(st) > 0 ? sectors / sample_sectors(st) : 0;
+	double lo, hi, f, f_lo, f_hi;
+	const char *unit, *unit_lo, *unit_hi;
+
+	wilson_interval(st, p, &lo, &hi);
+	f = p * total_sectors * SECTOR_SIZE;
+	f_lo = lo * total_sectors * SECTOR_SIZE;
+	f_hi = hi * total_sectors * SECTOR_SIZE;
+	unit = adjust_unit(&f);
+	unit_lo = adjust_unit(&f_lo);
+	unit_hi = adjust_unit(&f_hi);
+	printf("%s %.2f %s (%.0f sectors), from %.2f %s to %.2f %s\n",
+		prefix, f, unit, p * total_sectors, f_lo, unit_lo,
+		f_hi, unit_hi);
+}
+
+static void print_estimates(const struct sample_totals *st,
+	uint64_t total_sectors)
+{
+	printf("\nEstimates with 95%% confidence intervals:\n");
+	report_estimate("  Data OK:", st, st->ok, total_sectors);
+	report_estimate("Data LOST:", st,
+		st->corrupted + st->changed + st->overwritten, total_sectors);
+	report_estimate("\t       Corrupted:", st, st->corrupted,
+		total_sectors);
+	report_estimate("\tSlightly changed:", st, st->changed,
+		total_sectors);
+	report_estimate("\t     Overwritten:", st, st->overwritten,
+		total_sectors);
+}
+
+/* Validate about @sample percent of @files; see "Sampling" above.
+ * Sampling stops after @time_budget seconds, if not zero, or as soon
+ * as the share of lost data is above @fail_threshold percent with
+ * the confidence of the intervals, if @fail_threshold is not negative.
+ */
+static void sample_files(const char *path, const struct h2w_file *files,
+	long max_read_rate, int progress, int direct, uint64_t file_size,
+	int arena_flags, FILE *stats_file, int stats_format, int flow,
+	const struct raw_device *raw, int has_direct_io,
+	double sample, long time_budget, double fail_threshold)
+{
+	struct sample_totals st = { 0, 0, 0, 0, 0, 0 };
+	struct journaled_files no_jf = { NULL, 0, 0 };
+	struct read_totals totals;
+	struct sample *samples;
+	struct checker checker;
+	struct flow fw;
+	struct timeval t1, t2;
+	uint64_t planned_size = 0, total_size = 0, i, n_visits;
+	long j, n, n_files = 0, n_unread = 0;
+	int bits = 0, last_errno = 0;
+	const char *stop = NULL;
+	double f;
+	const char *unit;
+
+	samples = plan_samples(files, sample / 100, &n);
+	for (j = 0; j < n; j++) {
+		planned_size += samples[j].size;
+		st.n_chunks += samples[j].weight;
+		n_files += !j || samples[j].number != samples[j - 1].number;
+	}
+	total_size = get_total_size(files, &no_jf);
+
+	printf("Sampling %li of %" PRIu64 " chunks (%.2f%%) from %li %s\n",
+		n, st.n_chunks, sample, n_files, raw ? "regions" : "files");
+
+	init_checker(&checker, 0, false, file_size, arena_flags);
+	init_flow(&fw, planned_size, max_read_rate, progress, NULL);
+	flow_set_controller(&fw, flow);
+	if (stats_file)
+		flow_record_stats(&fw, stats_file, stats_format);
+	zero_totals(&totals);
+
+	while (((uint64_t)1 << bits) < (uint64_t)n)
+		bits++;
+	n_visits = (uint64_t)1 << bits;
+
+	assert(!gettimeofday(&t1, NULL));
+	start_measurement(&fw);
+	for (i = 0; i < n_visits && n; i++) {
+		uint64_t k = reverse_bits(i, bits);
+		const struct sample *s;
+		struct file_stats stats;
+		uint64_t secs_read;
+		int saved_errno;
+
+		if (k >= (uint64_t)n)
+			continue;
+		s = &samples[k];
+
+		if (raw)
+			saved_errno = validate_region_chunk(raw->fd,
+				s->number, s->pos, s->size, &fw, &stats,
+				&checker, &has_direct_io);
+		else
+			saved_errno = validate_file_chunk(path, s->number,
+				s->pos, s->size, &fw, &stats, &checker,
+				&has_direct_io);
+		add_to_totals(&totals, &stats);
+
+		/* The sectors that could not be read are lost; leaving
+		 * them out would favor the drives that fail.
 		 */
-		int64_t total_time_ms = delay_ms(&t1, &t2);
-		if (total_time_ms > 0) {
-			pr_avg_speed(get_avg_speed_given_time(&fw,
-				total_time_ms));
-		} else {
-			printf("Reading speed not available\n");
+		secs_read = stats.secs_ok + stats.secs_corrupted +
+			stats.secs_changed + stats.secs_overwritten;
+		if (secs_read < s->size / SECTOR_SIZE) {
+			stats.secs_corrupted +=
+				s->size / SECTOR_SIZE - secs_read;
+			n_unread++;
+		}
+		if (saved_errno)
+			last_errno = saved_errno;
+
+		st.ok += (double)stats.secs_ok * s->weight;
+		st.corrupted += (double)stats.secs_corrupted * s->weight;
+		st.changed += (double)stats.secs_changed * s->weight;
+		st.overwritten += (double)stats.secs_overwritten * s->weight;
+		st.n++;
+
+		if (fail_threshold >= 0) {
+			double lo, hi;
+			wilson_interval(&st, lost_share(&st), &lo, &hi);
+			if (lo * 100 > fail_threshold) {
+				stop = "more data than the failure threshold "
+					"is lost";
+				break;
+			}
+		}
+		if (time_budget > 0) {
+			assert(!gettimeofday(&t2, NULL));
+			if (delay_ms(&t1, &t2) >= time_budget * 1000) {
+				stop = "the time budget is over";
+				break;
+			}
 		}
 	}
+	end_measurement(-1, &fw);
+	assert(!gettimeofday(&t2, NULL));
+	free_checker(&checker);
+	free(samples);
+
+	f = totals.tot_size;
+	unit = adjust_unit(&f);
+	printf("\nSampled %.2f %s in %li chunks", f, unit, st.n);
+	if (stop)
+		printf("; stopped early because %s", stop);
+	printf("\n");
+	print_estimates(&st, total_size / SECTOR_SIZE);
+	if (n_unread)
+		printf("WARNING: %li chunks were not fully read; their unread sectors count as corrupted\n",
+			n_unread);
+	if (last_errno)
+		printf("WARNING: The last error while sampling was \"%s\"\n",
+			strerror(last_errno));
+	if (direct && !has_direct_io)
+		printf("WARNING: The file system does not support direct I/O, so the page cache was used\n");
+
+	print_read_speed(&fw, &t1, &t2);
+}
+
+/* Return the size of the files of f3write in @files.
+ * A file is as large as the files of f3write unless it is the last one,
+ * so it is the size of the largest file. If only one file is available,
+ * its size is only known to be right when it is the first file.
+ * @file_size is the size of option --file-size, or zero.
+ */
+static uint64_t infer_file_size(const struct h2w_file *files,
+	uint64_t file_size)
+{
+	const struct h2w_file *file;
+	uint64_t max_size = 0;
+	double f;
+	const char *unit;
+
+	for (file = files; file->number >= 0; file++)
+		if (file->size > max_size)
+			max_size = file->size;
+
+	if (!file_size) {
+		if (!max_size || (files[1].number < 0 && files[0].number > 0 &&
+			max_size <= DEFAULT_FILE_SIZE))
+			return DEFAULT_FILE_SIZE;
+		if (max_size != DEFAULT_FILE_SIZE) {
+			f = max_size;
+			unit = adjust_unit(&f);
+			printf("File size: %.2f %s, as the largest file\n\n",
+				f, unit);
+		}
+		return max_size;
+	}
+
+	if (max_size > file_size ||
+		(files[0].number >= 0 && files[1].number >= 0 &&
+		max_size < file_size)) {
+		f = max_size;
+		unit = adjust_unit(&f);
+		printf("WARNING: The largest file has %.2f %s, not the %" PRIu64 " MB of option --file-size, so the files are likely to be reported as overwritten\n\n",
+			f, unit, file_size >> 20);
+	}
+	return file_size;
 }
 
 int main(int argc, char **argv)
 {
-	const long *files;
+	const struct h2w_file *files;
+	FILE *stats_file;
+	struct journal *journal = NULL;
+	struct raw_device raw;
+	uint64_t tail;
+	int has_direct_io;
 
 	struct args args = {
 		/* Defaults. */
@@ -428,16 +905,77 @@ int main(int argc, char **argv)
 		.max_read_rate	= 0,
 		/* If stdout isn't a terminal, suppress progress. */
 		.show_progress	= isatty(STDOUT_FILENO),
+		.threads	= 0,
+		.direct		= false,
+		.arena_flags	= 0,
+		.mmap		= false,
+		.raw		= false,
+		/* Zero until it is given or inferred. */
+		.file_size	= 0,
+		.pattern	= PATTERN_V1,
+		.sample		= 0,
+		.time_budget	= 0,
+		.fail_threshold	= -1,
+		.stats_filename	= NULL,
+		.stats_format	= FLOW_STATS_CSV,
+		.flow		= FLOW_CLASSIC,
+		.journal_filename = NULL,
 	};
 
 	/* Read parameters. */
 	argp_parse(&argp, argc, argv, 0, NULL, &args);
 	print_header(stdout, "read");
+	pattern_set_version(args.pattern);
+
+	has_direct_io = args.direct;
+	if (args.raw) {
+#ifdef __CYGWIN__
+		/* See validate_file(). */
+		raw.fd = open_raw_device(args.dev_path, O_RDWR,
+			&has_direct_io, &raw.size, &tail);
+#else
+		raw.fd = open_raw_device(args.dev_path, O_RDONLY,
+			&has_direct_io, &raw.size, &tail);
+#endif
+		if (raw.fd < 0)
+			err(errno, "Can't open device %s", args.dev_path);
+		pr_raw_tail(tail);
+		if (!args.file_size)
+			args.file_size = DEFAULT_FILE_SIZE;
+		raw.region_size = args.file_size;
+		files = ls_raw_regions(&raw, args.start_at, args.end_at);
+	} else {
+		files = ls_my_files(args.dev_path, args.start_at, args.end_at,
+			true);
+		args.file_size = infer_file_size(files, args.file_size);
+	}
 
-	files = ls_my_files(args.dev_path, args.start_at, args.end_at);
+	if (args.journal_filename) {
+		journal = open_journal(args.journal_filename, "f3read");
+		if (!journal)
+			err(errno, "Can't open journal %s",
+				args.journal_filename);
+	}
 
-	iterate_files(args.dev_path, files, args.start_at, args.end_at,
-		args.max_read_rate, args.show_progress);
+	stats_file = open_stats_file(args.stats_filename);
+	if (is_sampling(&args))
+		sample_files(args.dev_path, files, args.max_read_rate,
+			args.show_progress, args.direct, args.file_size,
+			args.arena_flags, stats_file, args.stats_format, args.flow,
+			args.raw ? &raw : NULL, has_direct_io,
+			args.sample > 0 ? args.sample : 100,
+			args.time_budget, args.fail_threshold);
+	else
+		iterate_files(args.dev_path, files, args.start_at,
+			args.end_at, args.max_read_rate, args.show_progress,
+			args.threads, args.direct, args.mmap, args.file_size,
+			args.arena_flags, stats_file, args.stats_format, args.flow, journal,
+			args.raw ? &raw : NULL, has_direct_io);
+	close_stats_file(stats_file, args.stats_filename);
+	if (journal)
+		close_journal(journal);
+	if (args.raw)
+		close(raw.fd);
 	free((void *)files);
 	return 0;
 }
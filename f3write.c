@@ -3,6 +3,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
@@ -16,9 +17,15 @@
 #include <unistd.h>
 #include <err.h>
 #include <argp.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "libflow.h"
+#include "libpipe.h"
+#include "libpattern.h"
+#include "libverify.h"
+#include "libjournal.h"
+#include "libarena.h"
 #include "version.h"
 
 /* Argp's global variables. */
@@ -39,6 +46,37 @@ static struct argp_option options[] = {
 		"Maximum write rate",					0},
 	{"show-progress",	'p',	"NUM",		0,
 		"Show progress if NUM is not zero",			0},
+	{"threads",		't',	"NUM",		0,
+		"Number of threads generating data; 0 means none",	0},
+	{"direct",		'd',	NULL,		0,
+		"Bypass the page cache when writing files",		0},
+	{"hugepages",		'H',	NULL,		0,
+		"Back the I/O buffers with huge pages",			0},
+	{"verify",		'v',	NULL,		0,
+		"Verify each file while the next one is written",	0},
+	{"raw",			'R',	NULL,		0,
+		"Write straight onto the unmounted device PATH instead of "
+		"creating files; file NUM is then the NUMth region of "
+		"the device, and its data are lost",			0},
+	{"file-size",		'z',	"MB",		0,
+		"Size of the files, or regions; the default is 1024, "
+		"and f3read must be given the same size",		0},
+	{"preallocate",		'a',	NULL,		0,
+		"Allocate each file before writing it, where the file "
+		"system supports it",					0},
+	{"pattern",		'P',	"VERSION",	0,
+		"Version of the test pattern: v1 (default) or v2; "
+		"f3read must be given the same version",		0},
+	{"journal",		'j',	"FILE",		0,
+		"Record written files in FILE, and resume from it",	0},
+	{"flow",		'c',	"NAME",		0,
+		"How chunks between speed measurements are sized: "
+		"classic (default) or smooth, which flushes less often",
+									0},
+	{"stats-file",		'f',	"FILE",		0,
+		"Record every speed measurement into FILE",		0},
+	{"stats-format",	'F',	"FORMAT",	0,
+		"Format of the records: csv (default) or json",		0},
 	{ 0 }
 };
 
@@ -47,6 +85,19 @@ struct args {
 	long		end_at;
 	long		max_write_rate;
 	int		show_progress;
+	int		threads;
+	int		direct;
+	/* Flags of create_arena(). */
+	int		arena_flags;
+	int		verify;
+	int		raw;
+	uint64_t	file_size;
+	int		preallocate;
+	int		pattern;
+	const char	*stats_filename;
+	int		stats_format;
+	int		flow;
+	const char	*journal_filename;
 	const char	*dev_path;
 };
 
@@ -84,6 +135,73 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->show_progress = !!arg_to_long(state, arg);
 		break;
 
+	case 't':
+		l = arg_to_long(state, arg);
+		if (l < 0 || l > MAX_THREADS)
+			argp_error(state,
+				"NUM must be in the interval [0, %i]",
+				MAX_THREADS);
+		args->threads = l;
+		break;
+
+	case 'd':
+		args->direct = true;
+		break;
+
+	case 'H':
+		args->arena_flags |= ARENA_HUGEPAGE;
+		break;
+
+	case 'v':
+		args->verify = true;
+		break;
+
+	case 'R':
+		args->raw = true;
+		break;
+
+	case 'z':
+		l = arg_to_long(state, arg);
+		if (l <= 0 || l > MAX_FILE_SIZE_MB)
+			argp_error(state,
+				"MB must be in the interval [1, %i]",
+				MAX_FILE_SIZE_MB);
+		args->file_size = (uint64_t)l << 20;
+		break;
+
+	case 'a':
+		args->preallocate = true;
+		break;
+
+	case 'j':
+		args->journal_filename = arg;
+		break;
+
+	case 'f':
+		args->stats_filename = arg;
+		break;
+
+	case 'F':
+		l = flow_stats_format_from_name(arg);
+		if (l < 0)
+			argp_error(state, "Unknown format `%s'", arg);
+		args->stats_format = l;
+		break;
+
+	case 'c':
+		l = flow_controller_from_name(arg);
+		if (l < 0)
+			argp_error(state, "Unknown flow `%s'", arg);
+		args->flow = l;
+		break;
+
+	case 'P':
+		l = pattern_version_from_name(arg);
+		if (l < 0)
+			argp_error(state, "Unknown pattern version `%s'", arg);
+		args->pattern = l;
+		break;
+
 	case ARGP_KEY_INIT:
 		args->dev_path = NULL;
 		break;
@@ -102,6 +220,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		if (args->start_at > args->end_at)
 			argp_error(state,
 				"Option --start-at must be less or equal to option --end-at");
+		if (args->raw && args->preallocate)
+			argp_error(state,
+				"Option --preallocate cannot be combined with option --raw");
 		break;
 
 	default:
@@ -112,29 +233,6 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, adoc, doc, NULL, NULL, NULL};
 
-static uint64_t fill_buffer(void *buf, size_t size, uint64_t offset)
-{
-	const int num_int64 = SECTOR_SIZE >> 3;
-	uint8_t *p, *ptr_end;
-
-	assert(size > 0);
-	assert(size % SECTOR_SIZE == 0);
-
-	p = buf;
-	ptr_end = p + size;
-	while (p < ptr_end) {
-		uint64_t *sector = (uint64_t *)p;
-		int i;
-		sector[0] = offset;
-		for (i = 1; i < num_int64; i++)
-			sector[i] = random_number(sector[i - 1]);
-		p += SECTOR_SIZE;
-		offset += SECTOR_SIZE;
-	}
-
-	return offset;
-}
-
 /* XXX Avoid duplicate this function, which was copied from libdevs.c. */
 static int write_all(int fd, const char *buf, size_t count)
 {
@@ -142,6 +240,11 @@ static int write_all(int fd, const char *buf, size_t count)
 	do {
 		ssize_t rc = write(fd, buf + done, count - done);
 		if (rc < 0) {
+			/* Direct I/O rejects unaligned writes with EINVAL;
+			 * retry through the page cache.
+			 */
+			if (errno == EINVAL && !stop_direct_io(fd))
+				continue;
 			/* The write() failed. */
 			return errno;
 		}
@@ -150,17 +253,112 @@ static int write_all(int fd, const char *buf, size_t count)
 	return 0;
 }
 
-static int write_chunk(int fd, size_t chunk_size, uint64_t *poffset)
+/* Source of the data written to the files. */
+struct feed {
+	/* Aligned buffer used when there are no workers. */
+	char			*buf;
+	/* Workers generating data; NULL if there are none. */
+	struct pipeline		*pl;
+	/* Fields below are only used with workers. */
+	/* Offset of the next buffer to hand to the workers. */
+	uint64_t		next_offset;
+	uint64_t		end_offset;
+	/* Slot being written out, and how much of it was written. */
+	struct pipe_slot	*slot;
+	size_t			slot_pos;
+};
+
+static void fill_slot(struct pipe_slot *slot, void *arg)
+{
+	UNUSED(arg);
+	fill_buffer(slot->buf, slot->size, slot->offset);
+}
+
+/* Submit @slot if there is still data to be generated for the file. */
+static void feed_slot(struct feed *feed, struct pipe_slot *slot)
 {
-	char buf[MAX_BUFFER_SIZE];
+	uint64_t remaining = feed->end_offset - feed->next_offset;
+
+	if (!remaining) {
+		pipe_put(feed->pl, slot);
+		return;
+	}
+
+	slot->offset = feed->next_offset;
+	slot->size = remaining <= MAX_BUFFER_SIZE
+		? remaining : MAX_BUFFER_SIZE;
+	feed->next_offset += slot->size;
+	pipe_submit(feed->pl, slot);
+}
+
+static void start_feed(struct feed *feed, uint64_t offset, uint64_t size)
+{
+	int i, n = pipe_n_slots(feed->pl);
+
+	feed->next_offset = offset;
+	feed->end_offset = offset + size;
+	feed->slot = NULL;
+	feed->slot_pos = 0;
+	for (i = 0; i < n; i++)
+		feed_slot(feed, pipe_get(feed->pl));
+}
+
+/* Discard whatever the workers generated ahead for the file. */
+static void stop_feed(struct feed *feed)
+{
+	int i, n = pipe_n_slots(feed->pl);
+	for (i = 0; i < n; i++)
+		pipe_put(feed->pl, pipe_get(feed->pl));
+	feed->slot = NULL;
+}
+
+static int write_fed_chunk(int fd, size_t chunk_size, uint64_t *poffset,
+	struct feed *feed)
+{
+	while (chunk_size > 0) {
+		size_t turn_size;
+		int ret;
+
+		if (!feed->slot) {
+			feed->slot = pipe_get(feed->pl);
+			feed->slot_pos = 0;
+			assert(feed->slot->state == PSS_DONE);
+			assert(feed->slot->offset == *poffset);
+		}
+
+		turn_size = feed->slot->size - feed->slot_pos;
+		if (turn_size > chunk_size)
+			turn_size = chunk_size;
+		ret = write_all(fd, feed->slot->buf + feed->slot_pos,
+			turn_size);
+		if (ret)
+			return ret;
+		chunk_size -= turn_size;
+		*poffset += turn_size;
+		feed->slot_pos += turn_size;
+
+		if (feed->slot_pos == feed->slot->size) {
+			feed_slot(feed, feed->slot);
+			feed->slot = NULL;
+		}
+	}
+
+	return 0;
+}
+
+static int write_chunk(int fd, size_t chunk_size, uint64_t *poffset,
+	struct feed *feed)
+{
+	if (feed->pl)
+		return write_fed_chunk(fd, chunk_size, poffset, feed);
 
 	while (chunk_size > 0) {
 		size_t turn_size = chunk_size <= MAX_BUFFER_SIZE
 			? chunk_size : MAX_BUFFER_SIZE;
 		int ret;
 		chunk_size -= turn_size;
-		*poffset = fill_buffer(buf, turn_size, *poffset);
-		ret = write_all(fd, buf, turn_size);
+		*poffset = fill_buffer(feed->buf, turn_size, *poffset);
+		ret = write_all(fd, feed->buf, turn_size);
 		if (ret)
 			return ret;
 	}
@@ -168,45 +366,178 @@ static int write_chunk(int fd, size_t chunk_size, uint64_t *poffset)
 	return 0;
 }
 
-/* Return true when disk is full. */
-static int create_and_fill_file(const char *path, long number, size_t size,
-	int *phas_suggested_max_write_rate, struct flow *fw)
+/* Files written so far are verified by a thread of their own
+ * while the next files are written; see option --verify.
+ */
+struct verifier {
+	const char		*path;
+	/* The device being written with option --raw, or -1. */
+	int			raw_fd;
+	uint64_t		raw_size;
+	long			start_at;
+	pthread_t		thread;
+
+	pthread_mutex_t		lock;
+	/* Signaled when a file is ready, or the writing is over. */
+	pthread_cond_t		has_file;
+	/* Files @start_at to @start_at + @n_ready - 1 can be verified. */
+	long			n_ready;
+	long			n_checked;
+	bool			done_writing;
+
+	/* Entry i holds the result of file @start_at + i. */
+	struct file_stats	*stats;
+	int			*errors;
+
+	struct flow		fw;
+	struct checker		checker;
+	int			has_direct_io;
+	struct timeval		t1, t2;
+};
+
+static void *verify_files(void *arg)
 {
-	char *full_fn;
-	const char *filename;
-	int fd, saved_errno;
-	size_t remaining;
-	uint64_t offset;
+	struct verifier *v = arg;
 
-	assert(size > 0);
-	assert(size % fw->block_size == 0);
+	assert(!gettimeofday(&v->t1, NULL));
+	assert(!pthread_mutex_lock(&v->lock));
+	while (true) {
+		long i;
 
-	/* Create the file. */
-	full_fn = full_fn_from_number(&filename, path, number);
-	assert(full_fn);
-	printf("Creating file %s ... ", filename);
-	fflush(stdout);
-	fd = open(full_fn, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (fd < 0) {
-		if (errno == ENOSPC) {
-			printf("No space left.\n");
+		while (v->n_checked == v->n_ready && !v->done_writing)
+			assert(!pthread_cond_wait(&v->has_file, &v->lock));
+		if (v->n_checked == v->n_ready)
+			break;
+		i = v->n_checked;
+		assert(!pthread_mutex_unlock(&v->lock));
+
+		v->errors[i] = v->raw_fd >= 0
+			? validate_region(v->raw_fd, v->raw_size,
+				v->start_at + i, &v->fw, &v->stats[i],
+				&v->checker, &v->has_direct_io)
+			: validate_file(v->path, v->start_at + i, &v->fw,
+				&v->stats[i], &v->checker, &v->has_direct_io);
+
+		assert(!pthread_mutex_lock(&v->lock));
+		v->n_checked++;
+	}
+	assert(!pthread_mutex_unlock(&v->lock));
+	assert(!gettimeofday(&v->t2, NULL));
+	return NULL;
+}
+
+static void start_verifier(struct verifier *v, const char *path, int raw,
+	long start_at, long end_at, uint64_t file_size, int threads,
+	int direct, int arena_flags)
+{
+	long n = end_at - start_at + 1;
+
+	v->path = path;
+	v->has_direct_io = direct;
+	v->raw_fd = -1;
+	if (raw) {
+		/* A descriptor of its own keeps the position of
+		 * the writer untouched.
+		 */
+		v->raw_fd = open_raw_device(path, O_RDONLY, &v->has_direct_io,
+			&v->raw_size, NULL);
+		if (v->raw_fd < 0)
+			err(errno, "Can't open device %s", path);
+	}
+	v->start_at = start_at;
+	v->n_ready = 0;
+	v->n_checked = 0;
+	v->done_writing = false;
+	v->stats = malloc(n * sizeof(*v->stats));
+	v->errors = malloc(n * sizeof(*v->errors));
+	if (!v->stats || !v->errors)
+		errx(1, "Out of memory");
+	/* The progress of the writing is the one shown. */
+	init_flow(&v->fw, (uint64_t)n * file_size, 0, false, NULL);
+	init_checker(&v->checker, threads, false, file_size, arena_flags);
+	assert(!pthread_mutex_init(&v->lock, NULL));
+	assert(!pthread_cond_init(&v->has_file, NULL));
+	if (pthread_create(&v->thread, NULL, verify_files, v))
+		errx(1, "Can't create the verifying thread");
+}
+
+/* File @number is closed, so it can be verified. */
+static void verifier_add_file(struct verifier *v, long number)
+{
+	assert(!pthread_mutex_lock(&v->lock));
+	assert(number == v->start_at + v->n_ready);
+	v->n_ready++;
+	assert(!pthread_cond_signal(&v->has_file));
+	assert(!pthread_mutex_unlock(&v->lock));
+}
+
+/* Wait for the verification of all ready files, and report it. */
+static void stop_verifier(struct verifier *v, int direct)
+{
+	struct read_totals totals;
+	long i;
+
+	assert(!pthread_mutex_lock(&v->lock));
+	v->done_writing = true;
+	assert(!pthread_cond_signal(&v->has_file));
+	assert(!pthread_mutex_unlock(&v->lock));
+	assert(!pthread_join(v->thread, NULL));
+
+	printf("\n                  SECTORS "
+		"     ok/corrupted/changed/overwritten\n");
+	zero_totals(&totals);
+	for (i = 0; i < v->n_checked; i++) {
+		if (v->raw_fd >= 0) {
+			printf("Validating region %li ... ",
+				v->start_at + i + 1);
+		} else {
+			const char *filename;
+			char *full_fn = full_fn_from_number(&filename, "",
+				v->start_at + i);
+			assert(full_fn);
+			printf("Validating file %s ... ", filename);
 			free(full_fn);
-			return true;
 		}
-		err(errno, "Can't create file %s", full_fn);
+		print_file_status(&v->stats[i], v->errors[i]);
+		add_to_totals(&totals, &v->stats[i]);
 	}
-	assert(fd >= 0);
+	print_totals(&totals);
+	if (!totals.and_read_all)
+		printf("WARNING: Not all data was read due to I/O error(s)\n");
+	if (direct && !v->has_direct_io)
+		printf("WARNING: The file system does not support direct I/O, so the page cache was used\n");
+	print_read_speed(&v->fw, &v->t1, &v->t2);
+
+	assert(!pthread_cond_destroy(&v->has_file));
+	assert(!pthread_mutex_destroy(&v->lock));
+	free_checker(&v->checker);
+	free(v->stats);
+	free(v->errors);
+	if (v->raw_fd >= 0)
+		close(v->raw_fd);
+}
 
-	/* Write content. */
-	saved_errno = 0;
-	offset = (uint64_t)number * GIGABYTES;
-	remaining = size;
+/* Write at the current position of @fd the @size bytes of the sectors
+ * at @offset.
+ * Return zero, or the error that stopped the writing.
+ */
+static int write_file_data(int fd, uint64_t offset, uint64_t size,
+	struct flow *fw, struct feed *feed)
+{
+	int saved_errno = 0;
+	uint64_t remaining = size;
+
+	assert(size > 0);
+	assert(size % fw->block_size == 0);
+
+	if (feed->pl)
+		start_feed(feed, offset, size);
 	start_measurement(fw);
 	while (remaining > 0) {
 		uint64_t write_size = get_rem_chunk_size(fw);
 		if (write_size > remaining)
 			write_size = remaining;
-		saved_errno = write_chunk(fd, write_size, &offset);
+		saved_errno = write_chunk(fd, write_size, &offset, feed);
 		if (saved_errno)
 			break;
 		remaining -= write_size;
@@ -220,12 +551,27 @@ static int create_and_fill_file(const char *path, long number, size_t size,
 		if (!saved_errno)
 			saved_errno = errno;
 	}
-	close(fd);
-	free(full_fn);
+	if (feed->pl)
+		stop_feed(feed);
+	if (saved_errno == 0)
+		assert(remaining == 0);
+	return saved_errno;
+}
+
+/* Report the writing of file @number, which ended with @saved_errno.
+ * Return true when disk is full.
+ */
+static int file_written(long number, int saved_errno,
+	int *phas_suggested_max_write_rate, struct verifier *verifier,
+	struct journal *journal)
+{
+	if (verifier)
+		verifier_add_file(verifier, number);
 
 	if (saved_errno == 0 || saved_errno == ENOSPC) {
-		if (saved_errno == 0)
-			assert(remaining == 0);
+		/* flush_chunk() has already synced the file. */
+		if (journal && journal_append(journal, "written %li", number))
+			err(errno, "Can't update the journal");
 		printf("OK!\n");
 		return saved_errno == ENOSPC;
 	}
@@ -240,6 +586,80 @@ static int create_and_fill_file(const char *path, long number, size_t size,
 	return false;
 }
 
+/* Return true when disk is full.
+ * If *@ppreallocate is true, the file is preallocated; when
+ * the file system doesn't support it, *@ppreallocate is cleared.
+ */
+static int create_and_fill_file(const char *path, long number, uint64_t size,
+	int *phas_suggested_max_write_rate, struct flow *fw, struct feed *feed,
+	int *pdirect, int *ppreallocate, struct verifier *verifier,
+	struct journal *journal)
+{
+	char *full_fn;
+	const char *filename;
+	int fd, saved_errno;
+
+	/* Create the file. */
+	full_fn = full_fn_from_number(&filename, path, number);
+	assert(full_fn);
+	printf("Creating file %s ... ", filename);
+	fflush(stdout);
+	fd = open_file(full_fn, O_CREAT | O_WRONLY | O_TRUNC, pdirect);
+	if (fd < 0) {
+		if (errno == ENOSPC) {
+			printf("No space left.\n");
+			free(full_fn);
+			return true;
+		}
+		err(errno, "Can't create file %s", full_fn);
+	}
+	assert(fd >= 0);
+
+	if (*ppreallocate) {
+		/* When the whole file doesn't fit, what fits is written
+		 * as if there were no preallocation.
+		 */
+		int rc = preallocate_file(fd, size);
+		if (rc == EOPNOTSUPP)
+			*ppreallocate = false;
+	}
+
+	saved_errno = write_file_data(fd, (uint64_t)number * size, size, fw,
+		feed);
+	if (saved_errno && *ppreallocate) {
+		/* Release the blocks allocated beyond what was written. */
+		struct stat st;
+		if (!fstat(fd, &st))
+			ftruncate(fd, st.st_size);
+	}
+	close(fd);
+	free(full_fn);
+	return file_written(number, saved_errno,
+		phas_suggested_max_write_rate, verifier, journal);
+}
+
+/* Write region @number of the raw device @fd of @dev_size bytes with
+ * what file @number would hold.
+ * Return true when the last region of the device has been written.
+ */
+static int fill_region(int fd, uint64_t dev_size, uint64_t region_size,
+	long number, int *phas_suggested_max_write_rate, struct flow *fw,
+	struct feed *feed, struct verifier *verifier, struct journal *journal)
+{
+	const off_t pos = (off_t)number * region_size;
+	int saved_errno;
+
+	printf("Writing region %li ... ", number + 1);
+	fflush(stdout);
+	assert(lseek(fd, pos, SEEK_SET) == pos);
+	saved_errno = write_file_data(fd, pos,
+		raw_region_size(dev_size, region_size, number), fw, feed);
+	file_written(number, saved_errno, phas_suggested_max_write_rate,
+		verifier, journal);
+	return !saved_errno &&
+		number == raw_n_regions(dev_size, region_size) - 1;
+}
+
 static inline uint64_t get_freespace(const char *path)
 {
 	struct statvfs fs;
@@ -254,6 +674,13 @@ static inline void pr_freespace(uint64_t fs)
 	printf("Free space: %.2f %s\n", f, unit);
 }
 
+static inline void pr_devsize(uint64_t size)
+{
+	double f = (double)size;
+	const char *unit = adjust_unit(&f);
+	printf("Device size: %.2f %s\n", f, unit);
+}
+
 static inline void pr_avg_speed(double speed)
 {
 	const char *unit = adjust_unit(&speed);
@@ -272,50 +699,146 @@ static int flush_chunk(const struct flow *fw, int fd)
 	return 0;
 }
 
-static int fill_fs(const char *path, long start_at, long end_at,
-	long max_write_rate, int progress)
+/* Return the number of bytes to write to the file system of @path
+ * in files of @file_size bytes, and reduce *@pend_at to the last file
+ * that may fit.
+ * Return zero if there is no space.
+ */
+static uint64_t fs_write_size(const char *path, long start_at, long *pend_at,
+	uint64_t file_size)
 {
 	uint64_t free_space;
-	struct flow fw;
 	long i;
-	int has_suggested_max_write_rate = max_write_rate > 0;
-	struct timeval t1, t2;
 
 	free_space = get_freespace(path);
 	pr_freespace(free_space);
 	if (free_space <= 0) {
 		printf("No space!\n");
-		return 1;
+		return 0;
 	}
 
-	i = end_at - start_at + 1;
-	if (i > 0 && (uint64_t)i <= (free_space >> 30)) {
+	i = *pend_at - start_at + 1;
+	if (i > 0 && (uint64_t)i <= free_space / file_size) {
 		/* The amount of data to write is less than the space available,
 		 * update @free_space to improve estimate of time to finish.
 		 */
-		free_space = (uint64_t)i << 30;
+		free_space = (uint64_t)i * file_size;
 	} else {
 		/* There are more data to write than space available.
-		 * Reduce @end_at to reduce the number of error messages
+		 * Reduce *@pend_at to reduce the number of error messages
 		 * when multiple write failures happens.
 		 *
 		 * One should not subtract the value below of one because
-		 * the expression (free_space >> 30) is an integer division,
-		 * that is, it ignores the remainder.
+		 * the expression (free_space / file_size) is an integer
+		 * division, that is, it ignores the remainder.
 		 */
-		end_at = start_at + (free_space >> 30);
+		*pend_at = start_at + free_space / file_size;
+	}
+	return free_space;
+}
+
+/* If @raw is true, @path is a device that is written
+ * without a file system; see option --raw.
+ */
+static int fill_fs(const char *path, int raw, long start_at, long end_at,
+	uint64_t file_size, int preallocate, long max_write_rate,
+	int progress, int threads, int direct, int arena_flags, int verify,
+	FILE *stats_file, int stats_format, int flow, struct journal *journal)
+{
+	uint64_t free_space, dev_size = 0;
+	int raw_fd = -1;
+	struct flow fw;
+	struct feed feed;
+	struct verifier verifier;
+	struct arena *arena = NULL;
+	uint64_t tail;
+	int has_direct_io = direct;
+	int has_preallocation = preallocate;
+	long i;
+	int is_full = false;
+	int has_suggested_max_write_rate = max_write_rate > 0;
+	struct timeval t1, t2;
+
+	if (raw) {
+		raw_fd = open_raw_device(path, O_WRONLY, &has_direct_io,
+			&dev_size, &tail);
+		if (raw_fd < 0)
+			err(errno, "Can't open device %s", path);
+		pr_devsize(dev_size);
+		pr_raw_tail(tail);
+		if (end_at >= raw_n_regions(dev_size, file_size))
+			end_at = raw_n_regions(dev_size, file_size) - 1;
+		if (start_at > end_at) {
+			printf("The device has no region %li\n", start_at + 1);
+			close(raw_fd);
+			return 1;
+		}
+		free_space = (uint64_t)(end_at - start_at) * file_size +
+			raw_region_size(dev_size, file_size, end_at);
+	} else {
+		free_space = fs_write_size(path, start_at, &end_at,
+			file_size);
+		if (!free_space)
+			return 1;
+	}
+
+	feed.buf = NULL;
+	feed.pl = NULL;
+	if (threads > 0) {
+		feed.pl = create_pipeline(threads, MAX_BUFFER_SIZE,
+			arena_flags, fill_slot, NULL);
+		if (!feed.pl)
+			errx(1, "Can't create %i threads", threads);
+	} else {
+		arena = create_arena(MAX_BUFFER_SIZE, arena_flags);
+		if (!arena)
+			errx(1, "Out of memory");
+		feed.buf = arena_alloc(arena, MAX_BUFFER_SIZE,
+			DIRECT_IO_ORDER);
+		assert(feed.buf);
 	}
 
+	if (verify)
+		start_verifier(&verifier, path, raw, start_at, end_at,
+			file_size, threads, direct, arena_flags);
+
 	init_flow(&fw, free_space, max_write_rate, progress, flush_chunk);
+	flow_set_controller(&fw, flow);
+	if (stats_file)
+		flow_record_stats(&fw, stats_file, stats_format);
 	assert(!gettimeofday(&t1, NULL));
-	for (i = start_at; i <= end_at; i++)
-		if (create_and_fill_file(path, i, GIGABYTES,
-			&has_suggested_max_write_rate, &fw))
+	for (i = start_at; i <= end_at; i++) {
+		if (raw) {
+			is_full = fill_region(raw_fd, dev_size, file_size, i,
+				&has_suggested_max_write_rate, &fw, &feed,
+				verify ? &verifier : NULL, journal);
+			continue;
+		}
+		if (create_and_fill_file(path, i, file_size,
+			&has_suggested_max_write_rate, &fw, &feed, &has_direct_io,
+			&has_preallocation, verify ? &verifier : NULL,
+			journal)) {
+			is_full = true;
 			break;
+		}
+	}
 	assert(!gettimeofday(&t2, NULL));
+	if (raw)
+		close(raw_fd);
+
+	if (feed.pl)
+		free_pipeline(feed.pl);
+	if (arena)
+		free_arena(arena);
+
+	if (direct && !has_direct_io)
+		printf("WARNING: The file system does not support direct I/O, so the page cache was used\n");
+	if (preallocate && !has_preallocation)
+		printf("WARNING: The file system does not support preallocation, so files were not preallocated\n");
 
 	/* Final report. */
-	pr_freespace(get_freespace(path));
+	if (!raw)
+		pr_freespace(get_freespace(path));
 	/* Writing speed. */
 	if (has_enough_measurements(&fw)) {
 		pr_avg_speed(get_avg_speed(&fw));
@@ -332,22 +855,53 @@ static int fill_fs(const char *path, long start_at, long end_at,
 		}
 	}
 
+	if (verify)
+		stop_verifier(&verifier, direct);
+
+	if (journal && is_full && journal_append(journal, "full"))
+		err(errno, "Can't update the journal");
 	return 0;
 }
 
+/* Return the first file to write according to @journal, or
+ * -1 if the journal says that the disk is already full.
+ * The size of the files when the journal was started goes to
+ * *@pfile_size, or zero if the journal does not have it.
+ */
+static long resume_from_journal(struct journal *journal, long start_at,
+	uint64_t *pfile_size)
+{
+	char record[JOURNAL_MAX_RECORD];
+	long number, resume_at = start_at;
+
+	*pfile_size = 0;
+	while (journal_next(journal, record)) {
+		if (!strcmp(record, "full"))
+			return -1;
+		if (sscanf(record, "file-size %" SCNu64, pfile_size) == 1)
+			continue;
+		/* Files are written in order. */
+		if (sscanf(record, "written %li", &number) == 1 &&
+			number == resume_at)
+			resume_at++;
+	}
+	return resume_at;
+}
+
 static void unlink_old_files(const char *path, long start_at, long end_at)
 {
-	const long *files = ls_my_files(path, start_at, end_at);
-	const long *number = files;
-	while (*number >= 0) {
+	const struct h2w_file *files = ls_my_files(path, start_at, end_at,
+		false);
+	const struct h2w_file *file = files;
+	while (file->number >= 0) {
 		char *full_fn;
 		const char *filename;
-		full_fn = full_fn_from_number(&filename, path, *number);
+		full_fn = full_fn_from_number(&filename, path, file->number);
 		assert(full_fn);
 		printf("Removing old file %s ...\n", filename);
 		if (unlink(full_fn))
 			err(errno, "Can't remove file %s", full_fn);
-		number++;
+		file++;
 		free(full_fn);
 	}
 	free((void *)files);
@@ -355,6 +909,10 @@ static void unlink_old_files(const char *path, long start_at, long end_at)
 
 int main(int argc, char **argv)
 {
+	FILE *stats_file;
+	struct journal *journal = NULL;
+	int ret;
+
 	struct args args = {
 		/* Defaults. */
 		.start_at	= 0,
@@ -362,14 +920,74 @@ int main(int argc, char **argv)
 		.max_write_rate = 0,
 		/* If stdout isn't a terminal, suppress progress. */
 		.show_progress	= isatty(STDOUT_FILENO),
+		.threads	= 0,
+		.direct		= false,
+		.arena_flags	= 0,
+		.verify		= false,
+		.raw		= false,
+		.file_size	= DEFAULT_FILE_SIZE,
+		.preallocate	= false,
+		.pattern	= PATTERN_V1,
+		.stats_filename	= NULL,
+		.stats_format	= FLOW_STATS_CSV,
+		.flow		= FLOW_CLASSIC,
+		.journal_filename = NULL,
 	};
 
 	/* Read parameters. */
 	argp_parse(&argp, argc, argv, 0, NULL, &args);
 	print_header(stdout, "write");
+	pattern_set_version(args.pattern);
+
+	if (args.journal_filename) {
+		uint64_t file_size;
+		long resume_at;
+
+		journal = open_journal(args.journal_filename, "f3write");
+		if (!journal)
+			err(errno, "Can't open journal %s",
+				args.journal_filename);
+		resume_at = resume_from_journal(journal, args.start_at,
+			&file_size);
+		/* Files of another size would not line up with
+		 * those already written.
+		 */
+		if (file_size && file_size != args.file_size)
+			errx(1, "Journal %s was started with files of %" PRIu64 " MB, not %" PRIu64 " MB; use option --file-size=%" PRIu64,
+				args.journal_filename, file_size >> 20,
+				args.file_size >> 20, file_size >> 20);
+		if (!file_size && journal_append(journal,
+			"file-size %" PRIu64, args.file_size))
+			err(errno, "Can't update the journal");
+		if (resume_at < 0) {
+			printf("The disk is full according to journal %s\n",
+				args.journal_filename);
+			close_journal(journal);
+			return 0;
+		}
+		if (resume_at > args.start_at)
+			printf(args.raw
+				? "Resuming at region %li according to journal %s\n\n"
+				: "Resuming at file %li.h2w according to journal %s\n\n",
+				resume_at + 1, args.journal_filename);
+		args.start_at = resume_at;
+		if (args.start_at > args.end_at) {
+			close_journal(journal);
+			return 0;
+		}
+	}
 
-	unlink_old_files(args.dev_path, args.start_at, args.end_at);
-
-	return fill_fs(args.dev_path, args.start_at, args.end_at,
-		args.max_write_rate, args.show_progress);
+	if (!args.raw)
+		unlink_old_files(args.dev_path, args.start_at, args.end_at);
+
+	stats_file = open_stats_file(args.stats_filename);
+	ret = fill_fs(args.dev_path, args.raw, args.start_at, args.end_at,
+		args.file_size, args.preallocate, args.max_write_rate,
+		args.show_progress, args.threads, args.direct,
+		args.arena_flags, args.verify, stats_file, args.stats_format,
+		args.flow, journal);
+	close_stats_file(stats_file, args.stats_filename);
+	if (journal)
+		close_journal(journal);
+	return ret;
 }
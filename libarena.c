@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libarena.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* Size of the huge pages that MAP_HUGETLB gets when no size is given
+ * on most systems, e.g. x86-64 and ARM64 with 4KB pages.
+ */
+#define HUGEPAGE_SIZE	(2UL << 20)
+
+struct arena {
+	char	*mem;
+	size_t	len;
+	size_t	top;
+};
+
+static char *map_arena(size_t len, int flags)
+{
+	void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+struct arena *create_arena(size_t size, int flags)
+{
+	struct arena *a = malloc(sizeof(*a));
+	if (!a)
+		return NULL;
+
+	a->top = 0;
+	a->mem = NULL;
+	a->len = size > 0 ? size : 1;
+	if (flags & ARENA_HUGEPAGE) {
+		a->len = (a->len + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+		a->mem = map_arena(a->len, MAP_HUGETLB);
+#endif
+	}
+
+	if (!a->mem) {
+		a->mem = map_arena(a->len, 0);
+		if (!a->mem) {
+			free(a);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		/* The advice is only a hint, so its failure is harmless. */
+		if (flags & ARENA_HUGEPAGE)
+			madvise(a->mem, a->len, MADV_HUGEPAGE);
+#endif
+	}
+
+	if (flags & ARENA_LOCAL) {
+		const long page_size = sysconf(_SC_PAGESIZE);
+		volatile char *p;
+		for (p = a->mem; p < a->mem + a->len; p += page_size)
+			*p = 0;
+	}
+
+	return a;
+}
+
+void free_arena(struct arena *a)
+{
+	assert(!munmap(a->mem, a->len));
+	free(a);
+}
+
+void *arena_alloc(struct arena *a, size_t size, int order)
+{
+	const uintptr_t mask = ((uintptr_t)1 << order) - 1;
+	const uintptr_t p = ((uintptr_t)(a->mem + a->top) + mask) & ~mask;
+	const size_t top = p - (uintptr_t)a->mem + size;
+
+	if (top > a->len)
+		return NULL;
+	a->top = top;
+	return (void *)p;
+}
+
+size_t arena_mark(const struct arena *a)
+{
+	return a->top;
+}
+
+void arena_release(struct arena *a, size_t mark)
+{
+	assert(mark <= a->top);
+	a->top = mark;
+}
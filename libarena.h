@@ -0,0 +1,53 @@
+#ifndef HEADER_LIBARENA_H
+#define HEADER_LIBARENA_H
+
+#include <stddef.h>
+
+/*
+ * Arenas of buffers
+ *
+ * An arena holds the I/O buffers of a whole run, so buffers are neither
+ * faulted in, nor aligned again every time that they are needed.
+ *
+ * Buffers are taken and given back in LIFO order as if they were on
+ * a stack: arena_mark() records the top of the arena, and
+ * arena_release() gives back all buffers taken after that mark.
+ * Arenas are not thread safe, so each thread should have its own.
+ */
+
+/* Back the arena with huge pages.
+ * Pages reserved for MAP_HUGETLB are used when there are enough of them;
+ * otherwise, the arena asks for transparent huge pages.
+ */
+#define ARENA_HUGEPAGE	(1 << 0)
+
+/* Fault the whole arena in from the calling thread.
+ * Under the default NUMA policy, the memory then comes from the node
+ * that runs the thread, so each thread that creates its own arena
+ * works next to its memory.
+ */
+#define ARENA_LOCAL	(1 << 1)
+
+struct arena;
+
+/* Return NULL if there is not enough memory. */
+struct arena *create_arena(size_t size, int flags);
+void free_arena(struct arena *a);
+
+/* Return @size bytes aligned to 2^@order bytes, or NULL if
+ * the free part of @a is not enough.
+ */
+void *arena_alloc(struct arena *a, size_t size, int order);
+
+size_t arena_mark(const struct arena *a);
+void arena_release(struct arena *a, size_t mark);
+
+/* Size of an arena that holds @n buffers of @size bytes aligned to
+ * 2^@order bytes.
+ */
+static inline size_t arena_size(size_t n, size_t size, int order)
+{
+	return n * (size + ((size_t)1 << order) - 1);
+}
+
+#endif	/* HEADER_LIBARENA_H */
@@ -12,15 +12,20 @@
 #include <err.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <aio.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <linux/usbdevice_fs.h>
 #include <libudev.h>
 
 #include "libutils.h"
+#include "libpattern.h"
+#include "libarena.h"
 #include "libdevs.h"
 
 static const char * const ftype_to_name[FKTY_MAX] = {
@@ -85,17 +90,65 @@ enum fake_type dev_param_to_type(uint64_t real_size_byte,
 	return FKTY_LIMBO;
 }
 
+/* A request of a struct dev_queue. */
+struct dev_request {
+	char		*buf;
+	uint64_t	first_pos;
+	uint64_t	last_pos;
+	bool		is_write;
+
+	/* If false, the request has already been completed, and
+	 * @rc holds its result.
+	 */
+	bool		is_async;
+	int		rc;
+
+	/* Used by the block device. */
+	struct aiocb	cb;
+	/* Used by the perf device. */
+	uint64_t	t1_ns;
+	/* Used by the safe device. */
+	bool		not_forwarded;
+};
+
 struct device {
 	uint64_t	size_byte;
 	int		block_order;
+	/* Number of requests in flight through a struct dev_queue.
+	 * Queues may be used by different threads, so it is only
+	 * updated atomically.
+	 */
+	int		queued;
+	/* See dev_get_arena(). */
+	struct arena	*arena;
+	int		arena_flags;
 
 	int (*read_blocks)(struct device *dev, char *buf,
 		uint64_t first_pos, uint64_t last_pos);
 	int (*write_blocks)(struct device *dev, const char *buf,
 		uint64_t first_pos, uint64_t last_pos);
+	/* Optional methods; see dev_readv_blocks(). */
+	int (*readv_blocks)(struct device *dev, char *buf,
+		const uint64_t *positions, int n);
+	int (*writev_blocks)(struct device *dev, const char *buf,
+		const uint64_t *positions, int n);
 	int (*reset)(struct device *dev);
+	/* Optional method; see dev_flush(). */
+	int (*flush)(struct device *dev);
+	/* Optional method; see dev_discard_blocks(). */
+	int (*discard_blocks)(struct device *dev, uint64_t first_pos,
+		uint64_t last_pos, enum discard_type type);
 	void (*free)(struct device *dev);
 	const char *(*get_filename)(struct device *dev);
+
+	/* Optional methods to start a request and to wait for it.
+	 * If @submit is not NULL, @wait must not be NULL, and
+	 * @wait must be called for every submitted request
+	 * even if @submit completes it.
+	 * See dev_submit() and dev_wait().
+	 */
+	void (*submit)(struct device *dev, struct dev_request *req);
+	int (*wait)(struct device *dev, struct dev_request *req);
 };
 
 uint64_t dev_get_size_byte(struct device *dev)
@@ -118,6 +171,20 @@ const char *dev_get_filename(struct device *dev)
 	return dev->get_filename(dev);
 }
 
+void dev_set_arena_flags(struct device *dev, int flags)
+{
+	assert(!dev->arena);
+	dev->arena_flags = flags;
+}
+
+struct arena *dev_get_arena(struct device *dev)
+{
+	if (!dev->arena)
+		dev->arena = create_arena(DEV_ARENA_SIZE_BYTE,
+			dev->arena_flags);
+	return dev->arena;
+}
+
 int dev_read_blocks(struct device *dev, char *buf,
 	uint64_t first_pos, uint64_t last_pos)
 {
@@ -136,18 +203,260 @@ int dev_write_blocks(struct device *dev, const char *buf,
 	return dev->write_blocks(dev, buf, first_pos, last_pos);
 }
 
+/* Return the number of positions of the run of consecutive
+ * positions at the beginning of @positions.
+ */
+static inline int run_length(const uint64_t *positions, int n)
+{
+	int i = 1;
+	while (i < n && positions[i] == positions[i - 1] + 1)
+		i++;
+	return i;
+}
+
+/* Devices without vectored methods go through their runs. */
+static int dev_vec_by_runs(struct device *dev, char *buf,
+	const uint64_t *positions, int n, bool is_write)
+{
+	const int block_order = dev_get_block_order(dev);
+	int i = 0;
+
+	while (i < n) {
+		int len = run_length(positions + i, n - i);
+		uint64_t first_pos = positions[i];
+		uint64_t last_pos = first_pos + len - 1;
+		int rc = is_write
+			? dev->write_blocks(dev, buf, first_pos, last_pos)
+			: dev->read_blocks(dev, buf, first_pos, last_pos);
+		if (rc)
+			return rc;
+		buf += (size_t)len << block_order;
+		i += len;
+	}
+	return 0;
+}
+
+static void assert_positions(struct device *dev, const uint64_t *positions,
+	int n)
+{
+	int i;
+	for (i = 1; i < n; i++)
+		assert(positions[i - 1] < positions[i]);
+	assert(positions[n - 1] < (dev->size_byte >> dev->block_order));
+}
+
+int dev_readv_blocks(struct device *dev, char *buf,
+	const uint64_t *positions, int n)
+{
+	if (n <= 0)
+		return false;
+	assert_positions(dev, positions, n);
+	return dev->readv_blocks
+		? dev->readv_blocks(dev, buf, positions, n)
+		: dev_vec_by_runs(dev, buf, positions, n, false);
+}
+
+int dev_writev_blocks(struct device *dev, const char *buf,
+	const uint64_t *positions, int n)
+{
+	if (n <= 0)
+		return false;
+	assert_positions(dev, positions, n);
+	/* The buffer is not written to, see dev_vec_by_runs(). */
+	return dev->writev_blocks
+		? dev->writev_blocks(dev, buf, positions, n)
+		: dev_vec_by_runs(dev, (char *)buf, positions, n, true);
+}
+
 int dev_reset(struct device *dev)
 {
+	/* A reset may reopen the device under the requests. */
+	assert(!dev->queued);
 	return dev->reset ? dev->reset(dev) : 0;
 }
 
+int dev_flush(struct device *dev)
+{
+	/* Requests in flight would not be covered by the flush. */
+	assert(!dev->queued);
+	return dev->flush ? dev->flush(dev) : 0;
+}
+
+static const char * const discard_names[DISCARD_MAX] = {
+	[DISCARD_PLAIN]		= "plain",
+	[DISCARD_SECURE]	= "secure",
+};
+
+const char *discard_type_to_name(enum discard_type type)
+{
+	assert(type < DISCARD_MAX);
+	return discard_names[type];
+}
+
+int discard_type_from_name(const char *name)
+{
+	int i;
+	for (i = 0; i < DISCARD_MAX; i++)
+		if (!strcmp(name, discard_names[i]))
+			return i;
+	return -1;
+}
+
+int dev_discard_blocks(struct device *dev, uint64_t first_pos,
+	uint64_t last_pos, enum discard_type type)
+{
+	/* Requests in flight could land after the discard. */
+	assert(!dev->queued);
+	assert(type < DISCARD_MAX);
+	if (first_pos > last_pos)
+		return 0;
+	assert(last_pos < (dev->size_byte >> dev->block_order));
+	return dev->discard_blocks
+		? dev->discard_blocks(dev, first_pos, last_pos, type)
+		: EOPNOTSUPP;
+}
+
 void free_device(struct device *dev)
 {
+	assert(!dev->queued);
 	if (dev->free)
 		dev->free(dev);
+	if (dev->arena)
+		free_arena(dev->arena);
 	free(dev);
 }
 
+/* Devices without the methods submit and wait complete requests
+ * synchronously.
+ */
+static void dev_sync_request(struct device *dev, struct dev_request *req)
+{
+	req->is_async = false;
+	req->rc = req->is_write
+		? dev->write_blocks(dev, req->buf,
+			req->first_pos, req->last_pos)
+		: dev->read_blocks(dev, req->buf,
+			req->first_pos, req->last_pos);
+}
+
+static void dev_submit(struct device *dev, struct dev_request *req)
+{
+	if (dev->submit)
+		dev->submit(dev, req);
+	else
+		dev_sync_request(dev, req);
+}
+
+static int dev_wait(struct device *dev, struct dev_request *req)
+{
+	return dev->wait ? dev->wait(dev, req) : req->rc;
+}
+
+struct dev_queue {
+	struct device		*dev;
+	struct dev_request	*reqs;
+	int			depth;
+	/* Oldest request in flight. */
+	int			first;
+	int			n;
+};
+
+struct dev_queue *create_dev_queue(struct device *dev, int depth)
+{
+	struct dev_queue *q;
+
+	assert(depth > 0);
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return NULL;
+	q->reqs = calloc(depth, sizeof(*q->reqs));
+	if (!q->reqs) {
+		free(q);
+		return NULL;
+	}
+	q->dev = dev;
+	q->depth = depth;
+	q->first = 0;
+	q->n = 0;
+	return q;
+}
+
+void free_dev_queue(struct dev_queue *q)
+{
+	while (q->n > 0)
+		dev_queue_complete(q, NULL, NULL, NULL);
+	free(q->reqs);
+	free(q);
+}
+
+int dev_queue_is_full(const struct dev_queue *q)
+{
+	return q->n >= q->depth;
+}
+
+int dev_queue_pending(const struct dev_queue *q)
+{
+	return q->n;
+}
+
+static void dev_queue_submit(struct dev_queue *q, char *buf,
+	uint64_t first_pos, uint64_t last_pos, bool is_write)
+{
+	struct device *dev = q->dev;
+	struct dev_request *req;
+
+	assert(!dev_queue_is_full(q));
+	assert(first_pos <= last_pos);
+	assert(last_pos < (dev->size_byte >> dev->block_order));
+
+	req = &q->reqs[(q->first + q->n) % q->depth];
+	req->buf = buf;
+	req->first_pos = first_pos;
+	req->last_pos = last_pos;
+	req->is_write = is_write;
+	req->is_async = false;
+	req->rc = 0;
+	dev_submit(dev, req);
+	q->n++;
+	__sync_fetch_and_add(&dev->queued, 1);
+}
+
+void dev_queue_submit_read(struct dev_queue *q, char *buf,
+	uint64_t first_pos, uint64_t last_pos)
+{
+	dev_queue_submit(q, buf, first_pos, last_pos, false);
+}
+
+void dev_queue_submit_write(struct dev_queue *q, const char *buf,
+	uint64_t first_pos, uint64_t last_pos)
+{
+	/* The buffer is not written to, see dev_sync_request(). */
+	dev_queue_submit(q, (char *)buf, first_pos, last_pos, true);
+}
+
+int dev_queue_complete(struct dev_queue *q, char **pbuf,
+	uint64_t *pfirst_pos, uint64_t *plast_pos)
+{
+	struct dev_request *req;
+	int rc;
+
+	assert(q->n > 0);
+	req = &q->reqs[q->first];
+	rc = dev_wait(q->dev, req);
+	q->first = (q->first + 1) % q->depth;
+	q->n--;
+	__sync_fetch_and_sub(&q->dev->queued, 1);
+
+	if (pbuf)
+		*pbuf = req->buf;
+	if (pfirst_pos)
+		*pfirst_pos = req->first_pos;
+	if (plast_pos)
+		*plast_pos = req->last_pos;
+	return rc;
+}
+
 struct file_device {
 	/* This must be the first field. See dev_fdev() for details. */
 	struct device dev;
@@ -159,6 +468,8 @@ struct file_device {
 	uint64_t	cache_mask;
 	uint64_t	*cache_entries;
 	char		*cache_blocks;
+	/* Queues of different threads share the cache. */
+	pthread_mutex_t	cache_lock;
 };
 
 static inline struct file_device *dev_fdev(struct device *dev)
@@ -166,13 +477,57 @@ static inline struct file_device *dev_fdev(struct device *dev)
 	return (struct file_device *)dev;
 }
 
+/* Return the number of blocks from @first_pos to @last_pos that are
+ * in real memory and contiguous in the file, which is at least one
+ * if block @first_pos is in real memory, and zero otherwise.
+ * These blocks are read or written with a single system call.
+ */
+static uint64_t fdev_real_run(const struct file_device *fdev,
+	uint64_t first_pos, uint64_t last_pos, int block_order)
+{
+	const uint64_t offset = (first_pos << block_order) &
+		fdev->address_mask;
+	uint64_t n;
+
+	if (offset >= fdev->real_size_byte)
+		return 0;
+
+	for (n = 1; first_pos + n <= last_pos; n++) {
+		uint64_t next = ((first_pos + n) << block_order) &
+			fdev->address_mask;
+		if (next != offset + (n << block_order) ||
+			next >= fdev->real_size_byte)
+			break;
+	}
+	return n;
+}
+
+/* Blocks beyond the end of the file have never been written,
+ * so they are zeros.
+ */
+static void fdev_pread(struct file_device *fdev, char *buf, size_t count,
+	off_t offset)
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t rc = pread(fdev->fd, buf + done, count - done,
+			offset + done);
+		assert(rc >= 0);
+		if (!rc) {
+			/* Tried to read beyond the end of the file. */
+			memset(buf + done, 0, count - done);
+			break;
+		}
+		done += rc;
+	}
+}
+
 static int fdev_read_block(struct device *dev, char *buf, uint64_t block_pos)
 {
 	struct file_device *fdev = dev_fdev(dev);
 	const int block_size = dev_get_block_size(dev);
 	const int block_order = dev_get_block_order(dev);
-	off_t off_ret, offset = block_pos << block_order;
-	int done;
+	off_t offset = block_pos << block_order;
 
 	offset &= fdev->address_mask;
 	if ((uint64_t)offset >= fdev->real_size_byte) {
@@ -183,33 +538,20 @@ static int fdev_read_block(struct device *dev, char *buf, uint64_t block_pos)
 
 		cache_pos = block_pos & fdev->cache_mask;
 
+		assert(!pthread_mutex_lock(&fdev->cache_lock));
 		if (fdev->cache_entries &&
-			fdev->cache_entries[cache_pos] != block_pos)
+			fdev->cache_entries[cache_pos] != block_pos) {
+			assert(!pthread_mutex_unlock(&fdev->cache_lock));
 			goto no_block;
+		}
 
 		memmove(buf, &fdev->cache_blocks[cache_pos << block_order],
 			block_size);
+		assert(!pthread_mutex_unlock(&fdev->cache_lock));
 		return 0;
 	}
 
-	off_ret = lseek(fdev->fd, offset, SEEK_SET);
-	if (off_ret < 0)
-		return - errno;
-	assert(off_ret == offset);
-
-	done = 0;
-	do {
-		ssize_t rc = read(fdev->fd, buf + done, block_size - done);
-		assert(rc >= 0);
-		if (!rc) {
-			/* Tried to read beyond the end of the file. */
-			assert(!done);
-			memset(buf, 0, block_size);
-			done += block_size;
-		}
-		done += rc;
-	} while (done < block_size);
-
+	fdev_pread(fdev, buf, block_size, offset);
 	return 0;
 
 no_block:
@@ -220,23 +562,35 @@ no_block:
 static int fdev_read_blocks(struct device *dev, char *buf,
 		uint64_t first_pos, uint64_t last_pos)
 {
-	const int block_size = dev_get_block_size(dev);
-	uint64_t pos;
+	struct file_device *fdev = dev_fdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	uint64_t pos = first_pos;
 
-	for (pos = first_pos; pos <= last_pos; pos++) {
-		int rc = fdev_read_block(dev, buf, pos);
-		if (rc)
-			return rc;
-		buf += block_size;
+	while (pos <= last_pos) {
+		uint64_t n = fdev_real_run(fdev, pos, last_pos, block_order);
+
+		if (n) {
+			fdev_pread(fdev, buf, n << block_order,
+				(pos << block_order) & fdev->address_mask);
+		} else {
+			/* Cached and limbo blocks only cost a memmove(). */
+			int rc = fdev_read_block(dev, buf, pos);
+			if (rc)
+				return rc;
+			n = 1;
+		}
+		buf += n << block_order;
+		pos += n;
 	}
 	return 0;
 }
 
-static int write_all(int fd, const char *buf, size_t count)
+static int write_all(int fd, const char *buf, size_t count, off_t offset)
 {
 	size_t done = 0;
 	do {
-		ssize_t rc = write(fd, buf + done, count - done);
+		ssize_t rc = pwrite(fd, buf + done, count - done,
+			offset + done);
 		if (rc < 0) {
 			/* The write() failed. */
 			return errno;
@@ -252,7 +606,7 @@ static int fdev_write_block(struct device *dev, const char *buf,
 	struct file_device *fdev = dev_fdev(dev);
 	const int block_size = dev_get_block_size(dev);
 	const int block_order = dev_get_block_order(dev);
-	off_t off_ret, offset = block_pos << block_order;
+	off_t offset = block_pos << block_order;
 
 	offset &= fdev->address_mask;
 	if ((uint64_t)offset >= fdev->real_size_byte) {
@@ -262,34 +616,66 @@ static int fdev_write_block(struct device *dev, const char *buf,
 		if (!fdev->cache_blocks)
 			return 0; /* No cache available. */
 		cache_pos = block_pos & fdev->cache_mask;
+		assert(!pthread_mutex_lock(&fdev->cache_lock));
 		memmove(&fdev->cache_blocks[cache_pos << block_order],
 			buf, block_size);
 
 		if (fdev->cache_entries)
 			fdev->cache_entries[cache_pos] = block_pos;
+		assert(!pthread_mutex_unlock(&fdev->cache_lock));
 
 		return 0;
 	}
 
-	off_ret = lseek(fdev->fd, offset, SEEK_SET);
-	if (off_ret < 0)
-		return - errno;
-	assert(off_ret == offset);
-
-	return write_all(fdev->fd, buf, block_size);
+	return write_all(fdev->fd, buf, block_size, offset);
 }
 
 static int fdev_write_blocks(struct device *dev, const char *buf,
 		uint64_t first_pos, uint64_t last_pos)
 {
-	const int block_size = dev_get_block_size(dev);
-	uint64_t pos;
+	struct file_device *fdev = dev_fdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	uint64_t pos = first_pos;
+
+	while (pos <= last_pos) {
+		uint64_t n = fdev_real_run(fdev, pos, last_pos, block_order);
+		int rc = n
+			? write_all(fdev->fd, buf, n << block_order,
+				(pos << block_order) & fdev->address_mask)
+			: fdev_write_block(dev, buf, pos);
 
-	for (pos = first_pos; pos <= last_pos; pos++) {
-		int rc = fdev_write_block(dev, buf, pos);
 		if (rc)
 			return rc;
-		buf += block_size;
+		if (!n)
+			n = 1;
+		buf += n << block_order;
+		pos += n;
+	}
+	return 0;
+}
+
+/* Discarded blocks in real memory become holes of the file, so
+ * they read as zeros, as they do on most drives.
+ * The file has no copies of the blocks, so both types are the same.
+ */
+static int fdev_discard_blocks(struct device *dev, uint64_t first_pos,
+	uint64_t last_pos, enum discard_type type)
+{
+	struct file_device *fdev = dev_fdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	uint64_t pos = first_pos;
+
+	UNUSED(type);
+	while (pos <= last_pos) {
+		uint64_t n = fdev_real_run(fdev, pos, last_pos, block_order);
+
+		if (n && fallocate(fdev->fd,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(pos << block_order) & fdev->address_mask,
+			n << block_order))
+			return errno;
+		/* Blocks beyond real memory are left as they are. */
+		pos += n ? n : 1;
 	}
 	return 0;
 }
@@ -300,6 +686,7 @@ static void fdev_free(struct device *dev)
 	free(fdev->cache_blocks);
 	free(fdev->cache_entries);
 	free((void *)fdev->filename);
+	assert(!pthread_mutex_destroy(&fdev->cache_lock));
 	assert(!close(fdev->fd));
 }
 
@@ -371,11 +758,22 @@ struct device *create_file_device(const char *filename,
 
 	fdev->dev.size_byte = fake_size_byte;
 	fdev->dev.block_order = block_order;
+	fdev->dev.queued = 0;
+	fdev->dev.arena = NULL;
+	fdev->dev.arena_flags = 0;
 	fdev->dev.read_blocks = fdev_read_blocks;
 	fdev->dev.write_blocks = fdev_write_blocks;
 	fdev->dev.reset = NULL;
+	fdev->dev.flush = NULL;
+	fdev->dev.discard_blocks = fdev_discard_blocks;
+	/* Going through the runs is already a single pass. */
+	fdev->dev.readv_blocks = NULL;
+	fdev->dev.writev_blocks = NULL;
 	fdev->dev.free = fdev_free;
 	fdev->dev.get_filename = fdev_get_filename;
+	fdev->dev.submit = NULL;
+	fdev->dev.wait = NULL;
+	assert(!pthread_mutex_init(&fdev->cache_lock, NULL));
 
 	return &fdev->dev;
 
@@ -394,6 +792,357 @@ error:
 	return NULL;
 }
 
+/*
+ * Memory device
+ *
+ * It emulates the same drives that the file device does, but it keeps
+ * the blocks in sparse stores in memory, and blocks that were never
+ * written read as zeros. Most blocks that F3 writes are patterns, see
+ * fill_buffer_with_block(), so a store only keeps the first word and
+ * the seed of the chain of these blocks. Thus, drives of terabytes are
+ * emulated with little memory and no I/O.
+ */
+
+enum mem_block_kind {
+	/* calloc(3) leaves blocks zeroed, so this must be zero. */
+	MB_ZERO = 0,
+	MB_PATTERN,
+	MB_RAW,
+};
+
+struct mem_block {
+	enum mem_block_kind	kind;
+	/* Position of the block on the drive; only used by strict caches. */
+	uint64_t		tag;
+	/* Only used by kind MB_PATTERN. */
+	uint64_t		first_word;
+	uint64_t		seed;
+	/* Only used by kind MB_RAW. */
+	char			*data;
+};
+
+/* A leaf has 2^MEM_LEAF_ORDER blocks,
+ * and an interior node has 2^MEM_NODE_ORDER children.
+ */
+#define MEM_LEAF_ORDER	6
+#define MEM_NODE_ORDER	9
+
+/* Radix tree of blocks indexed by position. */
+struct mem_store {
+	void	*root;
+	/* Number of levels of interior nodes. */
+	int	levels;
+};
+
+static void init_mem_store(struct mem_store *st, uint64_t n_blocks)
+{
+	int bits = n_blocks > 1 ? ceiling_log2(n_blocks) : 0;
+
+	st->root = NULL;
+	st->levels = 0;
+	while (bits > MEM_LEAF_ORDER + st->levels * MEM_NODE_ORDER)
+		st->levels++;
+}
+
+/* Return NULL if @create is false and the block was never written,
+ * or if there is no memory to create the block.
+ */
+static struct mem_block *mem_store_get(struct mem_store *st, uint64_t pos,
+	int create)
+{
+	void **pnode = &st->root;
+	struct mem_block *leaf;
+	int level;
+
+	for (level = st->levels; level > 0; level--) {
+		void **node = *pnode;
+		int shift = MEM_LEAF_ORDER + (level - 1) * MEM_NODE_ORDER;
+
+		if (!node) {
+			if (!create)
+				return NULL;
+			node = calloc(1 << MEM_NODE_ORDER, sizeof(*node));
+			if (!node)
+				return NULL;
+			*pnode = node;
+		}
+		pnode = &node[(pos >> shift) & ((1 << MEM_NODE_ORDER) - 1)];
+	}
+
+	leaf = *pnode;
+	if (!leaf) {
+		if (!create)
+			return NULL;
+		leaf = calloc(1 << MEM_LEAF_ORDER, sizeof(*leaf));
+		if (!leaf)
+			return NULL;
+		*pnode = leaf;
+	}
+	return &leaf[pos & ((1 << MEM_LEAF_ORDER) - 1)];
+}
+
+static void free_mem_node(void *node, int level)
+{
+	int i;
+
+	if (!node)
+		return;
+	if (!level) {
+		struct mem_block *leaf = node;
+		for (i = 0; i < (1 << MEM_LEAF_ORDER); i++)
+			free(leaf[i].data);
+	} else {
+		void **children = node;
+		for (i = 0; i < (1 << MEM_NODE_ORDER); i++)
+			free_mem_node(children[i], level - 1);
+	}
+	free(node);
+}
+
+static void free_mem_store(struct mem_store *st)
+{
+	free_mem_node(st->root, st->levels);
+}
+
+static int mem_block_store(struct mem_block *blk, const char *buf,
+	int block_order)
+{
+	const uint64_t *words = (const uint64_t *)buf;
+	const int n = 1 << (block_order - 3);
+	uint64_t seed = pattern_seed_of(words[1]);
+
+	if (!pattern_count_mismatches(words + 1, n - 1, seed, 0)) {
+		free(blk->data);
+		blk->data = NULL;
+		blk->kind = MB_PATTERN;
+		blk->first_word = words[0];
+		blk->seed = seed;
+		return 0;
+	}
+
+	if (!blk->data) {
+		blk->data = malloc(1 << block_order);
+		if (!blk->data)
+			return - ENOMEM;
+	}
+	memcpy(blk->data, buf, 1 << block_order);
+	blk->kind = MB_RAW;
+	return 0;
+}
+
+static void mem_block_load(const struct mem_block *blk, char *buf,
+	int block_order)
+{
+	uint64_t *words = (uint64_t *)buf;
+	const int n = 1 << (block_order - 3);
+
+	switch (blk ? blk->kind : MB_ZERO) {
+	case MB_ZERO:
+		memset(buf, 0, 1 << block_order);
+		break;
+
+	case MB_PATTERN:
+		words[0] = blk->first_word;
+		pattern_fill(words + 1, n - 1, blk->seed);
+		break;
+
+	case MB_RAW:
+		memcpy(buf, blk->data, 1 << block_order);
+		break;
+
+	default:
+		assert(0);
+	}
+}
+
+struct memory_device {
+	/* This must be the first field. See dev_mdev() for details. */
+	struct device dev;
+
+	const char		*name;
+	uint64_t		real_size_byte;
+	uint64_t		address_mask;
+	int			has_cache;
+	int			strict_cache;
+	uint64_t		cache_mask;
+	struct mem_store	blocks;
+	struct mem_store	cache;
+	struct mem_latency	latency;
+};
+
+static inline struct memory_device *dev_mdev(struct device *dev)
+{
+	return (struct memory_device *)dev;
+}
+
+static void mdev_sleep(uint64_t ns)
+{
+	struct timespec req;
+
+	if (!ns)
+		return;
+	req.tv_sec = ns / 1000000000;
+	req.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &req, &req) == EINTR)
+		;
+}
+
+/* Find where the block at @block_pos is stored; NULL if it was never
+ * written, or if it is not stored at all.
+ */
+static struct mem_block *mdev_find_block(struct memory_device *mdev,
+	uint64_t block_pos, int create, int *pdropped)
+{
+	const int block_order = dev_get_block_order(&mdev->dev);
+	uint64_t offset = (block_pos << block_order) & mdev->address_mask;
+	struct mem_block *blk;
+
+	*pdropped = false;
+	if (offset < mdev->real_size_byte)
+		return mem_store_get(&mdev->blocks, offset >> block_order,
+			create);
+
+	/* Block beyond real memory. */
+	if (!mdev->has_cache) {
+		*pdropped = true;
+		return NULL;
+	}
+	blk = mem_store_get(&mdev->cache, block_pos & mdev->cache_mask,
+		create);
+	if (!create && blk && mdev->strict_cache && blk->tag != block_pos)
+		return NULL;
+	return blk;
+}
+
+static int mdev_read_blocks(struct device *dev, char *buf,
+		uint64_t first_pos, uint64_t last_pos)
+{
+	struct memory_device *mdev = dev_mdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	uint64_t pos;
+
+	mdev_sleep(mdev->latency.read_ns * (last_pos - first_pos + 1));
+	for (pos = first_pos; pos <= last_pos; pos++) {
+		int dropped;
+		mem_block_load(mdev_find_block(mdev, pos, false, &dropped),
+			buf, block_order);
+		buf += dev_get_block_size(dev);
+	}
+	return 0;
+}
+
+static int mdev_write_blocks(struct device *dev, const char *buf,
+		uint64_t first_pos, uint64_t last_pos)
+{
+	struct memory_device *mdev = dev_mdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	uint64_t pos;
+
+	mdev_sleep(mdev->latency.write_ns * (last_pos - first_pos + 1));
+	for (pos = first_pos; pos <= last_pos; pos++) {
+		int dropped, rc;
+		struct mem_block *blk = mdev_find_block(mdev, pos, true,
+			&dropped);
+
+		if (!blk) {
+			if (dropped)
+				goto next;
+			return - ENOMEM;
+		}
+		rc = mem_block_store(blk, buf, block_order);
+		if (rc)
+			return rc;
+		blk->tag = pos;
+next:
+		buf += dev_get_block_size(dev);
+	}
+	return 0;
+}
+
+static int mdev_reset(struct device *dev)
+{
+	mdev_sleep(dev_mdev(dev)->latency.reset_ns);
+	return 0;
+}
+
+static int mdev_flush(struct device *dev)
+{
+	mdev_sleep(dev_mdev(dev)->latency.flush_ns);
+	return 0;
+}
+
+static void mdev_free(struct device *dev)
+{
+	struct memory_device *mdev = dev_mdev(dev);
+	free_mem_store(&mdev->blocks);
+	free_mem_store(&mdev->cache);
+	free((void *)mdev->name);
+}
+
+static const char *mdev_get_filename(struct device *dev)
+{
+	return dev_mdev(dev)->name;
+}
+
+struct device *create_memory_device(const char *name,
+	uint64_t real_size_byte, uint64_t fake_size_byte, int wrap,
+	int block_order, int cache_order, int strict_cache,
+	const struct mem_latency *latency)
+{
+	struct memory_device *mdev;
+
+	if (!block_order)
+		block_order = 12;
+	if (!dev_param_valid(real_size_byte, fake_size_byte, wrap,
+		block_order))
+		goto error;
+
+	mdev = malloc(sizeof(*mdev));
+	if (!mdev)
+		goto error;
+
+	mdev->name = strdup(name);
+	if (!mdev->name)
+		goto mdev;
+
+	mdev->real_size_byte = real_size_byte;
+	mdev->address_mask = (((uint64_t)1) << wrap) - 1;
+	mdev->has_cache = cache_order >= 0;
+	mdev->strict_cache = mdev->has_cache && strict_cache;
+	mdev->cache_mask = mdev->has_cache
+		? (((uint64_t)1) << cache_order) - 1 : 0;
+	init_mem_store(&mdev->blocks, real_size_byte >> block_order);
+	init_mem_store(&mdev->cache, mdev->cache_mask + 1);
+	if (latency)
+		mdev->latency = *latency;
+	else
+		memset(&mdev->latency, 0, sizeof(mdev->latency));
+
+	mdev->dev.size_byte = fake_size_byte;
+	mdev->dev.block_order = block_order;
+	mdev->dev.queued = 0;
+	mdev->dev.arena = NULL;
+	mdev->dev.arena_flags = 0;
+	mdev->dev.read_blocks = mdev_read_blocks;
+	mdev->dev.write_blocks = mdev_write_blocks;
+	mdev->dev.reset = mdev_reset;
+	mdev->dev.flush = mdev_flush;
+	mdev->dev.discard_blocks = NULL;
+	mdev->dev.readv_blocks = NULL;
+	mdev->dev.writev_blocks = NULL;
+	mdev->dev.free = mdev_free;
+	mdev->dev.get_filename = mdev_get_filename;
+	mdev->dev.submit = NULL;
+	mdev->dev.wait = NULL;
+
+	return &mdev->dev;
+
+mdev:
+	free(mdev);
+error:
+	return NULL;
+}
+
 struct block_device {
 	/* This must be the first field. See dev_bdev() for details. */
 	struct device dev;
@@ -407,11 +1156,12 @@ static inline struct block_device *dev_bdev(struct device *dev)
 	return (struct block_device *)dev;
 }
 
-static int read_all(int fd, char *buf, size_t count)
+static int read_all(int fd, char *buf, size_t count, off_t offset)
 {
 	size_t done = 0;
 	do {
-		ssize_t rc = read(fd, buf + done, count - done);
+		ssize_t rc = pread(fd, buf + done, count - done,
+			offset + done);
 		if (rc < 0) {
 			if (errno == EINTR)
 				continue;
@@ -422,7 +1172,7 @@ static int read_all(int fd, char *buf, size_t count)
 			} else {
 				/* Execution should not come here. */
 				err(errno,
-					"%s(): unexpected error code from read(2) = %i",
+					"%s(): unexpected error code from pread(2) = %i",
 					__func__, errno);
 			}
 			return - errno;
@@ -440,11 +1190,33 @@ static int bdev_read_blocks(struct device *dev, char *buf,
 	const int block_order = dev_get_block_order(dev);
 	size_t length = (last_pos - first_pos + 1) << block_order;
 	off_t offset = first_pos << block_order;
-	off_t off_ret = lseek(bdev->fd, offset, SEEK_SET);
-	if (off_ret < 0)
-		return - errno;
-	assert(off_ret == offset);
-	return read_all(bdev->fd, buf, length);
+	return read_all(bdev->fd, buf, length, offset);
+}
+
+static int bdev_flush(struct device *dev)
+{
+	struct block_device *bdev = dev_bdev(dev);
+	int rc = fsync(bdev->fd);
+	if (rc)
+		return rc;
+	return posix_fadvise(bdev->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static int bdev_discard_blocks(struct device *dev, uint64_t first_pos,
+	uint64_t last_pos, enum discard_type type)
+{
+	struct block_device *bdev = dev_bdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	uint64_t range[2] = {
+		first_pos << block_order,
+		(last_pos - first_pos + 1) << block_order,
+	};
+
+	if (ioctl(bdev->fd, type == DISCARD_SECURE
+		? BLKSECDISCARD : BLKDISCARD, &range))
+		/* Drivers without discard may not know the ioctl. */
+		return errno == ENOTTY ? EOPNOTSUPP : errno;
+	return 0;
 }
 
 static int bdev_write_blocks(struct device *dev, const char *buf,
@@ -454,18 +1226,168 @@ static int bdev_write_blocks(struct device *dev, const char *buf,
 	const int block_order = dev_get_block_order(dev);
 	size_t length = (last_pos - first_pos + 1) << block_order;
 	off_t offset = first_pos << block_order;
-	off_t off_ret = lseek(bdev->fd, offset, SEEK_SET);
-	int rc;
-	if (off_ret < 0)
-		return - errno;
-	assert(off_ret == offset);
-	rc = write_all(bdev->fd, buf, length);
-	if (rc)
-		return rc;
-	rc = fsync(bdev->fd);
-	if (rc)
-		return rc;
-	return posix_fadvise(bdev->fd, 0, 0, POSIX_FADV_DONTNEED);
+	return write_all(bdev->fd, buf, length, offset);
+}
+
+static void bdev_submit(struct device *dev, struct dev_request *req)
+{
+	struct block_device *bdev = dev_bdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	struct aiocb *cb = &req->cb;
+
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = bdev->fd;
+	cb->aio_offset = req->first_pos << block_order;
+	cb->aio_buf = req->buf;
+	cb->aio_nbytes = (req->last_pos - req->first_pos + 1) << block_order;
+	cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+
+	if (req->is_write ? aio_write(cb) : aio_read(cb)) {
+		/* The system is out of resources for POSIX AIO,
+		 * or does not support it.
+		 */
+		dev_sync_request(dev, req);
+		return;
+	}
+
+	req->is_async = true;
+}
+
+/* Collect the result of the completed @cb, and finish a short transfer
+ * synchronously.
+ */
+static int bdev_finish_transfer(struct block_device *bdev,
+	struct aiocb *cb, bool is_write)
+{
+	int rc = aio_error(cb);
+	ssize_t ret = aio_return(cb);
+	size_t done = rc ? 0 : ret;
+
+	rc = - rc;
+	while (!rc && done < cb->aio_nbytes) {
+		char *buf = (char *)cb->aio_buf + done;
+		size_t count = cb->aio_nbytes - done;
+		off_t offset = cb->aio_offset + done;
+		ret = is_write
+			? pwrite(bdev->fd, buf, count, offset)
+			: pread(bdev->fd, buf, count, offset);
+		if (ret < 0) {
+			if (errno != EINTR)
+				rc = - errno;
+		} else if (!ret) {
+			/* We should never hit the end of the file. */
+			rc = - EIO;
+		} else {
+			done += ret;
+		}
+	}
+	return rc;
+}
+
+static int bdev_wait(struct device *dev, struct dev_request *req)
+{
+	struct block_device *bdev = dev_bdev(dev);
+	const struct aiocb *list[1] = { &req->cb };
+	struct aiocb *cb = &req->cb;
+
+	if (!req->is_async)
+		return req->rc;
+
+	while (aio_error(cb) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
+	return bdev_finish_transfer(bdev, cb, req->is_write);
+}
+
+/* Maximum number of runs submitted with a single lio_listio(3). */
+#define BDEV_MAX_LIO	64
+
+/* Transfer the runs of @positions with batches of lio_listio(3), so
+ * the cost of the calls is paid once per batch instead of once
+ * per run.
+ */
+static int bdev_vec_blocks(struct device *dev, char *buf,
+	const uint64_t *positions, int n, bool is_write)
+{
+	struct block_device *bdev = dev_bdev(dev);
+	const int block_order = dev_get_block_order(dev);
+	struct aiocb cbs[BDEV_MAX_LIO];
+	struct aiocb *list[BDEV_MAX_LIO];
+	int i = 0;
+
+	while (i < n) {
+		int j, n_cbs, rc = 0;
+
+		for (n_cbs = 0; n_cbs < BDEV_MAX_LIO && i < n; n_cbs++) {
+			struct aiocb *cb = &cbs[n_cbs];
+			int len = run_length(positions + i, n - i);
+
+			memset(cb, 0, sizeof(*cb));
+			cb->aio_fildes = bdev->fd;
+			cb->aio_offset = positions[i] << block_order;
+			cb->aio_buf = buf;
+			cb->aio_nbytes = (size_t)len << block_order;
+			cb->aio_lio_opcode = is_write ? LIO_WRITE : LIO_READ;
+			cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+			list[n_cbs] = cb;
+
+			buf += cb->aio_nbytes;
+			i += len;
+		}
+
+		if (lio_listio(LIO_WAIT, list, n_cbs, NULL)) {
+			/* The system may have run out of resources for
+			 * POSIX AIO, or not support it, and it's unclear
+			 * which requests were queued. Wait for any
+			 * queued request, and redo the batch synchronously.
+			 */
+			for (j = 0; j < n_cbs; j++) {
+				const struct aiocb *one[1] = { &cbs[j] };
+				while (aio_error(&cbs[j]) == EINPROGRESS)
+					aio_suspend(one, 1, NULL);
+				aio_return(&cbs[j]);
+			}
+			for (j = 0; j < n_cbs && !rc; j++) {
+				struct aiocb *cb = &cbs[j];
+				uint64_t first_pos =
+					cb->aio_offset >> block_order;
+				uint64_t last_pos = first_pos +
+					(cb->aio_nbytes >> block_order) - 1;
+				rc = is_write
+					? bdev_write_blocks(dev,
+						(const char *)cb->aio_buf,
+						first_pos, last_pos)
+					: bdev_read_blocks(dev,
+						(char *)cb->aio_buf,
+						first_pos, last_pos);
+			}
+			if (rc)
+				return rc;
+			continue;
+		}
+
+		for (j = 0; j < n_cbs; j++) {
+			int cb_rc = bdev_finish_transfer(bdev, &cbs[j],
+				is_write);
+			if (!rc)
+				rc = cb_rc;
+		}
+		if (rc)
+			return rc;
+	}
+	return 0;
+}
+
+static int bdev_readv_blocks(struct device *dev, char *buf,
+	const uint64_t *positions, int n)
+{
+	return bdev_vec_blocks(dev, buf, positions, n, false);
+}
+
+static int bdev_writev_blocks(struct device *dev, const char *buf,
+	const uint64_t *positions, int n)
+{
+	/* The buffer is not written to. */
+	return bdev_vec_blocks(dev, (char *)buf, positions, n, true);
 }
 
 static inline int bdev_open(const char *filename)
@@ -546,46 +1468,228 @@ static uint64_t get_udev_dev_size_byte(struct udev_device *dev)
 	return size_sector * 512LL;
 }
 
-static int wait_for_reset(struct udev *udev, const char *id_serial,
-	uint64_t original_size_byte, const char **pfinal_dev_filename)
+/*
+ * Shared udev monitor.
+ *
+ * All devices being reset at the same time share a single monitor.
+ * The waiter that finds no event in its mailbox takes the role of
+ * reader, receives the next event from the monitor, and delivers it
+ * to the mailboxes of the waiters whose drives have the serial of
+ * the event; the other waiters sleep until the reader delivers
+ * something or gives up the role.
+ *
+ * This keeps concurrent resets from stealing each other's events, and
+ * the number of netlink sockets constant.
+ */
+
+struct reset_event {
+	struct reset_event	*next;
+	const char		*action;
+	uint64_t		size_byte;
+	/* NULL if the event has no device node. */
+	const char		*devnode;
+};
+
+struct reset_waiter {
+	struct reset_waiter	*next;
+	const char		*id_serial;
+	/* Mailbox. */
+	struct reset_event	*first_event, **plast_event;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	/* Signaled when an event is delivered or the reader leaves. */
+	pthread_cond_t		changed;
+	struct udev		*udev;
+	struct udev_monitor	*mon;
+	struct reset_waiter	*waiters;
+	bool			has_reader;
+} shared_mon = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.changed	= PTHREAD_COND_INITIALIZER,
+	.udev		= NULL,
+	.mon		= NULL,
+	.waiters	= NULL,
+	.has_reader	= false,
+};
+
+static void free_reset_event(struct reset_event *event)
 {
-	bool done = false, went_to_zero = false, already_changed_size = false;
-	struct udev_monitor *mon;
-	int rc;
+	free((void *)event->action);
+	free((void *)event->devnode);
+	free(event);
+}
 
-	mon = create_monitor(udev, "block", "disk");
-	if (!mon) {
-		warnx("%s(): Can't instantiate a monitor", __func__);
-		rc = - ENOMEM;
-		goto out;
+static struct reset_event *new_reset_event(struct udev_device *dev)
+{
+	struct reset_event *event = malloc(sizeof(*event));
+	const char *action = udev_device_get_action(dev);
+	const char *devnode = udev_device_get_devnode(dev);
+
+	if (!event)
+		return NULL;
+	event->next = NULL;
+	event->action = strdup(action ? action : "");
+	event->size_byte = get_udev_dev_size_byte(dev);
+	event->devnode = devnode ? strdup(devnode) : NULL;
+	if (!event->action || (devnode && !event->devnode)) {
+		free_reset_event(event);
+		return NULL;
 	}
+	return event;
+}
 
-	do {
+/* The caller must hold @shared_mon.lock. */
+static int deliver_event(struct udev_device *dev)
+{
+	const char *id_serial = udev_device_get_property_value(dev,
+		"ID_SERIAL");
+	struct reset_waiter *w;
+
+	if (!id_serial)
+		return 0;
+
+	/* Cheap drives may share a serial, so every waiter that matches
+	 * receives the event.
+	 */
+	for (w = shared_mon.waiters; w; w = w->next) {
+		struct reset_event *event;
+
+		if (strcmp(w->id_serial, id_serial))
+			continue;
+		event = new_reset_event(dev);
+		if (!event)
+			return - ENOMEM;
+		*w->plast_event = event;
+		w->plast_event = &event->next;
+	}
+	return 0;
+}
+
+/* Start receiving the events of drives whose serial is @id_serial.
+ * Call this function before the drive is reset, so no event is lost.
+ */
+static int add_reset_waiter(struct reset_waiter *w, const char *id_serial)
+{
+	int rc = 0;
+
+	w->id_serial = id_serial;
+	w->first_event = NULL;
+	w->plast_event = &w->first_event;
+
+	assert(!pthread_mutex_lock(&shared_mon.lock));
+	if (!shared_mon.waiters) {
+		assert(!shared_mon.udev);
+		shared_mon.udev = udev_new();
+		if (!shared_mon.udev) {
+			warnx("Can't load library udev");
+			rc = - EOPNOTSUPP;
+			goto out;
+		}
+		shared_mon.mon = create_monitor(shared_mon.udev,
+			"block", "disk");
+	}
+	w->next = shared_mon.waiters;
+	shared_mon.waiters = w;
+
+out:
+	assert(!pthread_mutex_unlock(&shared_mon.lock));
+	return rc;
+}
+
+static void remove_reset_waiter(struct reset_waiter *w)
+{
+	struct reset_waiter **pw;
+
+	assert(!pthread_mutex_lock(&shared_mon.lock));
+	for (pw = &shared_mon.waiters; *pw != w; pw = &(*pw)->next)
+		assert(*pw);
+	*pw = w->next;
+
+	if (!shared_mon.waiters) {
+		/* Nobody can be reading because readers are waiters. */
+		assert(!shared_mon.has_reader);
+		assert(!udev_monitor_unref(shared_mon.mon));
+		assert(!udev_unref(shared_mon.udev));
+		shared_mon.mon = NULL;
+		shared_mon.udev = NULL;
+	}
+	assert(!pthread_mutex_unlock(&shared_mon.lock));
+
+	while (w->first_event) {
+		struct reset_event *event = w->first_event;
+		w->first_event = event->next;
+		free_reset_event(event);
+	}
+}
+
+/* Return the next event of @w, or NULL on failure.
+ * The caller must free the event with free_reset_event().
+ */
+static struct reset_event *next_reset_event(struct reset_waiter *w)
+{
+	struct reset_event *event;
+
+	assert(!pthread_mutex_lock(&shared_mon.lock));
+	while (!w->first_event) {
 		struct udev_device *dev;
-		const char *dev_id_serial, *action;
-		uint64_t new_size_byte;
-		const char *devnode;
+		int rc;
+
+		if (shared_mon.has_reader) {
+			assert(!pthread_cond_wait(&shared_mon.changed,
+				&shared_mon.lock));
+			continue;
+		}
 
-		dev = udev_monitor_receive_device(mon);
-		if (!dev) {
+		shared_mon.has_reader = true;
+		assert(!pthread_mutex_unlock(&shared_mon.lock));
+		dev = udev_monitor_receive_device(shared_mon.mon);
+		assert(!pthread_mutex_lock(&shared_mon.lock));
+		shared_mon.has_reader = false;
+
+		rc = dev ? deliver_event(dev) : - ENOMEM;
+		if (dev)
+			udev_device_unref(dev);
+		assert(!pthread_cond_broadcast(&shared_mon.changed));
+		if (rc) {
 			warnx("%s(): Can't monitor device", __func__);
-			rc = - ENOMEM;
-			goto mon;
+			assert(!pthread_mutex_unlock(&shared_mon.lock));
+			return NULL;
 		}
-		dev_id_serial = udev_device_get_property_value(dev,
-			"ID_SERIAL");
-		if (!dev_id_serial || strcmp(dev_id_serial, id_serial))
-			goto next;
+	}
 
-		action = udev_device_get_action(dev);
-		new_size_byte = get_udev_dev_size_byte(dev);
-		if (!strcmp(action, "add")) {
+	event = w->first_event;
+	w->first_event = event->next;
+	if (!w->first_event)
+		w->plast_event = &w->first_event;
+	assert(!pthread_mutex_unlock(&shared_mon.lock));
+	event->next = NULL;
+	return event;
+}
+
+static int wait_for_reset(struct reset_waiter *w,
+	uint64_t original_size_byte, const char **pfinal_dev_filename)
+{
+	bool done = false, went_to_zero = false, already_changed_size = false;
+
+	do {
+		struct reset_event *event;
+		uint64_t new_size_byte;
+		const char *devnode;
+
+		event = next_reset_event(w);
+		if (!event)
+			return - ENOMEM;
+
+		new_size_byte = event->size_byte;
+		if (!strcmp(event->action, "add")) {
 			/* Deal with the case in which the user pulls
 			 * the USB device.
 			 *
 			 * DO NOTHING.
 			 */
-		} else if (!strcmp(action, "change")) {
+		} else if (!strcmp(event->action, "change")) {
 			/* Deal with the case in which the user pulls
 			 * the memory card from the card reader.
 			 */
@@ -619,30 +1723,25 @@ static int wait_for_reset(struct udev *udev, const char *id_serial,
 
 			printf("\nThe reset failed. The drive has not returned to its original size.\n\n");
 			fflush(stdout);
-			rc = - ENXIO;
-			goto mon;
+			free_reset_event(event);
+			return - ENXIO;
 		}
 
-		devnode = strdup(udev_device_get_devnode(dev));
+		devnode = event->devnode ? strdup(event->devnode) : NULL;
 		if (!devnode) {
 			warnx("%s(): Out of memory", __func__);
-			rc = - ENOMEM;
-			goto mon;
+			free_reset_event(event);
+			return - ENOMEM;
 		}
 		free((void *)*pfinal_dev_filename);
 		*pfinal_dev_filename = devnode;
 		done = true;
 
 next:
-		udev_device_unref(dev);
+		free_reset_event(event);
 	} while (!done);
 
-	rc = 0;
-
-mon:
-	assert(!udev_monitor_unref(mon));
-out:
-	return rc;
+	return 0;
 }
 
 static int bdev_manual_usb_reset(struct device *dev)
@@ -650,6 +1749,7 @@ static int bdev_manual_usb_reset(struct device *dev)
 	struct block_device *bdev = dev_bdev(dev);
 	struct udev *udev;
 	struct udev_device *udev_dev, *usb_dev;
+	struct reset_waiter waiter;
 	const char *id_serial;
 	int rc;
 
@@ -691,6 +1791,10 @@ static int bdev_manual_usb_reset(struct device *dev)
 		goto usb_dev;
 	}
 
+	rc = add_reset_waiter(&waiter, id_serial);
+	if (rc)
+		goto usb_dev;
+
 	/* Close @bdev->fd before the drive is removed to increase
 	 * the chance that the device will receive the same filename.
 	 * The code is robust enough to deal with the case the drive doesn't
@@ -699,10 +1803,12 @@ static int bdev_manual_usb_reset(struct device *dev)
 	assert(!close(bdev->fd));
 	bdev->fd = -1;
 
-	printf("Please unplug and plug back the USB drive. Waiting...");
+	printf("Please unplug and plug back the USB drive `%s'. Waiting...",
+		bdev->filename);
 	fflush(stdout);
-	rc = wait_for_reset(udev, id_serial, dev_get_size_byte(dev),
+	rc = wait_for_reset(&waiter, dev_get_size_byte(dev),
 		&bdev->filename);
+	remove_reset_waiter(&waiter);
 	if (rc) {
 		assert(rc < 0);
 		goto usb_dev;
@@ -952,10 +2058,19 @@ struct device *create_block_device(const char *filename, enum reset_type rt)
 	assert(block_size == (1 << block_order));
 	bdev->dev.block_order = block_order;
 
+	bdev->dev.queued = 0;
+	bdev->dev.arena = NULL;
+	bdev->dev.arena_flags = 0;
 	bdev->dev.read_blocks = bdev_read_blocks;
 	bdev->dev.write_blocks = bdev_write_blocks;
 	bdev->dev.free = bdev_free;
 	bdev->dev.get_filename = bdev_get_filename;
+	bdev->dev.submit = bdev_submit;
+	bdev->dev.wait = bdev_wait;
+	bdev->dev.readv_blocks = bdev_readv_blocks;
+	bdev->dev.writev_blocks = bdev_writev_blocks;
+	bdev->dev.flush = bdev_flush;
+	bdev->dev.discard_blocks = bdev_discard_blocks;
 
 	return &bdev->dev;
 
@@ -980,11 +2095,16 @@ struct perf_device {
 	struct device		*shadow_dev;
 
 	uint64_t		read_count;
-	uint64_t		read_time_us;
+	uint64_t		read_time_ns;
+	struct lat_histogram	read_lat;
 	uint64_t		write_count;
-	uint64_t		write_time_us;
+	uint64_t		write_time_ns;
+	struct lat_histogram	write_lat;
 	uint64_t		reset_count;
-	uint64_t		reset_time_us;
+	uint64_t		reset_time_ns;
+	struct lat_histogram	reset_lat;
+	uint64_t		flush_count;
+	uint64_t		flush_time_ns;
 };
 
 static inline struct perf_device *dev_pdev(struct device *dev)
@@ -992,19 +2112,29 @@ static inline struct perf_device *dev_pdev(struct device *dev)
 	return (struct perf_device *)dev;
 }
 
+/* Account an operation on @n_blocks blocks that took @time_ns.
+ * The histograms are per block, so operations of different sizes
+ * are comparable.
+ */
+static inline void pdev_account(uint64_t *pcount, uint64_t *ptime_ns,
+	struct lat_histogram *lat, uint64_t n_blocks, uint64_t time_ns)
+{
+	*pcount += n_blocks;
+	*ptime_ns += time_ns;
+	lat_add(lat, time_ns / n_blocks, n_blocks);
+}
+
 static int pdev_read_blocks(struct device *dev, char *buf,
 		uint64_t first_pos, uint64_t last_pos)
 {
 	struct perf_device *pdev = dev_pdev(dev);
-	struct timeval t1, t2;
+	uint64_t t1 = now_ns();
 	int rc;
 
-	assert(!gettimeofday(&t1, NULL));
 	rc = pdev->shadow_dev->read_blocks(pdev->shadow_dev, buf,
 		first_pos, last_pos);
-	assert(!gettimeofday(&t2, NULL));
-	pdev->read_count += last_pos - first_pos + 1;
-	pdev->read_time_us += diff_timeval_us(&t1, &t2);
+	pdev_account(&pdev->read_count, &pdev->read_time_ns, &pdev->read_lat,
+		last_pos - first_pos + 1, now_ns() - t1);
 	return rc;
 }
 
@@ -1012,29 +2142,95 @@ static int pdev_write_blocks(struct device *dev, const char *buf,
 		uint64_t first_pos, uint64_t last_pos)
 {
 	struct perf_device *pdev = dev_pdev(dev);
-	struct timeval t1, t2;
+	uint64_t t1 = now_ns();
 	int rc;
 
-	assert(!gettimeofday(&t1, NULL));
 	rc = pdev->shadow_dev->write_blocks(pdev->shadow_dev, buf,
 		first_pos, last_pos);
-	assert(!gettimeofday(&t2, NULL));
-	pdev->write_count += last_pos - first_pos + 1;
-	pdev->write_time_us += diff_timeval_us(&t1, &t2);
+	pdev_account(&pdev->write_count, &pdev->write_time_ns,
+		&pdev->write_lat, last_pos - first_pos + 1, now_ns() - t1);
+	return rc;
+}
+
+static int pdev_readv_blocks(struct device *dev, char *buf,
+		const uint64_t *positions, int n)
+{
+	struct perf_device *pdev = dev_pdev(dev);
+	uint64_t t1 = now_ns();
+	int rc;
+
+	rc = dev_readv_blocks(pdev->shadow_dev, buf, positions, n);
+	pdev_account(&pdev->read_count, &pdev->read_time_ns, &pdev->read_lat,
+		n, now_ns() - t1);
+	return rc;
+}
+
+static int pdev_writev_blocks(struct device *dev, const char *buf,
+		const uint64_t *positions, int n)
+{
+	struct perf_device *pdev = dev_pdev(dev);
+	uint64_t t1 = now_ns();
+	int rc;
+
+	rc = dev_writev_blocks(pdev->shadow_dev, buf, positions, n);
+	pdev_account(&pdev->write_count, &pdev->write_time_ns,
+		&pdev->write_lat, n, now_ns() - t1);
 	return rc;
 }
 
 static int pdev_reset(struct device *dev)
 {
 	struct perf_device *pdev = dev_pdev(dev);
-	struct timeval t1, t2;
+	uint64_t t1 = now_ns();
 	int rc;
 
-	assert(!gettimeofday(&t1, NULL));
 	rc = dev_reset(pdev->shadow_dev);
-	assert(!gettimeofday(&t2, NULL));
-	pdev->reset_count++;
-	pdev->reset_time_us += diff_timeval_us(&t1, &t2);
+	pdev_account(&pdev->reset_count, &pdev->reset_time_ns,
+		&pdev->reset_lat, 1, now_ns() - t1);
+	return rc;
+}
+
+static int pdev_flush(struct device *dev)
+{
+	struct perf_device *pdev = dev_pdev(dev);
+	uint64_t t1 = now_ns();
+	int rc;
+
+	rc = dev_flush(pdev->shadow_dev);
+	pdev->flush_count++;
+	pdev->flush_time_ns += now_ns() - t1;
+	return rc;
+}
+
+static int pdev_discard_blocks(struct device *dev, uint64_t first_pos,
+	uint64_t last_pos, enum discard_type type)
+{
+	return dev_discard_blocks(dev_pdev(dev)->shadow_dev, first_pos,
+		last_pos, type);
+}
+
+static void pdev_submit(struct device *dev, struct dev_request *req)
+{
+	req->t1_ns = now_ns();
+	dev_submit(dev_pdev(dev)->shadow_dev, req);
+}
+
+/* Requests in flight overlap, so the accumulated times of
+ * queued requests are the sum of their latencies, not wall time.
+ */
+static int pdev_wait(struct device *dev, struct dev_request *req)
+{
+	struct perf_device *pdev = dev_pdev(dev);
+	uint64_t n_blocks = req->last_pos - req->first_pos + 1;
+	int rc;
+
+	rc = dev_wait(pdev->shadow_dev, req);
+	if (req->is_write)
+		pdev_account(&pdev->write_count, &pdev->write_time_ns,
+			&pdev->write_lat, n_blocks, now_ns() - req->t1_ns);
+	else
+		pdev_account(&pdev->read_count, &pdev->read_time_ns,
+			&pdev->read_lat, n_blocks, now_ns() - req->t1_ns);
 	return rc;
 }
 
@@ -1069,19 +2265,33 @@ struct device *create_perf_device(struct device *dev)
 
 	pdev->shadow_dev = dev;
 	pdev->read_count = 0;
-	pdev->read_time_us = 0;
+	pdev->read_time_ns = 0;
+	lat_init(&pdev->read_lat);
 	pdev->write_count = 0;
-	pdev->write_time_us = 0;
+	pdev->write_time_ns = 0;
+	lat_init(&pdev->write_lat);
 	pdev->reset_count = 0;
-	pdev->reset_time_us = 0;
+	pdev->reset_time_ns = 0;
+	lat_init(&pdev->reset_lat);
+	pdev->flush_count = 0;
+	pdev->flush_time_ns = 0;
 
 	pdev->dev.size_byte = dev->size_byte;
 	pdev->dev.block_order = dev->block_order;
+	pdev->dev.queued = 0;
+	pdev->dev.arena = NULL;
+	pdev->dev.arena_flags = 0;
 	pdev->dev.read_blocks = pdev_read_blocks;
 	pdev->dev.write_blocks = pdev_write_blocks;
+	pdev->dev.readv_blocks = pdev_readv_blocks;
+	pdev->dev.writev_blocks = pdev_writev_blocks;
 	pdev->dev.reset	= pdev_reset;
+	pdev->dev.flush = pdev_flush;
+	pdev->dev.discard_blocks = pdev_discard_blocks;
 	pdev->dev.free = pdev_free;
 	pdev->dev.get_filename = pdev_get_filename;
+	pdev->dev.submit = pdev_submit;
+	pdev->dev.wait = pdev_wait;
 
 	return &pdev->dev;
 }
@@ -1089,28 +2299,48 @@ struct device *create_perf_device(struct device *dev)
 void perf_device_sample(struct device *dev,
 	uint64_t *pread_count, uint64_t *pread_time_us,
 	uint64_t *pwrite_count, uint64_t *pwrite_time_us,
-	uint64_t *preset_count, uint64_t *preset_time_us)
+	uint64_t *preset_count, uint64_t *preset_time_us,
+	uint64_t *pflush_count, uint64_t *pflush_time_us,
+	struct lat_histogram *pread_lat, struct lat_histogram *pwrite_lat,
+	struct lat_histogram *preset_lat)
 {
 	struct perf_device *pdev = dev_pdev(dev);
 
 	if (pread_count)
 		*pread_count = pdev->read_count;
 	if (pread_time_us)
-		*pread_time_us = pdev->read_time_us;
+		*pread_time_us = pdev->read_time_ns / 1000;
+	if (pread_lat)
+		*pread_lat = pdev->read_lat;
 
 	if (pwrite_count)
 		*pwrite_count = pdev->write_count;
 	if (pwrite_time_us)
-		*pwrite_time_us = pdev->write_time_us;
+		*pwrite_time_us = pdev->write_time_ns / 1000;
+	if (pwrite_lat)
+		*pwrite_lat = pdev->write_lat;
 
 	if (preset_count)
 		*preset_count = pdev->reset_count;
 	if (preset_time_us)
-		*preset_time_us = pdev->reset_time_us;
+		*preset_time_us = pdev->reset_time_ns / 1000;
+	if (preset_lat)
+		*preset_lat = pdev->reset_lat;
+
+	if (pflush_count)
+		*pflush_count = pdev->flush_count;
+	if (pflush_time_us)
+		*pflush_time_us = pdev->flush_time_ns / 1000;
 }
 
-#define SDEV_BITMAP_WORD		long
-#define SDEV_BITMAP_BITS_PER_WORD	(8*sizeof(SDEV_BITMAP_WORD))
+/* A run of saved blocks; see struct safe_device. */
+struct sdev_run {
+	uint64_t		first_pos;
+	uint64_t		last_pos;
+	/* Index in @saved_blocks of the copy of @first_pos. */
+	uint64_t		sb_index;
+};
+
 struct safe_device {
 	/* This must be the first field. See dev_sdev() for details. */
 	struct device		dev;
@@ -1118,10 +2348,17 @@ struct safe_device {
 	struct device		*shadow_dev;
 
 	char			*saved_blocks;
-	uint64_t		*sb_positions;
-	SDEV_BITMAP_WORD	*sb_bitmap;
 	uint64_t		sb_n;
 	uint64_t		sb_max;
+
+	/* Runs of saved blocks sorted by position and without
+	 * overlaps, so looking up a block is a binary search, and
+	 * the memory used is proportional to the blocks saved,
+	 * not to the size of the drive.
+	 */
+	struct sdev_run		*runs;
+	uint64_t		n_runs;
+	uint64_t		max_runs;
 };
 
 static inline struct safe_device *dev_sdev(struct device *dev)
@@ -1137,46 +2374,71 @@ static int sdev_read_blocks(struct device *dev, char *buf,
 		first_pos, last_pos);
 }
 
-static int sdev_is_block_saved(struct safe_device *sdev, uint64_t pos)
+/* Return the index of the first run that ends at or after @pos,
+ * or @sdev->n_runs if there is none.
+ */
+static uint64_t sdev_find_run(const struct safe_device *sdev, uint64_t pos)
 {
-	lldiv_t idx;
-	SDEV_BITMAP_WORD set_bit;
-
-	if (!sdev->sb_bitmap) {
-		uint64_t i;
-		/* Running without bitmap. */
-		for (i = 0; i < sdev->sb_n; i++)
-			if (sdev->sb_positions[i] == pos) {
-				/* The block is already saved. */
-				return true;
-			}
-		return false;
+	uint64_t lo = 0, hi = sdev->n_runs;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (sdev->runs[mid].last_pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	idx = lldiv(pos, SDEV_BITMAP_BITS_PER_WORD);
-	set_bit = (SDEV_BITMAP_WORD)1 << idx.rem;
-	return !!(sdev->sb_bitmap[idx.quot] & set_bit);
+	return lo;
 }
 
-static void sdev_mark_blocks(struct safe_device *sdev,
+/* Record that the blocks from @first_pos to @last_pos have been saved
+ * at the end of @saved_blocks. These blocks must fall between run
+ * @i - 1 and run @i.
+ *
+ * Return the index of the run that follows the new blocks.
+ */
+static uint64_t sdev_mark_blocks(struct safe_device *sdev, uint64_t i,
 		uint64_t first_pos, uint64_t last_pos)
 {
-	uint64_t pos;
+	struct sdev_run *run;
 
-	for (pos = first_pos; pos <= last_pos; pos++) {
-		if (sdev->sb_bitmap) {
-			lldiv_t idx = lldiv(pos, SDEV_BITMAP_BITS_PER_WORD);
-			SDEV_BITMAP_WORD set_bit = (SDEV_BITMAP_WORD)1 <<
-				idx.rem;
-			sdev->sb_bitmap[idx.quot] |= set_bit;
+	/* Extend the previous run if it's contiguous both on the drive
+	 * and in @saved_blocks.
+	 */
+	if (i > 0) {
+		run = &sdev->runs[i - 1];
+		if (run->last_pos + 1 == first_pos && run->sb_index +
+				(run->last_pos - run->first_pos + 1) ==
+				sdev->sb_n) {
+			run->last_pos = last_pos;
+			sdev->sb_n += last_pos - first_pos + 1;
+			return i;
 		}
-		sdev->sb_positions[sdev->sb_n] = pos;
-		sdev->sb_n++;
 	}
+
+	if (sdev->n_runs == sdev->max_runs) {
+		/* Only when running with minimum memory. */
+		struct sdev_run *runs;
+		sdev->max_runs *= 2;
+		runs = realloc(sdev->runs, sdev->max_runs * sizeof(*runs));
+		assert(runs);
+		sdev->runs = runs;
+	}
+	memmove(&sdev->runs[i + 1], &sdev->runs[i],
+		(sdev->n_runs - i) * sizeof(*sdev->runs));
+	sdev->n_runs++;
+	run = &sdev->runs[i];
+	run->first_pos = first_pos;
+	run->last_pos = last_pos;
+	run->sb_index = sdev->sb_n;
+	sdev->sb_n += last_pos - first_pos + 1;
+	return i + 1;
 }
 
-/* Load blocks into cache. */
-static int sdev_load_blocks(struct safe_device *sdev,
+/* Load blocks into cache. The blocks must fall between run *@pi - 1
+ * and run *@pi. On success, *@pi is the index of the run that follows
+ * the loaded blocks.
+ */
+static int sdev_load_blocks(struct safe_device *sdev, uint64_t *pi,
 		uint64_t first_pos, uint64_t last_pos)
 {
 	const int block_order = dev_get_block_order(sdev->shadow_dev);
@@ -1192,39 +2454,35 @@ static int sdev_load_blocks(struct safe_device *sdev,
 		return rc;
 
 	/* Bookkeeping. */
-	sdev_mark_blocks(sdev, first_pos, last_pos);
+	*pi = sdev_mark_blocks(sdev, *pi, first_pos, last_pos);
 	return 0;
 }
 
 static int sdev_save_block(struct safe_device *sdev,
 		uint64_t first_pos, uint64_t last_pos)
 {
-	uint64_t pos, start_pos;
-	int rc;
+	uint64_t pos = first_pos;
+	uint64_t i = sdev_find_run(sdev, first_pos);
 
-	start_pos = first_pos;
-	for (pos = first_pos; pos <= last_pos; pos++) {
-		if (sdev_is_block_saved(sdev, pos)) {
-			if (start_pos < pos) {
-				/* The blocks haven't been saved before.
-				 * Save them now.
-				 */
-				rc = sdev_load_blocks(sdev, start_pos, pos - 1);
-				if (rc)
-					return rc;
-			} else if (start_pos == pos) {
-				/* Do nothing. */
-			} else {
-				assert(0);
-			}
-			start_pos = pos + 1;
+	while (pos <= last_pos) {
+		uint64_t end_pos;
+		int rc;
+
+		if (i < sdev->n_runs && sdev->runs[i].first_pos <= pos) {
+			/* Already saved. */
+			pos = sdev->runs[i].last_pos + 1;
+			i++;
+			continue;
 		}
-	}
 
-	if (start_pos <= last_pos) {
-		rc = sdev_load_blocks(sdev, start_pos, last_pos);
+		/* Save the blocks up to the next run. */
+		end_pos = i < sdev->n_runs &&
+			sdev->runs[i].first_pos <= last_pos
+			? sdev->runs[i].first_pos - 1 : last_pos;
+		rc = sdev_load_blocks(sdev, &i, pos, end_pos);
 		if (rc)
 			return rc;
+		pos = end_pos + 1;
 	}
 
 	return 0;
@@ -1243,11 +2501,65 @@ static int sdev_write_blocks(struct device *dev, const char *buf,
 		first_pos, last_pos);
 }
 
+static int sdev_readv_blocks(struct device *dev, char *buf,
+		const uint64_t *positions, int n)
+{
+	return dev_readv_blocks(dev_sdev(dev)->shadow_dev, buf, positions, n);
+}
+
+static int sdev_writev_blocks(struct device *dev, const char *buf,
+		const uint64_t *positions, int n)
+{
+	struct safe_device *sdev = dev_sdev(dev);
+	int i = 0;
+
+	while (i < n) {
+		int len = run_length(positions + i, n - i);
+		int rc = sdev_save_block(sdev, positions[i],
+			positions[i] + len - 1);
+		if (rc)
+			return rc;
+		i += len;
+	}
+
+	return dev_writev_blocks(sdev->shadow_dev, buf, positions, n);
+}
+
+static void sdev_submit(struct device *dev, struct dev_request *req)
+{
+	struct safe_device *sdev = dev_sdev(dev);
+
+	req->not_forwarded = false;
+	if (req->is_write) {
+		/* Saving the blocks is synchronous. */
+		int rc = sdev_save_block(sdev, req->first_pos, req->last_pos);
+		if (rc) {
+			req->not_forwarded = true;
+			req->is_async = false;
+			req->rc = rc;
+			return;
+		}
+	}
+	dev_submit(sdev->shadow_dev, req);
+}
+
+static int sdev_wait(struct device *dev, struct dev_request *req)
+{
+	if (req->not_forwarded)
+		return req->rc;
+	return dev_wait(dev_sdev(dev)->shadow_dev, req);
+}
+
 static int sdev_reset(struct device *dev)
 {
 	return dev_reset(dev_sdev(dev)->shadow_dev);
 }
 
+static int sdev_flush_shadow(struct device *dev)
+{
+	return dev_flush(dev_sdev(dev)->shadow_dev);
+}
+
 static void sdev_carefully_recover(struct safe_device *sdev, char *buffer,
 		uint64_t first_pos, uint64_t last_pos)
 {
@@ -1270,12 +2582,16 @@ static void sdev_carefully_recover(struct safe_device *sdev, char *buffer,
 	}
 }
 
-static uint64_t sdev_bitmap_length(struct device *dev)
+/* Number of writes in flight while recovering blocks. */
+#define SDEV_RECOVER_DEPTH	16
+
+static void sdev_complete_recovery(struct safe_device *sdev,
+	struct dev_queue *q)
 {
-	const int block_order = dev_get_block_order(dev);
-	lldiv_t idx = lldiv(dev_get_size_byte(dev) >> block_order,
-		SDEV_BITMAP_BITS_PER_WORD);
-	return (idx.quot + (idx.rem ? 1 : 0)) * sizeof(SDEV_BITMAP_WORD);
+	char *buf;
+	uint64_t first_pos, last_pos;
+	if (dev_queue_complete(q, &buf, &first_pos, &last_pos))
+		sdev_carefully_recover(sdev, buf, first_pos, last_pos);
 }
 
 void sdev_recover(struct device *dev, uint64_t very_last_pos)
@@ -1283,42 +2599,43 @@ void sdev_recover(struct device *dev, uint64_t very_last_pos)
 	struct safe_device *sdev = dev_sdev(dev);
 	const int block_order = dev_get_block_order(sdev->shadow_dev);
 	char *first_block = align_mem(sdev->saved_blocks, block_order);
-	uint64_t i, first_pos, last_pos;
-	char *start_buf;
-	int has_seq;
-
-	has_seq = false;
-	for (i = 0; i < sdev->sb_n; i++) {
-		uint64_t pos = sdev->sb_positions[i];
-
-		if (!has_seq) {
-			if (pos > very_last_pos)
-				continue;
+	struct dev_queue *q;
+	uint64_t i;
 
-			last_pos = first_pos = pos;
-			start_buf = first_block + (i << block_order);
-			has_seq = true;
-			continue;
-		}
+	/* Keep the writes in flight, and flush once at the end. */
+	q = create_dev_queue(sdev->shadow_dev, SDEV_RECOVER_DEPTH);
 
-		if (pos <= very_last_pos && pos == last_pos + 1) {
-			last_pos++;
+	/* The runs are sorted by position, so the writes sweep
+	 * the drive once.
+	 */
+	for (i = 0; i < sdev->n_runs; i++) {
+		const struct sdev_run *run = &sdev->runs[i];
+		char *buf = first_block + (run->sb_index << block_order);
+		uint64_t last_pos = run->last_pos;
+
+		if (run->first_pos > very_last_pos)
+			break;
+		if (last_pos > very_last_pos)
+			last_pos = very_last_pos;
+
+		if (!q) {
+			sdev_carefully_recover(sdev, buf, run->first_pos,
+				last_pos);
 			continue;
 		}
-
-		sdev_carefully_recover(sdev, start_buf, first_pos, last_pos);
-
-		has_seq = pos <= very_last_pos;
-		if (has_seq) {
-			last_pos = first_pos = pos;
-			start_buf = first_block + (i << block_order);
-		}
+		if (dev_queue_is_full(q))
+			sdev_complete_recovery(sdev, q);
+		dev_queue_submit_write(q, buf, run->first_pos, last_pos);
 	}
 
-	if (has_seq) {
-		sdev_carefully_recover(sdev, start_buf, first_pos, last_pos);
-		has_seq = false;
+	if (q) {
+		while (dev_queue_pending(q) > 0)
+			sdev_complete_recovery(sdev, q);
+		free_dev_queue(q);
 	}
+
+	if (dev_flush(sdev->shadow_dev))
+		warn("Failed to flush the recovered blocks");
 }
 
 void sdev_flush(struct device *dev)
@@ -1329,10 +2646,15 @@ void sdev_flush(struct device *dev)
 		return;
 
 	sdev->sb_n = 0;
+	sdev->n_runs = 0;
+}
 
-	if (sdev->sb_bitmap)
-		memset(sdev->sb_bitmap, 0,
-			sdev_bitmap_length(sdev->shadow_dev));
+uint64_t sdev_used_memory_byte(struct device *dev)
+{
+	struct safe_device *sdev = dev_sdev(dev);
+	const int block_order = dev_get_block_order(sdev->shadow_dev);
+	return (sdev->sb_n << block_order) +
+		sdev->n_runs * sizeof(*sdev->runs);
 }
 
 static void sdev_free(struct device *dev)
@@ -1342,8 +2664,7 @@ static void sdev_free(struct device *dev)
 	sdev_recover(dev, UINT_LEAST64_MAX);
 	sdev_flush(dev);
 
-	free(sdev->sb_bitmap);
-	free(sdev->sb_positions);
+	free(sdev->runs);
 	free(sdev->saved_blocks);
 	free_device(sdev->shadow_dev);
 }
@@ -1369,19 +2690,16 @@ struct device *create_safe_device(struct device *dev, uint64_t max_blocks,
 	if (!sdev->saved_blocks)
 		goto sdev;
 
-	sdev->sb_positions = malloc(max_blocks * sizeof(*sdev->sb_positions));
-	if (!sdev->sb_positions)
+	/* There can't be more runs than saved blocks, so, unless asked
+	 * to use minimum memory, allocate all runs upfront.
+	 */
+	sdev->max_runs = min_memory ? 64 : max_blocks;
+	if (sdev->max_runs < 1)
+		sdev->max_runs = 1;
+	sdev->runs = malloc(sdev->max_runs * sizeof(*sdev->runs));
+	if (!sdev->runs)
 		goto saved_blocks;
-
-	if (!min_memory) {
-		length = sdev_bitmap_length(dev);
-		sdev->sb_bitmap = malloc(length);
-		if (!sdev->sb_bitmap)
-			goto offsets;
-		memset(sdev->sb_bitmap, 0, length);
-	} else {
-		sdev->sb_bitmap = NULL;
-	}
+	sdev->n_runs = 0;
 
 	sdev->shadow_dev = dev;
 	sdev->sb_n = 0;
@@ -1389,16 +2707,24 @@ struct device *create_safe_device(struct device *dev, uint64_t max_blocks,
 
 	sdev->dev.size_byte = dev->size_byte;
 	sdev->dev.block_order = block_order;
+	sdev->dev.queued = 0;
+	sdev->dev.arena = NULL;
+	sdev->dev.arena_flags = 0;
 	sdev->dev.read_blocks = sdev_read_blocks;
 	sdev->dev.write_blocks = sdev_write_blocks;
+	sdev->dev.readv_blocks = sdev_readv_blocks;
+	sdev->dev.writev_blocks = sdev_writev_blocks;
 	sdev->dev.reset	= sdev_reset;
+	sdev->dev.flush = sdev_flush_shadow;
+	/* Discarded blocks could not be restored. */
+	sdev->dev.discard_blocks = NULL;
 	sdev->dev.free = sdev_free;
 	sdev->dev.get_filename = sdev_get_filename;
+	sdev->dev.submit = sdev_submit;
+	sdev->dev.wait = sdev_wait;
 
 	return &sdev->dev;
 
-offsets:
-	free(sdev->sb_positions);
 saved_blocks:
 	free(sdev->saved_blocks);
 sdev:
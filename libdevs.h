@@ -69,9 +69,117 @@ int dev_read_blocks(struct device *dev, char *buf,
 int dev_write_blocks(struct device *dev, const char *buf,
 	uint64_t first_pos, uint64_t last_pos);
 
+/* Vectored versions of the functions above.
+ * Transfer the block at each of the @n @positions, which must be in
+ * increasing order, from or to the consecutive blocks of @buf.
+ * Devices can then batch the transfers instead of paying
+ * the cost of a call per block.
+ */
+int dev_readv_blocks(struct device *dev, char *buf,
+	const uint64_t *positions, int n);
+int dev_writev_blocks(struct device *dev, const char *buf,
+	const uint64_t *positions, int n);
+
 int dev_reset(struct device *dev);
+
+/* Make sure that all written blocks have reached the medium, and that
+ * later reads don't come from caches of the system.
+ * Writes don't flush on their own, so callers can batch writes
+ * before a single flush; a flush is needed before a reset and
+ * before reads that must see the medium.
+ */
+int dev_flush(struct device *dev);
+
+enum discard_type {
+	/* BLKDISCARD: the drive may drop the blocks whenever it wants. */
+	DISCARD_PLAIN,
+	/* BLKSECDISCARD: the blocks, and all copies of them, are erased
+	 * before the call returns.
+	 */
+	DISCARD_SECURE,
+	DISCARD_MAX
+};
+
+const char *discard_type_to_name(enum discard_type type);
+/* Return -1 if @name is not a discard type. */
+int discard_type_from_name(const char *name);
+
+/* Tell @dev that the blocks from @first_pos to @last_pos are no longer
+ * needed, so flash drives can erase them ahead of later writes, and
+ * tests that follow start from a known state.
+ * What the discarded blocks read afterwards depends on the drive.
+ * Return zero, or the error; EOPNOTSUPP if @dev does not support
+ * discarding blocks, which callers should take as a reason to go on
+ * without discarding.
+ */
+int dev_discard_blocks(struct device *dev, uint64_t first_pos,
+	uint64_t last_pos, enum discard_type type);
+
 void free_device(struct device *dev);
 
+/*
+ *	Buffers
+ */
+
+struct arena;
+
+/* Size of the arena of a device; it holds, at least, the buffers of
+ * a sequential scan with eight big blocks in flight.
+ */
+#define DEV_ARENA_SIZE_BYTE	(9 * BIG_BLOCK_SIZE_BYTE)
+
+/* Return an arena of DEV_ARENA_SIZE_BYTE bytes for the buffers of
+ * the I/O with @dev, or NULL if out of memory; see libarena.h.
+ * The arena is created at the first call, so that it is close to
+ * the thread that uses @dev, and it lasts until free_device().
+ * Like dev_reset(), this function is not thread safe.
+ */
+struct arena *dev_get_arena(struct device *dev);
+
+/* Set the flags of create_arena() for the arena of @dev.
+ * It must be called before dev_get_arena().
+ */
+void dev_set_arena_flags(struct device *dev, int flags);
+
+/*
+ *	Queued I/O
+ *
+ * A queue keeps up to @depth requests in flight on a device, so
+ * the device doesn't go idle in between requests of sequential scans.
+ * Requests complete in the order that they are submitted.
+ * Devices that don't support asynchronous I/O complete requests
+ * as they are submitted.
+ *
+ * The buffers of the requests must stay untouched until
+ * the requests complete, and all requests must be completed before
+ * calling dev_reset(), dev_flush(), or free_device().
+ *
+ * Different threads may use different queues of the same file or
+ * block device at the same time. Other devices, and dev_reset() and
+ * dev_flush() of any device, are not thread safe.
+ */
+
+struct dev_queue;
+
+struct dev_queue *create_dev_queue(struct device *dev, int depth);
+/* Complete all pending requests, and free @q. */
+void free_dev_queue(struct dev_queue *q);
+
+int dev_queue_is_full(const struct dev_queue *q);
+int dev_queue_pending(const struct dev_queue *q);
+
+/* The queue must not be full. */
+void dev_queue_submit_read(struct dev_queue *q, char *buf,
+	uint64_t first_pos, uint64_t last_pos);
+void dev_queue_submit_write(struct dev_queue *q, const char *buf,
+	uint64_t first_pos, uint64_t last_pos);
+
+/* Wait for the oldest pending request, and return its result.
+ * The output parameters identify the request, and can be NULL.
+ */
+int dev_queue_complete(struct dev_queue *q, char **pbuf,
+	uint64_t *pfirst_pos, uint64_t *plast_pos);
+
 /*
  *	Concrete devices
  */
@@ -81,6 +189,25 @@ struct device *create_file_device(const char *filename,
 	int block_order, int cache_order, int strict_cache,
 	int keep_file);
 
+/* Latencies that the memory device simulates, in nanoseconds. */
+struct mem_latency {
+	/* Per block. */
+	uint64_t	read_ns;
+	uint64_t	write_ns;
+	/* Per call. */
+	uint64_t	reset_ns;
+	uint64_t	flush_ns;
+};
+
+/* Emulate the same drive that create_file_device() does, but in memory.
+ * @name is only reported by dev_get_filename(), and
+ * @latency can be NULL for no latencies.
+ */
+struct device *create_memory_device(const char *name,
+	uint64_t real_size_byte, uint64_t fake_size_byte, int wrap,
+	int block_order, int cache_order, int strict_cache,
+	const struct mem_latency *latency);
+
 enum reset_type {
 	RT_MANUAL_USB = 0,
 	RT_USB,
@@ -90,11 +217,20 @@ enum reset_type {
 
 struct device *create_block_device(const char *filename, enum reset_type rt);
 
+struct lat_histogram;
+
 struct device *create_perf_device(struct device *dev);
+/* Any of the pointers may be NULL.
+ * The histograms are of the latencies per block in nanoseconds;
+ * a reset counts as a single block.
+ */
 void perf_device_sample(struct device *dev,
 	uint64_t *pread_count, uint64_t *pread_time_us,
 	uint64_t *pwrite_count, uint64_t *pwrite_time_us,
-	uint64_t *preset_count, uint64_t *preset_time_us);
+	uint64_t *preset_count, uint64_t *preset_time_us,
+	uint64_t *pflush_count, uint64_t *pflush_time_us,
+	struct lat_histogram *pread_lat, struct lat_histogram *pwrite_lat,
+	struct lat_histogram *preset_lat);
 /* Detach the shadow device of @pdev, free @pdev, and return
  * the shadow device.
  */
@@ -105,5 +241,10 @@ struct device *create_safe_device(struct device *dev, uint64_t max_blocks,
 
 void sdev_recover(struct device *dev, uint64_t very_last_pos);
 void sdev_flush(struct device *dev);
+/* Memory taken by the blocks saved since the last sdev_flush(),
+ * and by their bookkeeping. Blocks are only saved, so this is also
+ * the peak since then.
+ */
+uint64_t sdev_used_memory_byte(struct device *dev);
 
 #endif	/* HEADER_LIBDEVS_H */
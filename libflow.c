@@ -3,13 +3,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
 #include <float.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "libflow.h"
 #include "utils.h"
+#include "libutils.h"
 
 static inline void move_to_inc_at_start(struct flow *fw)
 {
@@ -33,14 +38,73 @@ void init_flow(struct flow *fw, uint64_t total_size,
 	fw->measured_time_ms	= 0;
 	fw->erase		= 0;
 	fw->func_flush_chunk	= func_flush_chunk;
+	fw->stats_file		= NULL;
+	fw->stats_format	= FLOW_STATS_CSV;
 	fw->processed_blocks	= 0;
 	fw->acc_delay_us	= 0;
+	fw->controller		= FLOW_CLASSIC;
+	fw->t1_ns		= 0;
+	fw->flush_ns		= 0;
+	fw->window_bytes	= 0;
+	fw->window_us		= 0;
+	fw->smooth_speed	= 0;
+	fw->pace_ns		= 0;
 	assert(fw->block_size > 0);
 	assert(fw->block_size % SECTOR_SIZE == 0);
 
 	move_to_inc_at_start(fw);
 }
 
+static const char *const stats_format_names[] = {
+	[FLOW_STATS_CSV]	= "csv",
+	[FLOW_STATS_JSON]	= "json",
+};
+
+int flow_stats_format_from_name(const char *name)
+{
+	int i;
+	for (i = 0; i < (int)(sizeof(stats_format_names) /
+			sizeof(stats_format_names[0])); i++)
+		if (!strcmp(name, stats_format_names[i]))
+			return i;
+	return -1;
+}
+
+void flow_set_controller(struct flow *fw, enum flow_controller controller)
+{
+	fw->controller = controller;
+	if (controller == FLOW_SMOOTH) {
+		fw->state = FW_SMOOTH;
+		fw->flush_ns = fw->pace_ns = now_ns();
+	}
+}
+
+static const char *const controller_names[] = {
+	[FLOW_CLASSIC]	= "classic",
+	[FLOW_SMOOTH]	= "smooth",
+};
+
+int flow_controller_from_name(const char *name)
+{
+	int i;
+	for (i = 0; i < (int)(sizeof(controller_names) /
+			sizeof(controller_names[0])); i++)
+		if (!strcmp(name, controller_names[i]))
+			return i;
+	return -1;
+}
+
+void flow_record_stats(struct flow *fw, FILE *stats_file,
+	enum flow_stats_format format)
+{
+	fw->stats_file = stats_file;
+	fw->stats_format = format;
+	assert(!gettimeofday(&fw->stats_t0, NULL));
+	if (format == FLOW_STATS_CSV)
+		fprintf(stats_file, "time_ms,offset,interval_ms,"
+			"blocks_per_delay,speed,state,flush_us\n");
+}
+
 static inline void repeat_ch(char ch, int count)
 {
 	while (count > 0) {
@@ -119,7 +183,10 @@ static void report_progress(struct flow *fw, double inst_speed)
 
 static inline void __start_measurement(struct flow *fw)
 {
-	assert(!gettimeofday(&fw->t1, NULL));
+	if (fw->controller == FLOW_SMOOTH)
+		fw->t1_ns = now_ns();
+	else
+		assert(!gettimeofday(&fw->t1, NULL));
 }
 
 void start_measurement(struct flow *fw)
@@ -204,19 +271,148 @@ static inline int flush_chunk(const struct flow *fw, int fd)
 	return 0;
 }
 
-/* XXX Avoid duplicate this function, which was copied from libutils.h. */
-static inline uint64_t diff_timeval_us(const struct timeval *t1,
-	const struct timeval *t2)
+static const char *const state_names[] = {
+	[FW_INC]	= "inc",
+	[FW_DEC]	= "dec",
+	[FW_SEARCH]	= "search",
+	[FW_STEADY]	= "steady",
+	[FW_SMOOTH]	= "smooth",
+};
+
+/* Write a line to the sink of @fw about the interval that has just
+ * been measured.
+ * Since this happens once per measurement, i.e. about once a second,
+ * its cost is negligible.
+ */
+static void record_stats(const struct flow *fw, const struct timeval *t2,
+	uint64_t delay, double inst_speed, int state, uint64_t flush_us)
 {
-	return (t2->tv_sec - t1->tv_sec) * 1000000ULL +
-		t2->tv_usec - t1->tv_usec;
+	uint64_t time_ms = diff_timeval_us(&fw->stats_t0, t2) / 1000;
+	uint64_t offset = fw->total_processed -
+		fw->processed_blocks * fw->block_size;
+
+	if (fw->stats_format == FLOW_STATS_JSON)
+		fprintf(fw->stats_file, "{\"time_ms\": %" PRIu64
+			", \"offset\": %" PRIu64
+			", \"interval_ms\": %" PRIu64
+			", \"blocks_per_delay\": %" PRIi64
+			", \"speed\": %.0f, \"state\": \"%s\""
+			", \"flush_us\": %" PRIu64 "}\n",
+			time_ms, offset, delay, fw->blocks_per_delay,
+			inst_speed, state_names[state], flush_us);
+	else
+		fprintf(fw->stats_file, "%" PRIu64 ",%" PRIu64 ",%" PRIu64
+			",%" PRIi64 ",%.0f,%s,%" PRIu64 "\n",
+			time_ms, offset, delay, fw->blocks_per_delay,
+			inst_speed, state_names[state], flush_us);
+}
+
+/*
+ * Smooth controller
+ *
+ * Flushes are what make the measured speed the speed of the drive
+ * instead of the speed of the page cache, so the speed is only
+ * measured over the windows between flushes, and a moving average of
+ * these speeds sizes the chunks. Progress is still reported at every
+ * measurement.
+ */
+
+/* Flushes are at least this far apart. */
+#define SMOOTH_FLUSH_MS		4000
+/* Weight of the speed of the last window in the moving average. */
+#define SMOOTH_ALPHA		0.25
+/* Capacity of the token bucket in milliseconds at the maximum rate. */
+#define SMOOTH_BURST_MS		1000
+
+static int measure_smooth(int fd, struct flow *fw)
+{
+	const uint64_t bytes = fw->processed_blocks * fw->block_size;
+	uint64_t t2 = now_ns(), delay_us, flush_us = 0;
+	double inst_speed, speed, target;
+	int flushed = false;
+
+	if (t2 - fw->flush_ns >= SMOOTH_FLUSH_MS * 1000000ULL) {
+		uint64_t f1 = t2;
+		if (flush_chunk(fw, fd) < 0)
+			return -1; /* Caller can read errno(3). */
+		t2 = now_ns();
+		flush_us = (t2 - f1) / 1000;
+		fw->flush_ns = t2;
+		flushed = true;
+	}
+
+	if (fw->max_process_rate < DBL_MAX) {
+		/* An empty bucket is at @fw->pace_ns, a full one is
+		 * SMOOTH_BURST_MS earlier.
+		 */
+		const uint64_t burst_ns = SMOOTH_BURST_MS * 1000000ULL;
+		if (fw->pace_ns + burst_ns < t2)
+			fw->pace_ns = t2 - burst_ns;
+		fw->pace_ns += bytes / fw->max_process_rate * 1e9;
+		if (fw->pace_ns > t2) {
+			msleep((fw->pace_ns - t2) / 1e6);
+			t2 = now_ns();
+		}
+	}
+
+	delay_us = (t2 - fw->t1_ns) / 1000 + fw->acc_delay_us;
+	if (!delay_us)
+		delay_us = 1;
+	inst_speed = bytes * 1e6 / delay_us;
+
+	fw->window_bytes += bytes;
+	fw->window_us += delay_us;
+	if (flushed) {
+		double window_speed = fw->window_bytes * 1e6 / fw->window_us;
+		fw->smooth_speed = fw->smooth_speed > 0
+			? fw->smooth_speed +
+				SMOOTH_ALPHA * (window_speed - fw->smooth_speed)
+			: window_speed;
+		fw->window_bytes = 0;
+		fw->window_us = 0;
+	}
+
+	/* Update mean. */
+	fw->measured_blocks += fw->processed_blocks;
+	fw->measured_time_ms += delay_us / 1000;
+
+	if (fw->stats_file) {
+		struct timeval now;
+		assert(!gettimeofday(&now, NULL));
+		record_stats(fw, &now, delay_us / 1000, inst_speed,
+			fw->state, flush_us);
+	}
+
+	/* Size the next chunk to take @fw->delay_ms. Before the first
+	 * flush, only the speed of the last chunk is known.
+	 */
+	speed = fw->smooth_speed > 0 ? fw->smooth_speed : inst_speed;
+	/* Don't wait for flushes to slow down. */
+	if (delay_us > 2000ULL * fw->delay_ms && inst_speed < speed)
+		speed = inst_speed;
+	target = speed * fw->delay_ms / 1000 / fw->block_size;
+	/* Grow gently, so a burst into the page cache is not taken
+	 * as the speed of the drive.
+	 */
+	if (target > 2.0 * fw->blocks_per_delay)
+		target = 2.0 * fw->blocks_per_delay;
+	fw->blocks_per_delay = target >= 1 ? (int64_t)target : 1;
+
+	if (fw->progress)
+		report_progress(fw, speed);
+
+	/* Reset accumulators. */
+	fw->processed_blocks = 0;
+	fw->acc_delay_us = 0;
+	__start_measurement(fw);
+	return 0;
 }
 
 int measure(int fd, struct flow *fw, long processed)
 {
 	ldiv_t result = ldiv(processed, fw->block_size);
 	struct timeval t2;
-	uint64_t delay;
+	uint64_t delay, flush_us = 0;
 	double bytes_k, inst_speed;
 
 	assert(result.rem == 0);
@@ -227,10 +423,21 @@ int measure(int fd, struct flow *fw, long processed)
 		return 0;
 	assert(fw->processed_blocks == fw->blocks_per_delay);
 
-	if (flush_chunk(fw, fd) < 0)
-		return -1; /* Caller can read errno(3). */
-
-	assert(!gettimeofday(&t2, NULL));
+	if (fw->controller == FLOW_SMOOTH)
+		return measure_smooth(fd, fw);
+
+	if (fw->stats_file) {
+		struct timeval f1;
+		assert(!gettimeofday(&f1, NULL));
+		if (flush_chunk(fw, fd) < 0)
+			return -1; /* Caller can read errno(3). */
+		assert(!gettimeofday(&t2, NULL));
+		flush_us = diff_timeval_us(&f1, &t2);
+	} else {
+		if (flush_chunk(fw, fd) < 0)
+			return -1; /* Caller can read errno(3). */
+		assert(!gettimeofday(&t2, NULL));
+	}
 	delay = (diff_timeval_us(&fw->t1, &t2) + fw->acc_delay_us) / 1000;
 
 	/* Instantaneous speed in bytes per second. */
@@ -270,6 +477,10 @@ int measure(int fd, struct flow *fw, long processed)
 	fw->measured_blocks += fw->processed_blocks;
 	fw->measured_time_ms += delay;
 
+	/* The state that chose @fw->blocks_per_delay is the one recorded. */
+	if (fw->stats_file)
+		record_stats(fw, &t2, delay, inst_speed, fw->state, flush_us);
+
 	switch (fw->state) {
 	case FW_INC:
 		if (is_rate_above(fw, delay, inst_speed)) {
@@ -351,8 +562,14 @@ int end_measurement(int fd, struct flow *fw)
 	}
 
 	/* Save time in between closing ongoing file and creating a new file. */
-	assert(!gettimeofday(&t2, NULL));
-	fw->acc_delay_us += diff_timeval_us(&fw->t1, &t2);
+	if (fw->controller == FLOW_SMOOTH) {
+		uint64_t now = now_ns();
+		fw->flush_ns = now;
+		fw->acc_delay_us += (now - fw->t1_ns) / 1000;
+	} else {
+		assert(!gettimeofday(&t2, NULL));
+		fw->acc_delay_us += diff_timeval_us(&fw->t1, &t2);
+	}
 
 out:
 	/* Erase progress information. */
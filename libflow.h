@@ -2,9 +2,18 @@
 #define HEADER_LIBFLOW_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
 
 struct flow;
 
+enum flow_stats_format {FLOW_STATS_CSV, FLOW_STATS_JSON};
+
+/* How the size of the chunks between measurements is tuned;
+ * see flow_set_controller().
+ */
+enum flow_controller {FLOW_CLASSIC, FLOW_SMOOTH};
+
 typedef int (*flow_func_flush_chunk_t)(const struct flow *fw, int fd);
 
 struct flow {
@@ -29,7 +38,7 @@ struct flow {
 	/* Measured time. */
 	uint64_t	measured_time_ms;
 	/* State. */
-	enum {FW_INC, FW_DEC, FW_SEARCH, FW_STEADY} state;
+	enum {FW_INC, FW_DEC, FW_SEARCH, FW_STEADY, FW_SMOOTH} state;
 	/* Number of characters to erase before printing out progress. */
 	int		erase;
 
@@ -38,6 +47,16 @@ struct flow {
 	 */
 	flow_func_flush_chunk_t func_flush_chunk;
 
+	/*
+	 * Telemetry; see flow_record_stats()
+	 */
+
+	/* Sink of the measurements; NULL if none. */
+	FILE		*stats_file;
+	enum flow_stats_format stats_format;
+	/* Time at which the recording started. */
+	struct timeval	stats_t0;
+
 	/*
 	 * Initialized while measuring
 	 */
@@ -53,6 +72,28 @@ struct flow {
 	int64_t		bpd1, bpd2;
 	/* Time measurements. */
 	struct timeval	t1;
+
+	/*
+	 * Smooth controller; see flow_set_controller()
+	 */
+
+	enum flow_controller controller;
+	/* Monotonic time of the start of the measurement, and of
+	 * the last flush in nanoseconds.
+	 */
+	uint64_t	t1_ns;
+	uint64_t	flush_ns;
+	/* Bytes and microseconds processed since the last flush. */
+	uint64_t	window_bytes;
+	uint64_t	window_us;
+	/* Smoothed processing speed in bytes per second; zero until
+	 * the first flush.
+	 */
+	double		smooth_speed;
+	/* Monotonic time at which the bytes processed so far are
+	 * allowed by @max_process_rate in nanoseconds.
+	 */
+	uint64_t	pace_ns;
 };
 
 /* If @max_process_rate <= 0, the maximum processing rate is infinity.
@@ -62,6 +103,36 @@ void init_flow(struct flow *fw, uint64_t total_size,
 	long max_process_rate, int progress,
 	flow_func_flush_chunk_t func_flush_chunk);
 
+/* Record every measurement of @fw as a line of @stats_file.
+ * A line has the time since this call, the offset of the measured
+ * interval in the flow, the interval length, the number of blocks
+ * the flow aimed at, the instantaneous speed, the state of the flow,
+ * and the time spent flushing the interval.
+ */
+void flow_record_stats(struct flow *fw, FILE *stats_file,
+	enum flow_stats_format format);
+
+/* Return the format named @name, or -1 if there is no such format. */
+int flow_stats_format_from_name(const char *name);
+
+/* Select the controller of @fw before it starts measuring.
+ *
+ * FLOW_CLASSIC, the default, flushes at every measurement, and
+ * searches for the chunk size that takes about a second with
+ * the states FW_INC, FW_DEC, FW_SEARCH, and FW_STEADY.
+ *
+ * FLOW_SMOOTH still measures about every second, but only flushes
+ * every few seconds. It sizes chunks from a moving average of
+ * the speed measured between flushes, and paces the maximum rate
+ * with a token bucket, so the chunk sizes do not oscillate.
+ */
+void flow_set_controller(struct flow *fw, enum flow_controller controller);
+
+/* Return the controller named @name, or -1 if there is no such
+ * controller.
+ */
+int flow_controller_from_name(const char *name);
+
 void start_measurement(struct flow *fw);
 int measure(int fd, struct flow *fw, long processed);
 int end_measurement(int fd, struct flow *fw);
@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200112L
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "libjournal.h"
+
+struct journal {
+	FILE	*f;
+};
+
+/* Read a whole line of @f into @line; return false at the end of
+ * the file, or if the last line was cut short.
+ */
+static bool read_line(FILE *f, char *line)
+{
+	size_t len;
+
+	if (!fgets(line, JOURNAL_MAX_RECORD, f))
+		return false;
+	len = strlen(line);
+	if (len == 0 || line[len - 1] != '\n')
+		return false;
+	line[len - 1] = '\0';
+	return true;
+}
+
+static int sync_journal(struct journal *j)
+{
+	if (fflush(j->f))
+		return -1;
+	return fsync(fileno(j->f));
+}
+
+struct journal *open_journal(const char *filename, const char *kind)
+{
+	char header[JOURNAL_MAX_RECORD], line[JOURNAL_MAX_RECORD];
+	struct journal *j;
+	long header_end, good_end;
+	int fd, saved_errno;
+
+	j = malloc(sizeof(*j));
+	if (!j)
+		return NULL;
+
+	fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		goto journal;
+	j->f = fdopen(fd, "r+");
+	if (!j->f) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		goto journal;
+	}
+
+	assert(snprintf(header, sizeof(header), "F3 journal %s", kind) <
+		(int)sizeof(header));
+	if (!read_line(j->f, line)) {
+		/* A new journal, or one whose header didn't make it. */
+		if (fseek(j->f, 0, SEEK_SET) || ftruncate(fd, 0) ||
+			fprintf(j->f, "%s\n", header) < 0 || sync_journal(j))
+			goto file;
+	} else if (strcmp(line, header)) {
+		errno = EINVAL;
+		goto file;
+	}
+
+	/* Drop a record cut short by a crash. */
+	header_end = good_end = ftell(j->f);
+	while (read_line(j->f, line))
+		good_end = ftell(j->f);
+	if (good_end < 0 || ftruncate(fd, good_end) ||
+		fseek(j->f, header_end, SEEK_SET))
+		goto file;
+	return j;
+
+file:
+	saved_errno = errno;
+	fclose(j->f);
+	errno = saved_errno;
+journal:
+	free(j);
+	return NULL;
+}
+
+void close_journal(struct journal *j)
+{
+	fclose(j->f);
+	free(j);
+}
+
+int journal_next(struct journal *j, char *record)
+{
+	return read_line(j->f, record);
+}
+
+int journal_append(struct journal *j, const char *fmt, ...)
+{
+	va_list ap;
+	int rc;
+
+	/* Switching from reading to writing requires a seek. */
+	if (fseek(j->f, 0, SEEK_END))
+		return -1;
+	va_start(ap, fmt);
+	rc = vfprintf(j->f, fmt, ap);
+	va_end(ap);
+	if (rc < 0 || fputc('\n', j->f) == EOF)
+		return -1;
+	return sync_journal(j);
+}
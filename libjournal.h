@@ -0,0 +1,40 @@
+#ifndef HEADER_LIBJOURNAL_H
+#define HEADER_LIBJOURNAL_H
+
+#include <stddef.h>
+
+/*
+ * Journals of sessions
+ *
+ * A journal is a text file that records the progress of a long session,
+ * so an interrupted session can resume where it stopped.
+ * Every record is a line that is on the disk when journal_append()
+ * returns, and a record cut short by a crash is dropped when
+ * the journal is opened again.
+ */
+
+struct journal;
+
+/* Open the journal @filename of a session of @kind, e.g. "f3read",
+ * and create it if it doesn't exist.
+ * Return NULL and set errno on failure; EINVAL means that @filename
+ * is not a journal of @kind.
+ */
+struct journal *open_journal(const char *filename, const char *kind);
+void close_journal(struct journal *j);
+
+#define JOURNAL_MAX_RECORD	256
+
+/* Read the next record of @j into @record, which must have
+ * JOURNAL_MAX_RECORD bytes, without the newline.
+ * Return false if there are no more records.
+ */
+int journal_next(struct journal *j, char *record);
+
+/* Append a record to @j; @fmt must not have newlines.
+ * Return zero, or -1 with errno set.
+ */
+int journal_append(struct journal *j, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif	/* HEADER_LIBJOURNAL_H */
@@ -0,0 +1,618 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "libpattern.h"
+
+/*
+ * Jumping ahead.
+ *
+ * Applying x -> A*x + C twice is x -> (A*A)*x + (A*C + C), so,
+ * composing that step with itself, one gets the constants that
+ * move a word k positions down the chain. Independent lanes seeded
+ * with k consecutive words can then advance k words at a time;
+ * this is what every kernel below does.
+ */
+
+#define LCG_A	4294967311ULL
+#define LCG_C	17ULL
+
+#define LCG_A2	(LCG_A * LCG_A)
+#define LCG_C2	(LCG_A * LCG_C + LCG_C)
+#define LCG_A4	(LCG_A2 * LCG_A2)
+#define LCG_C4	(LCG_A2 * LCG_C2 + LCG_C2)
+#define LCG_A8	(LCG_A4 * LCG_A4)
+#define LCG_C8	(LCG_A4 * LCG_C4 + LCG_C4)
+#define LCG_A16	(LCG_A8 * LCG_A8)
+#define LCG_C16	(LCG_A8 * LCG_C8 + LCG_C8)
+
+/* Seed @lanes with the @n words that follow @seed. */
+static inline void seed_lanes(uint64_t *lanes, int n, uint64_t seed)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		lanes[i] = seed = pattern_next(seed);
+}
+
+/* The lanes hold the next words of the chain when a kernel leaves
+ * its main loop, and fewer words than lanes remain, so the tail
+ * comes straight from the lanes.
+ */
+
+static inline void fill_tail(uint64_t *words, int n, const uint64_t *lanes)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		words[i] = lanes[i];
+}
+
+static inline int count_tail(const uint64_t *words, int n,
+	const uint64_t *lanes, int count)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		count += words[i] != lanes[i];
+	return count;
+}
+
+/*
+ * Generic kernels.
+ *
+ * Four chains are enough to keep the multiplier of most processors
+ * busy, and compilers vectorize them where they can.
+ */
+
+#define GENERIC_LANES	4
+
+static inline void advance_generic(uint64_t *x)
+{
+	x[0] = x[0] * LCG_A4 + LCG_C4;
+	x[1] = x[1] * LCG_A4 + LCG_C4;
+	x[2] = x[2] * LCG_A4 + LCG_C4;
+	x[3] = x[3] * LCG_A4 + LCG_C4;
+}
+
+static void fill_generic(uint64_t *words, int n, uint64_t seed)
+{
+	uint64_t x[GENERIC_LANES];
+	int i;
+
+	seed_lanes(x, GENERIC_LANES, seed);
+	for (i = 0; i + GENERIC_LANES <= n; i += GENERIC_LANES) {
+		words[i]     = x[0];
+		words[i + 1] = x[1];
+		words[i + 2] = x[2];
+		words[i + 3] = x[3];
+		advance_generic(x);
+	}
+	fill_tail(words + i, n - i, x);
+}
+
+static int count_generic(const uint64_t *words, int n, uint64_t seed,
+	int max)
+{
+	uint64_t x[GENERIC_LANES];
+	int i, count = 0;
+
+	seed_lanes(x, GENERIC_LANES, seed);
+	for (i = 0; i + GENERIC_LANES <= n; i += GENERIC_LANES) {
+		count += (words[i] != x[0]) + (words[i + 1] != x[1]) +
+			(words[i + 2] != x[2]) + (words[i + 3] != x[3]);
+		if (count > max)
+			return count;
+		advance_generic(x);
+	}
+	return count_tail(words + i, n - i, x, count);
+}
+
+struct pattern_kernel {
+	const char	*name;
+	void		(*fill)(uint64_t *words, int n, uint64_t seed);
+	int		(*count_mismatches)(const uint64_t *words, int n,
+		uint64_t seed, int max);
+};
+
+static const struct pattern_kernel generic_kernel = {
+	.name			= "generic",
+	.fill			= fill_generic,
+	.count_mismatches	= count_generic,
+};
+
+/* The words of v2 don't depend on each other, so plain loops are
+ * enough for compilers to vectorize them where they can.
+ */
+
+static void fill_generic_v2(uint64_t *words, int n, uint64_t seed)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		words[i] = pattern_word_v2(seed, i);
+}
+
+static int count_generic_v2(const uint64_t *words, int n, uint64_t seed,
+	int max)
+{
+	int i, count = 0;
+
+	for (i = 0; i + GENERIC_LANES <= n; i += GENERIC_LANES) {
+		count += (words[i] != pattern_word_v2(seed, i)) +
+			(words[i + 1] != pattern_word_v2(seed, i + 1)) +
+			(words[i + 2] != pattern_word_v2(seed, i + 2)) +
+			(words[i + 3] != pattern_word_v2(seed, i + 3));
+		if (count > max)
+			return count;
+	}
+	for (; i < n; i++)
+		count += words[i] != pattern_word_v2(seed, i);
+	return count;
+}
+
+static const struct pattern_kernel generic_v2_kernel = {
+	.name			= "generic",
+	.fill			= fill_generic_v2,
+	.count_mismatches	= count_generic_v2,
+};
+
+/* The kernel of each version, and the version in use. */
+static const struct pattern_kernel *kernels[PATTERN_VERSION_MAX] = {
+	[PATTERN_V1]	= &generic_kernel,
+	[PATTERN_V2]	= &generic_v2_kernel,
+};
+static enum pattern_version version = PATTERN_V1;
+
+/*
+ * x86-64 kernels.
+ *
+ * They are compiled with the target attribute, so the rest of
+ * the code keeps running on any x86-64 processor, and a kernel is
+ * only selected at startup if the processor supports it.
+ *
+ * SSE4 has no multiplication of 64-bit lanes that beats the generic
+ * kernel, and neither does NEON; on those processors, the generic
+ * kernel is used.
+ */
+
+#if defined(__x86_64__) && \
+	(defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+
+#include <immintrin.h>
+
+/* AVX2 has no 64-bit multiplication, so it's assembled out of
+ * 32-bit ones. @b_lo and @b_hi are the halves of the multiplier.
+ */
+static inline __attribute__((target("avx2")))
+__m256i mul64_avx2(__m256i a, __m256i b_lo, __m256i b_hi)
+{
+	__m256i a_hi = _mm256_srli_epi64(a, 32);
+	__m256i lo = _mm256_mul_epu32(a, b_lo);
+	__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(a_hi, b_lo),
+		_mm256_mul_epu32(a, b_hi));
+	return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+/* Two registers of four lanes hide the latency of the multiplication. */
+#define AVX2_LANES	8
+
+#define AVX2_SETUP							\
+	const __m256i b_lo = _mm256_set1_epi64x(LCG_A8 & 0xffffffff);	\
+	const __m256i b_hi = _mm256_set1_epi64x(LCG_A8 >> 32);		\
+	const __m256i c = _mm256_set1_epi64x(LCG_C8);			\
+	uint64_t x[AVX2_LANES];						\
+	__m256i v0, v1;							\
+	seed_lanes(x, AVX2_LANES, seed);				\
+	v0 = _mm256_loadu_si256((const __m256i *)x);			\
+	v1 = _mm256_loadu_si256((const __m256i *)(x + 4))
+
+#define AVX2_ADVANCE							\
+	do {								\
+		v0 = _mm256_add_epi64(mul64_avx2(v0, b_lo, b_hi), c);	\
+		v1 = _mm256_add_epi64(mul64_avx2(v1, b_lo, b_hi), c);	\
+	} while (0)
+
+#define AVX2_SAVE							\
+	do {								\
+		_mm256_storeu_si256((__m256i *)x, v0);			\
+		_mm256_storeu_si256((__m256i *)(x + 4), v1);		\
+	} while (0)
+
+static __attribute__((target("avx2")))
+void fill_avx2(uint64_t *words, int n, uint64_t seed)
+{
+	int i;
+	AVX2_SETUP;
+
+	for (i = 0; i + AVX2_LANES <= n; i += AVX2_LANES) {
+		_mm256_storeu_si256((__m256i *)(words + i), v0);
+		_mm256_storeu_si256((__m256i *)(words + i + 4), v1);
+		AVX2_ADVANCE;
+	}
+	AVX2_SAVE;
+	fill_tail(words + i, n - i, x);
+}
+
+static __attribute__((target("avx2,popcnt")))
+int count_avx2(const uint64_t *words, int n, uint64_t seed, int max)
+{
+	int i, count = 0;
+	AVX2_SETUP;
+
+	for (i = 0; i + AVX2_LANES <= n; i += AVX2_LANES) {
+		__m256i eq0 = _mm256_cmpeq_epi64(v0,
+			_mm256_loadu_si256((const __m256i *)(words + i)));
+		__m256i eq1 = _mm256_cmpeq_epi64(v1,
+			_mm256_loadu_si256((const __m256i *)(words + i + 4)));
+		int equal = _mm256_movemask_pd(_mm256_castsi256_pd(eq0)) |
+			_mm256_movemask_pd(_mm256_castsi256_pd(eq1)) << 4;
+		count += AVX2_LANES - __builtin_popcount(equal);
+		if (count > max)
+			return count;
+		AVX2_ADVANCE;
+	}
+	AVX2_SAVE;
+	return count_tail(words + i, n - i, x, count);
+}
+
+static const struct pattern_kernel avx2_kernel = {
+	.name			= "avx2",
+	.fill			= fill_avx2,
+	.count_mismatches	= count_avx2,
+};
+
+/* The lanes of v2 hold the counters of eight consecutive words. */
+
+static inline __attribute__((target("avx2")))
+__m256i mix_v2_avx2(__m256i z, __m256i m1_lo, __m256i m1_hi,
+	__m256i m2_lo, __m256i m2_hi)
+{
+	z = mul64_avx2(_mm256_xor_si256(z, _mm256_srli_epi64(z, 30)),
+		m1_lo, m1_hi);
+	z = mul64_avx2(_mm256_xor_si256(z, _mm256_srli_epi64(z, 27)),
+		m2_lo, m2_hi);
+	return _mm256_xor_si256(z, _mm256_srli_epi64(z, 31));
+}
+
+#define AVX2_V2_SETUP							\
+	const __m256i m1_lo = _mm256_set1_epi64x(0x1ce4e5b9);		\
+	const __m256i m1_hi = _mm256_set1_epi64x(0xbf58476d);		\
+	const __m256i m2_lo = _mm256_set1_epi64x(0x133111eb);		\
+	const __m256i m2_hi = _mm256_set1_epi64x(0x94d049bb);		\
+	const __m256i step = _mm256_set1_epi64x(			\
+		AVX2_LANES * PATTERN_V2_GAMMA);				\
+	__m256i c0 = _mm256_set_epi64x(					\
+		seed + 4 * PATTERN_V2_GAMMA, seed + 3 * PATTERN_V2_GAMMA, \
+		seed + 2 * PATTERN_V2_GAMMA, seed + PATTERN_V2_GAMMA);	\
+	__m256i c1 = _mm256_add_epi64(c0,				\
+		_mm256_set1_epi64x(4 * PATTERN_V2_GAMMA))
+
+#define AVX2_V2_MIX(c)	mix_v2_avx2(c, m1_lo, m1_hi, m2_lo, m2_hi)
+
+#define AVX2_V2_ADVANCE							\
+	do {								\
+		c0 = _mm256_add_epi64(c0, step);			\
+		c1 = _mm256_add_epi64(c1, step);			\
+	} while (0)
+
+static __attribute__((target("avx2")))
+void fill_avx2_v2(uint64_t *words, int n, uint64_t seed)
+{
+	int i;
+	AVX2_V2_SETUP;
+
+	for (i = 0; i + AVX2_LANES <= n; i += AVX2_LANES) {
+		_mm256_storeu_si256((__m256i *)(words + i), AVX2_V2_MIX(c0));
+		_mm256_storeu_si256((__m256i *)(words + i + 4),
+			AVX2_V2_MIX(c1));
+		AVX2_V2_ADVANCE;
+	}
+	for (; i < n; i++)
+		words[i] = pattern_word_v2(seed, i);
+}
+
+static __attribute__((target("avx2,popcnt")))
+int count_avx2_v2(const uint64_t *words, int n, uint64_t seed, int max)
+{
+	int i, count = 0;
+	AVX2_V2_SETUP;
+
+	for (i = 0; i + AVX2_LANES <= n; i += AVX2_LANES) {
+		__m256i eq0 = _mm256_cmpeq_epi64(AVX2_V2_MIX(c0),
+			_mm256_loadu_si256((const __m256i *)(words + i)));
+		__m256i eq1 = _mm256_cmpeq_epi64(AVX2_V2_MIX(c1),
+			_mm256_loadu_si256((const __m256i *)(words + i + 4)));
+		int equal = _mm256_movemask_pd(_mm256_castsi256_pd(eq0)) |
+			_mm256_movemask_pd(_mm256_castsi256_pd(eq1)) << 4;
+		count += AVX2_LANES - __builtin_popcount(equal);
+		if (count > max)
+			return count;
+		AVX2_V2_ADVANCE;
+	}
+	for (; i < n; i++)
+		count += words[i] != pattern_word_v2(seed, i);
+	return count;
+}
+
+static const struct pattern_kernel avx2_v2_kernel = {
+	.name			= "avx2",
+	.fill			= fill_avx2_v2,
+	.count_mismatches	= count_avx2_v2,
+};
+
+/* AVX-512DQ multiplies 64-bit lanes natively. */
+#define AVX512_LANES	16
+
+#define AVX512_SETUP							\
+	const __m512i a = _mm512_set1_epi64(LCG_A16);			\
+	const __m512i c = _mm512_set1_epi64(LCG_C16);			\
+	uint64_t x[AVX512_LANES];					\
+	__m512i v0, v1;							\
+	seed_lanes(x, AVX512_LANES, seed);				\
+	v0 = _mm512_loadu_si512(x);					\
+	v1 = _mm512_loadu_si512(x + 8)
+
+#define AVX512_ADVANCE							\
+	do {								\
+		v0 = _mm512_add_epi64(_mm512_mullo_epi64(v0, a), c);	\
+		v1 = _mm512_add_epi64(_mm512_mullo_epi64(v1, a), c);	\
+	} while (0)
+
+#define AVX512_SAVE							\
+	do {								\
+		_mm512_storeu_si512(x, v0);				\
+		_mm512_storeu_si512(x + 8, v1);				\
+	} while (0)
+
+static __attribute__((target("avx512f,avx512dq")))
+void fill_avx512(uint64_t *words, int n, uint64_t seed)
+{
+	int i;
+	AVX512_SETUP;
+
+	for (i = 0; i + AVX512_LANES <= n; i += AVX512_LANES) {
+		_mm512_storeu_si512(words + i, v0);
+		_mm512_storeu_si512(words + i + 8, v1);
+		AVX512_ADVANCE;
+	}
+	AVX512_SAVE;
+	fill_tail(words + i, n - i, x);
+}
+
+static __attribute__((target("avx512f,avx512dq,popcnt")))
+int count_avx512(const uint64_t *words, int n, uint64_t seed, int max)
+{
+	int i, count = 0;
+	AVX512_SETUP;
+
+	for (i = 0; i + AVX512_LANES <= n; i += AVX512_LANES) {
+		__mmask8 ne0 = _mm512_cmpneq_epi64_mask(v0,
+			_mm512_loadu_si512(words + i));
+		__mmask8 ne1 = _mm512_cmpneq_epi64_mask(v1,
+			_mm512_loadu_si512(words + i + 8));
+		count += __builtin_popcount(ne0 | (unsigned)ne1 << 8);
+		if (count > max)
+			return count;
+		AVX512_ADVANCE;
+	}
+	AVX512_SAVE;
+	return count_tail(words + i, n - i, x, count);
+}
+
+static const struct pattern_kernel avx512_kernel = {
+	.name			= "avx512",
+	.fill			= fill_avx512,
+	.count_mismatches	= count_avx512,
+};
+
+static inline __attribute__((target("avx512f,avx512dq")))
+__m512i mix_v2_avx512(__m512i z, __m512i m1, __m512i m2)
+{
+	z = _mm512_mullo_epi64(_mm512_xor_si512(z, _mm512_srli_epi64(z, 30)),
+		m1);
+	z = _mm512_mullo_epi64(_mm512_xor_si512(z, _mm512_srli_epi64(z, 27)),
+		m2);
+	return _mm512_xor_si512(z, _mm512_srli_epi64(z, 31));
+}
+
+#define AVX512_V2_SETUP							\
+	const __m512i m1 = _mm512_set1_epi64(0xbf58476d1ce4e5b9ULL);	\
+	const __m512i m2 = _mm512_set1_epi64(0x94d049bb133111ebULL);	\
+	const __m512i step = _mm512_set1_epi64(				\
+		AVX512_LANES * PATTERN_V2_GAMMA);			\
+	__m512i c0 = _mm512_add_epi64(_mm512_set1_epi64(seed),		\
+		_mm512_mullo_epi64(_mm512_set_epi64(8, 7, 6, 5, 4, 3, 2, 1), \
+			_mm512_set1_epi64(PATTERN_V2_GAMMA)));		\
+	__m512i c1 = _mm512_add_epi64(c0,				\
+		_mm512_set1_epi64(8 * PATTERN_V2_GAMMA))
+
+#define AVX512_V2_ADVANCE						\
+	do {								\
+		c0 = _mm512_add_epi64(c0, step);			\
+		c1 = _mm512_add_epi64(c1, step);			\
+	} while (0)
+
+static __attribute__((target("avx512f,avx512dq")))
+void fill_avx512_v2(uint64_t *words, int n, uint64_t seed)
+{
+	int i;
+	AVX512_V2_SETUP;
+
+	for (i = 0; i + AVX512_LANES <= n; i += AVX512_LANES) {
+		_mm512_storeu_si512(words + i, mix_v2_avx512(c0, m1, m2));
+		_mm512_storeu_si512(words + i + 8, mix_v2_avx512(c1, m1, m2));
+		AVX512_V2_ADVANCE;
+	}
+	for (; i < n; i++)
+		words[i] = pattern_word_v2(seed, i);
+}
+
+static __attribute__((target("avx512f,avx512dq,popcnt")))
+int count_avx512_v2(const uint64_t *words, int n, uint64_t seed, int max)
+{
+	int i, count = 0;
+	AVX512_V2_SETUP;
+
+	for (i = 0; i + AVX512_LANES <= n; i += AVX512_LANES) {
+		__mmask8 ne0 = _mm512_cmpneq_epi64_mask(
+			mix_v2_avx512(c0, m1, m2),
+			_mm512_loadu_si512(words + i));
+		__mmask8 ne1 = _mm512_cmpneq_epi64_mask(
+			mix_v2_avx512(c1, m1, m2),
+			_mm512_loadu_si512(words + i + 8));
+		count += __builtin_popcount(ne0 | (unsigned)ne1 << 8);
+		if (count > max)
+			return count;
+		AVX512_V2_ADVANCE;
+	}
+	for (; i < n; i++)
+		count += words[i] != pattern_word_v2(seed, i);
+	return count;
+}
+
+static const struct pattern_kernel avx512_v2_kernel = {
+	.name			= "avx512",
+	.fill			= fill_avx512_v2,
+	.count_mismatches	= count_avx512_v2,
+};
+
+/* Selecting the kernel before main() runs keeps the selection
+ * free of races with the worker threads of f3write and f3read.
+ */
+static void __attribute__((constructor)) select_kernel(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512dq")) {
+		kernels[PATTERN_V1] = &avx512_kernel;
+		kernels[PATTERN_V2] = &avx512_v2_kernel;
+	} else if (__builtin_cpu_supports("avx2")) {
+		kernels[PATTERN_V1] = &avx2_kernel;
+		kernels[PATTERN_V2] = &avx2_v2_kernel;
+	}
+}
+
+#endif	/* x86-64 */
+
+static const char * const version_names[PATTERN_VERSION_MAX] = {
+	[PATTERN_V1]	= "v1",
+	[PATTERN_V2]	= "v2",
+};
+
+void pattern_set_version(enum pattern_version v)
+{
+	assert(v >= 0 && v < PATTERN_VERSION_MAX);
+	version = v;
+}
+
+enum pattern_version pattern_get_version(void)
+{
+	return version;
+}
+
+int pattern_version_from_name(const char *name)
+{
+	int i;
+	for (i = 0; i < PATTERN_VERSION_MAX; i++)
+		if (!strcmp(name, version_names[i]))
+			return i;
+	return -1;
+}
+
+const char *pattern_version_name(enum pattern_version v)
+{
+	assert(v >= 0 && v < PATTERN_VERSION_MAX);
+	return version_names[v];
+}
+
+void pattern_fill(uint64_t *words, int n, uint64_t seed)
+{
+	assert(n >= 0);
+	kernels[version]->fill(words, n, seed);
+}
+
+int pattern_count_mismatches(const uint64_t *words, int n, uint64_t seed,
+	int max)
+{
+	assert(n >= 0);
+	return kernels[version]->count_mismatches(words, n, seed, max);
+}
+
+void fill_buffer_with_block(void *buf, int block_order, uint64_t offset,
+	uint64_t salt)
+{
+	uint64_t *int64_array = buf;
+	int num_int64 = 1 << (block_order - 3);
+
+	assert(block_order >= 9);
+
+	/* The offset is known by drives,
+	 * so one doesn't have to encrypt it.
+	 * Please don't add @salt here!
+	 */
+	int64_array[0] = offset;
+
+	/* Thanks to @salt, a drive has to guess the seed. */
+	pattern_fill(int64_array + 1, num_int64 - 1, offset ^ salt);
+}
+
+int validate_buffer_with_block(const void *buf, int block_order,
+	uint64_t *pfound_offset, uint64_t salt)
+{
+	const uint64_t *int64_array = buf;
+	int num_int64 = 1 << (block_order - 3);
+	uint64_t found_offset = int64_array[0];
+
+	assert(block_order >= 9);
+
+	if (pattern_count_mismatches(int64_array + 1, num_int64 - 1,
+		found_offset ^ salt, 0))
+		return true;
+
+	*pfound_offset = found_offset;
+	return false;
+}
+
+uint64_t validate_buffer_with_blocks(const void *buf, int block_order,
+	int n_blocks, uint64_t expected_offset, uint64_t salt,
+	uint64_t *good, uint64_t *valid, uint64_t *found_offsets)
+{
+	const char *blk = buf;
+	const int block_size = 1 << block_order;
+	const int num_int64 = block_size >> 3;
+	uint64_t good_word = 0, valid_word = 0, count = 0;
+	int i;
+
+	assert(block_order >= 9);
+
+	for (i = 0; i < n_blocks; i++) {
+		const uint64_t *int64_array = (const uint64_t *)blk;
+		const uint64_t found_offset = int64_array[0];
+		const uint64_t bit = 1ULL << (i & 63);
+		const uint64_t is_valid = !pattern_count_mismatches(
+			int64_array + 1, num_int64 - 1, found_offset ^ salt, 0);
+
+		valid_word |= -is_valid & bit;
+		good_word |= -(is_valid & (found_offset == expected_offset)) &
+			bit;
+		if (found_offsets)
+			found_offsets[i] = found_offset;
+
+		if ((i & 63) == 63 || i == n_blocks - 1) {
+			count += __builtin_popcountll(good_word);
+			if (good)
+				good[i >> 6] = good_word;
+			if (valid)
+				valid[i >> 6] = valid_word;
+			good_word = valid_word = 0;
+		}
+
+		blk += block_size;
+		expected_offset += block_size;
+	}
+
+	return count;
+}
+
+const char *pattern_kernel_name(void)
+{
+	return kernels[version]->name;
+}
@@ -0,0 +1,149 @@
+#ifndef HEADER_LIBPATTERN_H
+#define HEADER_LIBPATTERN_H
+
+#include <stdint.h>
+
+/*
+ * The pattern written by F3 is a chain of 64-bit words derived from
+ * a seed. The functions of this module produce and check chains
+ * with vectorized kernels when the processor has them, and their
+ * results are identical to a word-by-word loop over the definitions
+ * below.
+ *
+ * There are two versions of the pattern, and the version in use
+ * applies to every function of this module:
+ *
+ * v1, the default, is the linear congruential generator of
+ * pattern_next(); every word is derived from the previous one.
+ *
+ * v2 is the counter-based generator of pattern_word_v2(); every word
+ * is a hash of the seed and of the position of the word, so any
+ * word can be generated or checked on its own.
+ *
+ * Data written with one version only validate with the same version.
+ */
+
+enum pattern_version {
+	PATTERN_V1,
+	PATTERN_V2,
+	PATTERN_VERSION_MAX
+};
+
+/* Not thread safe; call it before starting threads that use
+ * this module.
+ */
+void pattern_set_version(enum pattern_version version);
+enum pattern_version pattern_get_version(void);
+
+/* Return the version named @name, e.g. "v2", or -1 if there is
+ * no such version.
+ */
+int pattern_version_from_name(const char *name);
+const char *pattern_version_name(enum pattern_version version);
+
+static inline uint64_t pattern_next(uint64_t x)
+{
+	return x * 4294967311ULL + 17;
+}
+
+/* Inverse of pattern_next(); the multiplier is odd, so it has
+ * a multiplicative inverse modulo 2^64.
+ */
+static inline uint64_t pattern_prev(uint64_t x)
+{
+	return (x - 17) * 0x6789abcdeeeeeeefULL;
+}
+
+/* Increment of the counter of SplitMix64, i.e. 2^64 over
+ * the golden ratio; it is odd.
+ */
+#define PATTERN_V2_GAMMA	0x9e3779b97f4a7c15ULL
+
+/* The finalizer of SplitMix64; it is a bijection. */
+static inline uint64_t pattern_mix_v2(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Inverse of pattern_mix_v2(). */
+static inline uint64_t pattern_unmix_v2(uint64_t z)
+{
+	z ^= (z >> 31) ^ (z >> 62);
+	z *= 0x319642b2d24d8ec3ULL;
+	z ^= (z >> 27) ^ (z >> 54);
+	z *= 0x96de1b173f119089ULL;
+	return z ^ (z >> 30) ^ (z >> 60);
+}
+
+/* Word @index of the v2 chain of @seed, counting from zero. */
+static inline uint64_t pattern_word_v2(uint64_t seed, uint64_t index)
+{
+	return pattern_mix_v2(seed + (index + 1) * PATTERN_V2_GAMMA);
+}
+
+/* Return the seed of the chain whose first word is @word with
+ * the version in use.
+ */
+static inline uint64_t pattern_seed_of(uint64_t word)
+{
+	return pattern_get_version() == PATTERN_V2
+		? pattern_unmix_v2(word) - PATTERN_V2_GAMMA
+		: pattern_prev(word);
+}
+
+/* Fill @words with the first @n words of the chain of @seed;
+ * with v1, the first word is pattern_next(@seed).
+ */
+void pattern_fill(uint64_t *words, int n, uint64_t seed);
+
+/* Count how many of the @n @words differ from the chain that
+ * pattern_fill() would write for @seed.
+ * The counting stops as soon as the count is greater than @max,
+ * so the returned value is only exact when it is less than or
+ * equal to @max.
+ */
+int pattern_count_mismatches(const uint64_t *words, int n, uint64_t seed,
+	int max);
+
+/*
+ * Blocks of f3probe and f3brew.
+ *
+ * The first word of a block is its offset on the drive, and
+ * the chain that follows is seeded by the offset xor a salt.
+ */
+
+/* Dependent on the byte order of the processor (i.e. endianness). */
+void fill_buffer_with_block(void *buf, int block_order, uint64_t offset,
+	uint64_t salt);
+
+/* Dependent on the byte order of the processor (i.e. endianness). */
+int validate_buffer_with_block(const void *buf, int block_order,
+	uint64_t *pfound_offset, uint64_t salt);
+
+/* Number of 64-bit words of a bitmap with a bit per block. */
+#define BLOCK_BITMAP_WORDS(n_blocks)	(((n_blocks) + 63) >> 6)
+
+/* Validate the @n_blocks consecutive blocks in @buf; the first block
+ * is expected at @expected_offset.
+ *
+ * The comparison of a block stops at its first mismatch.
+ * If not NULL, bit i of @good is set when block i is good,
+ * bit i of @valid is set when block i holds a block of F3,
+ * even if it is not the expected one, and @found_offsets[i] receives
+ * the offset that block i holds; this offset is only meaningful for
+ * valid blocks.
+ *
+ * Return the number of good blocks.
+ *
+ * Dependent on the byte order of the processor (i.e. endianness).
+ */
+uint64_t validate_buffer_with_blocks(const void *buf, int block_order,
+	int n_blocks, uint64_t expected_offset, uint64_t salt,
+	uint64_t *good, uint64_t *valid, uint64_t *found_offsets);
+
+/* Name of the kernel of the version in use, e.g. "avx2". */
+const char *pattern_kernel_name(void);
+
+#endif	/* HEADER_LIBPATTERN_H */
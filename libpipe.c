@@ -0,0 +1,213 @@
+#define _POSIX_C_SOURCE 200112L
+#define _XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "libarena.h"
+#include "libpipe.h"
+
+/* The buffers are aligned to 2^PIPE_BUF_ORDER bytes. */
+#define PIPE_BUF_ORDER	12
+
+struct pipeline {
+	struct pipe_slot	*slots;
+	int			n_slots;
+	/* Where the buffers of the slots come from. */
+	struct arena		*arena;
+	pthread_t		*threads;
+	int			n_threads;
+
+	pipe_work_t		work;
+	void			*arg;
+
+	/* Slot that pipe_get() returns. */
+	int			head;
+	/* Indexes of the submitted slots that no worker has taken yet.
+	 * This is a ring of @n_slots entries starting at @q_first;
+	 * it is needed because pipe_put() skips slots.
+	 */
+	int			*queue;
+	int			q_first;
+	int			n_queued;
+	bool			stop;
+
+	pthread_mutex_t		lock;
+	/* Signaled when a slot is submitted, or when stopping. */
+	pthread_cond_t		has_work;
+	/* Signaled when a slot is done. */
+	pthread_cond_t		has_done;
+};
+
+static void *pipe_worker(void *arg)
+{
+	struct pipeline *pl = arg;
+
+	assert(!pthread_mutex_lock(&pl->lock));
+	while (true) {
+		struct pipe_slot *slot;
+
+		while (!pl->n_queued && !pl->stop)
+			assert(!pthread_cond_wait(&pl->has_work, &pl->lock));
+		if (pl->stop)
+			break;
+
+		slot = &pl->slots[pl->queue[pl->q_first]];
+		pl->q_first = (pl->q_first + 1) % pl->n_slots;
+		pl->n_queued--;
+		assert(!pthread_mutex_unlock(&pl->lock));
+
+		pl->work(slot, pl->arg);
+
+		assert(!pthread_mutex_lock(&pl->lock));
+		assert(slot->state == PSS_BUSY);
+		slot->state = PSS_DONE;
+		assert(!pthread_cond_broadcast(&pl->has_done));
+	}
+	assert(!pthread_mutex_unlock(&pl->lock));
+	return NULL;
+}
+
+static void free_slots(struct pipeline *pl)
+{
+	if (pl->arena)
+		free_arena(pl->arena);
+	free(pl->slots);
+	free(pl->queue);
+}
+
+struct pipeline *create_pipeline(int n_threads, size_t buf_size,
+	int arena_flags, pipe_work_t work, void *arg)
+{
+	struct pipeline *pl;
+	int i;
+
+	assert(n_threads > 0);
+	assert(buf_size > 0);
+
+	pl = malloc(sizeof(*pl));
+	if (!pl)
+		goto error;
+
+	pl->arena = NULL;
+	pl->n_slots = 2 * n_threads;
+	pl->slots = calloc(pl->n_slots, sizeof(*pl->slots));
+	if (!pl->slots)
+		goto pl;
+	pl->queue = malloc(pl->n_slots * sizeof(*pl->queue));
+	if (!pl->queue)
+		goto slots;
+	pl->arena = create_arena(arena_size(pl->n_slots, buf_size,
+		PIPE_BUF_ORDER), arena_flags);
+	if (!pl->arena)
+		goto slots;
+	for (i = 0; i < pl->n_slots; i++) {
+		struct pipe_slot *slot = &pl->slots[i];
+		slot->buf = arena_alloc(pl->arena, buf_size, PIPE_BUF_ORDER);
+		assert(slot->buf);
+		slot->size = 0;
+		slot->offset = 0;
+		slot->index = i;
+		slot->state = PSS_IDLE;
+	}
+
+	pl->threads = malloc(n_threads * sizeof(*pl->threads));
+	if (!pl->threads)
+		goto slots;
+
+	pl->work = work;
+	pl->arg = arg;
+	pl->head = 0;
+	pl->q_first = 0;
+	pl->n_queued = 0;
+	pl->stop = false;
+	assert(!pthread_mutex_init(&pl->lock, NULL));
+	assert(!pthread_cond_init(&pl->has_work, NULL));
+	assert(!pthread_cond_init(&pl->has_done, NULL));
+
+	for (pl->n_threads = 0; pl->n_threads < n_threads; pl->n_threads++)
+		if (pthread_create(&pl->threads[pl->n_threads], NULL,
+			pipe_worker, pl))
+			break;
+	if (pl->n_threads < n_threads) {
+		free_pipeline(pl);
+		return NULL;
+	}
+
+	return pl;
+
+slots:
+	free_slots(pl);
+pl:
+	free(pl);
+error:
+	return NULL;
+}
+
+void free_pipeline(struct pipeline *pl)
+{
+	int i;
+
+	/* Let the workers finish what was submitted. */
+	for (i = 0; i < pl->n_slots; i++)
+		pipe_put(pl, pipe_get(pl));
+
+	assert(!pthread_mutex_lock(&pl->lock));
+	pl->stop = true;
+	assert(!pthread_cond_broadcast(&pl->has_work));
+	assert(!pthread_mutex_unlock(&pl->lock));
+	for (i = 0; i < pl->n_threads; i++)
+		assert(!pthread_join(pl->threads[i], NULL));
+
+	assert(!pthread_cond_destroy(&pl->has_done));
+	assert(!pthread_cond_destroy(&pl->has_work));
+	assert(!pthread_mutex_destroy(&pl->lock));
+	free(pl->threads);
+	free_slots(pl);
+	free(pl);
+}
+
+int pipe_n_slots(const struct pipeline *pl)
+{
+	return pl->n_slots;
+}
+
+struct pipe_slot *pipe_get(struct pipeline *pl)
+{
+	struct pipe_slot *slot = &pl->slots[pl->head];
+
+	assert(!pthread_mutex_lock(&pl->lock));
+	while (slot->state == PSS_BUSY)
+		assert(!pthread_cond_wait(&pl->has_done, &pl->lock));
+	assert(!pthread_mutex_unlock(&pl->lock));
+	return slot;
+}
+
+void pipe_submit(struct pipeline *pl, struct pipe_slot *slot)
+{
+	assert(slot == &pl->slots[pl->head]);
+	assert(slot->state != PSS_BUSY);
+	assert(slot->size > 0);
+
+	assert(!pthread_mutex_lock(&pl->lock));
+	slot->state = PSS_BUSY;
+	assert(pl->n_queued < pl->n_slots);
+	pl->queue[(pl->q_first + pl->n_queued) % pl->n_slots] = slot->index;
+	pl->n_queued++;
+	assert(!pthread_cond_signal(&pl->has_work));
+	assert(!pthread_mutex_unlock(&pl->lock));
+
+	pl->head = (pl->head + 1) % pl->n_slots;
+}
+
+void pipe_put(struct pipeline *pl, struct pipe_slot *slot)
+{
+	assert(slot == &pl->slots[pl->head]);
+	assert(slot->state != PSS_BUSY);
+
+	/* Workers only write to busy slots, so no locking is needed. */
+	slot->state = PSS_IDLE;
+	pl->head = (pl->head + 1) % pl->n_slots;
+}
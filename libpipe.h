@@ -0,0 +1,75 @@
+#ifndef HEADER_LIBPIPE_H
+#define HEADER_LIBPIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A pipeline is a ring of buffers shared between the caller, which is
+ * the only thread doing I/O, and a set of worker threads that do the
+ * CPU-bound work on the buffers (e.g. generating or checking sectors).
+ *
+ * The caller always receives the slots back in the same order that
+ * it submitted them, so the offsets flow through the ring exactly as
+ * they would flow through a single buffer.
+ */
+
+enum pipe_slot_state {
+	/* The slot is available and holds no result. */
+	PSS_IDLE,
+	/* The slot was submitted and the work on it is not done yet. */
+	PSS_BUSY,
+	/* The work on the slot is done. */
+	PSS_DONE,
+};
+
+struct pipe_slot {
+	/* Aligned buffer of the slot; see create_pipeline(). */
+	char			*buf;
+	/* Number of bytes of @buf to work on. */
+	size_t			size;
+	/* Offset of the first byte of @buf in the stream. */
+	uint64_t		offset;
+	/* Position of the slot in the ring; callers can use it to
+	 * keep per-slot results.
+	 */
+	int			index;
+	enum pipe_slot_state	state;
+};
+
+/* Upper bound on the number of worker threads the applications accept. */
+#define MAX_THREADS	64
+
+typedef void (*pipe_work_t)(struct pipe_slot *slot, void *arg);
+
+struct pipeline;
+
+/* @n_threads worker threads share a ring of 2 * @n_threads buffers of
+ * @buf_size bytes each. The buffers are aligned to 4KB, come from
+ * an arena created with @arena_flags, and
+ * @work is called with @arg for every submitted slot.
+ *
+ * Return NULL when out of resources.
+ */
+struct pipeline *create_pipeline(int n_threads, size_t buf_size,
+	int arena_flags, pipe_work_t work, void *arg);
+void free_pipeline(struct pipeline *pl);
+
+int pipe_n_slots(const struct pipeline *pl);
+
+/* Return the oldest slot of the ring.
+ * If the slot is busy, wait until the work on it is done.
+ */
+struct pipe_slot *pipe_get(struct pipeline *pl);
+
+/* Hand @slot, which must have been returned by pipe_get(), to
+ * the workers.
+ */
+void pipe_submit(struct pipeline *pl, struct pipe_slot *slot);
+
+/* Give @slot, which must have been returned by pipe_get(), back to
+ * the ring without submitting it. Its state becomes PSS_IDLE.
+ */
+void pipe_put(struct pipeline *pl, struct pipe_slot *slot);
+
+#endif	/* HEADER_LIBPIPE_H */
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -5,49 +7,284 @@
 #include <math.h>
 #include <errno.h>
 #include <time.h>	/* For time().		*/
-#include <sys/time.h>	/* For gettimeofday().	*/
 
 #include "libutils.h"
+#include "libpattern.h"
+#include "libarena.h"
 #include "libprobe.h"
 
-static int write_blocks(struct device *dev,
+/* Take a buffer of @size bytes from the arena of @dev, and
+ * store in *@pmark what put_buffer() needs to give it back.
+ * Aligning buffers to blocks is necessary to directly read and write
+ * the block device.
+ * For the file device, this is superfluous.
+ * Return NULL if out of memory.
+ */
+static char *get_buffer(struct device *dev, size_t size, size_t *pmark)
+{
+	struct arena *arena = dev_get_arena(dev);
+	if (!arena)
+		return NULL;
+	*pmark = arena_mark(arena);
+	return arena_alloc(arena, size, dev_get_block_order(dev));
+}
+
+static void put_buffer(struct device *dev, size_t mark)
+{
+	arena_release(dev_get_arena(dev), mark);
+}
+
+static int write_big_block(struct device *dev,
 	uint64_t first_pos, uint64_t last_pos, uint64_t salt)
 {
 	const int block_order = dev_get_block_order(dev);
 	const int block_size = dev_get_block_size(dev);
-	/* Aligning these pointers is necessary to directly read and write
-	 * the block device.
-	 * For the file device, this is superfluous.
-	 */
-	char stack[align_head(block_order) + BIG_BLOCK_SIZE_BYTE];
-	char *buffer = align_mem(stack, block_order);
-	char *stamp_blk = buffer;
-	char *flush_blk = buffer + BIG_BLOCK_SIZE_BYTE;
+	char *buffer, *stamp_blk;
 	uint64_t offset = first_pos << block_order;
-	uint64_t pos, write_pos = first_pos;
+	uint64_t pos;
+	size_t mark;
+	int ret;
 
+	assert(((last_pos - first_pos + 1) << block_order) <=
+		BIG_BLOCK_SIZE_BYTE);
+
+	buffer = get_buffer(dev, BIG_BLOCK_SIZE_BYTE, &mark);
+	if (!buffer)
+		return true;
+	stamp_blk = buffer;
 	for (pos = first_pos; pos <= last_pos; pos++) {
 		fill_buffer_with_block(stamp_blk, block_order, offset, salt);
 		stamp_blk += block_size;
 		offset += block_size;
+	}
+
+	ret = dev_write_blocks(dev, buffer, first_pos, last_pos) &&
+		dev_write_blocks(dev, buffer, first_pos, last_pos);
+	put_buffer(dev, mark);
+	return ret;
+}
 
-		if (stamp_blk == flush_blk || pos == last_pos) {
-			if (dev_write_blocks(dev, buffer, write_pos, pos) &&
-				dev_write_blocks(dev, buffer, write_pos, pos))
-				return true;
+/* Write a block at each of the @n @positions, which must be in
+ * increasing order.
+ */
+static int write_scattered_blocks(struct device *dev,
+	const uint64_t *positions, int n, uint64_t salt)
+{
+	const int block_order = dev_get_block_order(dev);
+	const int block_size = dev_get_block_size(dev);
+	const int per_call = BIG_BLOCK_SIZE_BYTE >> block_order;
+	char *buffer;
+	size_t mark;
+	int i, j, ret = true;
+
+	buffer = get_buffer(dev, BIG_BLOCK_SIZE_BYTE, &mark);
+	if (!buffer)
+		return true;
+
+	for (i = 0; i < n; i += per_call) {
+		int m = n - i < per_call ? n - i : per_call;
+		char *stamp_blk = buffer;
+
+		for (j = 0; j < m; j++) {
+			fill_buffer_with_block(stamp_blk, block_order,
+				positions[i + j] << block_order, salt);
+			stamp_blk += block_size;
+		}
+
+		if (dev_writev_blocks(dev, buffer, positions + i, m) &&
+			dev_writev_blocks(dev, buffer, positions + i, m))
+			goto out;
+	}
+	ret = false;
+
+out:
+	put_buffer(dev, mark);
+	return ret;
+}
+
+/* Number of requests that sequential scans keep in flight.
+ * Their buffers must fit in the arena of the device.
+ */
+#define PROBE_QUEUE_DEPTH	4
+
+/* Take the buffers of a sequential scan; see get_buffer(). */
+static char *get_scan_buffers(struct device *dev, size_t *pmark)
+{
+	return get_buffer(dev, PROBE_QUEUE_DEPTH * BIG_BLOCK_SIZE_BYTE,
+		pmark);
+}
+
+/* Write the blocks from @first_pos to @last_pos.
+ * If @payload is not NULL, it already holds these blocks stamped, so
+ * they are written from it instead of being stamped again.
+ */
+static int write_blocks_from(struct device *dev,
+	uint64_t first_pos, uint64_t last_pos, uint64_t salt,
+	const char *payload)
+{
+	const int block_order = dev_get_block_order(dev);
+	const int block_size = dev_get_block_size(dev);
+	const uint64_t step = (BIG_BLOCK_SIZE_BYTE >> block_order) - 1;
+	struct dev_queue *q;
+	char *buffers = NULL;
+	uint64_t next_pos = first_pos;
+	size_t mark;
+	int n_submitted = 0;
+	int ret = true;
+
+	if (last_pos - first_pos <= step) {
+		if (!payload)
+			return write_big_block(dev, first_pos, last_pos, salt);
+		return dev_write_blocks(dev, payload, first_pos, last_pos) &&
+			dev_write_blocks(dev, payload, first_pos, last_pos);
+	}
+
+	if (!payload) {
+		buffers = get_scan_buffers(dev, &mark);
+		if (!buffers)
+			return true;
+	}
+	q = create_dev_queue(dev, PROBE_QUEUE_DEPTH);
+	if (!q)
+		goto buffers;
+
+	while (next_pos <= last_pos || dev_queue_pending(q)) {
+		uint64_t pos, start_pos, end_pos, offset;
+		char *buffer, *stamp_blk;
+
+		if (next_pos <= last_pos && !dev_queue_is_full(q)) {
+			end_pos = next_pos + step;
+			if (end_pos > last_pos)
+				end_pos = last_pos;
+
+			if (payload) {
+				dev_queue_submit_write(q, payload +
+					((next_pos - first_pos) << block_order),
+					next_pos, end_pos);
+				next_pos = end_pos + 1;
+				continue;
+			}
+
+			buffer = buffers + (n_submitted % PROBE_QUEUE_DEPTH) *
+				BIG_BLOCK_SIZE_BYTE;
 			stamp_blk = buffer;
-			write_pos = pos + 1;
+			offset = next_pos << block_order;
+			for (pos = next_pos; pos <= end_pos; pos++) {
+				fill_buffer_with_block(stamp_blk, block_order,
+					offset, salt);
+				stamp_blk += block_size;
+				offset += block_size;
+			}
+
+			dev_queue_submit_write(q, buffer, next_pos, end_pos);
+			n_submitted++;
+			next_pos = end_pos + 1;
+			continue;
 		}
+
+		if (dev_queue_complete(q, &buffer, &start_pos, &end_pos) &&
+			dev_write_blocks(dev, buffer, start_pos, end_pos))
+			goto out;
 	}
+	ret = false;
 
-	return false;
+out:
+	/* The queue must go first because it waits for pending requests. */
+	free_dev_queue(q);
+buffers:
+	if (buffers)
+		put_buffer(dev, mark);
+	return ret;
+}
+
+static inline int write_blocks(struct device *dev,
+	uint64_t first_pos, uint64_t last_pos, uint64_t salt)
+{
+	return write_blocks_from(dev, first_pos, last_pos, salt, NULL);
+}
+
+/* Largest payload that a struct reset_cache keeps.
+ * The blocks of a larger reset beyond it are stamped on every reset.
+ */
+#define MAX_RESET_CACHE_BYTE	(64ULL << 20)
+
+/* high_level_reset() writes the same blocks with the same salt in
+ * every reset of a probe, so these blocks are stamped once, and kept here.
+ */
+struct reset_cache {
+	char		*stack;
+	char		*payload;
+	uint64_t	first_pos;
+	uint64_t	n_blocks;
+	uint64_t	salt;
+};
+
+static void init_reset_cache(struct reset_cache *rc)
+{
+	memset(rc, 0, sizeof(*rc));
 }
 
-static int high_level_reset(struct device *dev, uint64_t start_pos,
-	uint64_t cache_size_block, int need_reset, uint64_t salt)
+static void free_reset_cache(struct reset_cache *rc)
 {
-	if (write_blocks(dev,
-		start_pos, start_pos + cache_size_block - 1, salt))
+	free(rc->stack);
+	init_reset_cache(rc);
+}
+
+/* Return the number of blocks from @first_pos that @rc holds stamped.
+ * If there is not enough memory, nothing is cached, and zero is returned.
+ */
+static uint64_t fill_reset_cache(struct reset_cache *rc, struct device *dev,
+	uint64_t first_pos, uint64_t n_blocks, uint64_t salt)
+{
+	const int block_order = dev_get_block_order(dev);
+	const int block_size = dev_get_block_size(dev);
+	uint64_t i, offset;
+	char *stamp_blk;
+
+	if (n_blocks > MAX_RESET_CACHE_BYTE >> block_order)
+		n_blocks = MAX_RESET_CACHE_BYTE >> block_order;
+	if (rc->payload && rc->first_pos == first_pos &&
+		rc->n_blocks == n_blocks && rc->salt == salt)
+		return n_blocks;
+
+	free_reset_cache(rc);
+	rc->stack = malloc(align_head(block_order) +
+		(n_blocks << block_order));
+	if (!rc->stack)
+		return 0;
+	rc->payload = align_mem(rc->stack, block_order);
+	rc->first_pos = first_pos;
+	rc->n_blocks = n_blocks;
+	rc->salt = salt;
+
+	stamp_blk = rc->payload;
+	offset = first_pos << block_order;
+	for (i = 0; i < n_blocks; i++) {
+		fill_buffer_with_block(stamp_blk, block_order, offset, salt);
+		stamp_blk += block_size;
+		offset += block_size;
+	}
+	return n_blocks;
+}
+
+static int high_level_reset(struct device *dev, struct reset_cache *rc,
+	uint64_t start_pos, uint64_t cache_size_block, int need_reset,
+	uint64_t salt)
+{
+	const uint64_t last_pos = start_pos + cache_size_block - 1;
+	uint64_t n_cached = cache_size_block > 0
+		? fill_reset_cache(rc, dev, start_pos, cache_size_block, salt)
+		: 0;
+
+	if (n_cached > 0 && write_blocks_from(dev, start_pos,
+		start_pos + n_cached - 1, salt, rc->payload))
+		return true;
+	if (n_cached < cache_size_block &&
+		write_blocks(dev, start_pos + n_cached, last_pos, salt))
+		return true;
+
+	/* A single flush covers all writes since the last one. */
+	if (dev_flush(dev) && dev_flush(dev))
 		return true;
 
 	/* Reset. */
@@ -57,19 +294,119 @@ static int high_level_reset(struct device *dev, uint64_t start_pos,
 	return false;
 }
 
-/* Statistics used by bisect() in order to optimize the proportion
- * between writes and resets.
+static void init_bisect_stats(struct bisect_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+static const char * const strategy_names[] = {
+	[PS_HEURISTIC]	= "heuristic",
+	[PS_COST_MODEL]	= "cost-model",
+};
+
+const char *probe_strategy_to_name(enum probe_strategy strategy)
+{
+	assert(strategy < PS_MAX);
+	return strategy_names[strategy];
+}
+
+int probe_strategy_from_name(const char *name)
+{
+	int i;
+	for (i = 0; i < PS_MAX; i++)
+		if (!strcmp(name, strategy_names[i]))
+			return i;
+	return -1;
+}
+
+/* Least-squares fit of the cost of an operation, y = fixed + per_unit * x,
+ * where x is, for example, the number of blocks written by a call.
  */
-struct bisect_stats {
-	int		write_count;
-	int		reset_count;
-	uint64_t	write_time_us;
-	uint64_t	reset_time_us;
+struct cost_fit {
+	double	n, sx, sy, sxx, sxy, syy;
 };
 
-static void init_bisect_stats(struct bisect_stats *stats)
+static void fit_add(struct cost_fit *f, double x, double y)
 {
-	memset(stats, 0, sizeof(*stats));
+	f->n++;
+	f->sx += x;
+	f->sy += y;
+	f->sxx += x * x;
+	f->sxy += x * y;
+	f->syy += y * y;
+}
+
+/* Add a sample of @x units that started at @t1_ns and ends now.
+ * The monotonic clock keeps adjustments of the system time out of
+ * the samples.
+ */
+static void fit_add_since(struct cost_fit *f, double x, uint64_t t1_ns)
+{
+	fit_add(f, x, (now_ns() - t1_ns) / 1000.);
+}
+
+/* Return false if there are not enough samples to solve @f,
+ * otherwise the coefficients of the fit, and the standard deviation
+ * of its residuals.
+ */
+static int fit_solve(const struct cost_fit *f, double *pfixed,
+	double *pper_unit, double *pstd_dev)
+{
+	double d, fixed, per_unit, sse;
+
+	if (f->n < 1)
+		return false;
+
+	d = f->n * f->sxx - f->sx * f->sx;
+	if (d > 1e-9 * f->n * f->sxx) {
+		per_unit = (f->n * f->sxy - f->sx * f->sy) / d;
+		fixed = (f->sy - per_unit * f->sx) / f->n;
+	} else if (f->sx > 0) {
+		/* All samples have the same x, so the components
+		 * cannot be told apart; charge everything per unit.
+		 */
+		fixed = 0;
+		per_unit = f->sy / f->sx;
+	} else {
+		fixed = f->sy / f->n;
+		per_unit = 0;
+	}
+
+	/* Costs are not negative. */
+	if (per_unit < 0) {
+		per_unit = 0;
+		fixed = f->sy / f->n;
+	} else if (fixed < 0) {
+		fixed = 0;
+		per_unit = f->sxx > 0 ? f->sxy / f->sxx : 0;
+	}
+
+	sse = f->syy - 2 * fixed * f->sy - 2 * per_unit * f->sxy +
+		fixed * fixed * f->n + 2 * fixed * per_unit * f->sx +
+		per_unit * per_unit * f->sxx;
+	*pfixed = fixed;
+	*pper_unit = per_unit;
+	*pstd_dev = sse > 0 ? sqrt(sse / f->n) : 0;
+	return true;
+}
+
+/* Costs of the operations of a probe, in microseconds.
+ * They are collected whatever the strategy is.
+ */
+struct cost_model {
+	int		enabled;
+	/* x is the number of blocks written by a call. */
+	struct cost_fit	write;
+	/* x is the number of single-block reads of a call. */
+	struct cost_fit	read;
+	/* x is always zero. */
+	struct cost_fit	reset;
+};
+
+static void init_cost_model(struct cost_model *cm, int strategy)
+{
+	memset(cm, 0, sizeof(*cm));
+	cm->enabled = strategy == PS_COST_MODEL;
 }
 
 #define MAX_N_BLOCK_ORDER	10
@@ -150,12 +487,63 @@ static uint64_t estimate_n_bisect_blocks(struct bisect_stats *pstats)
 	return (1 << n_block_order) - 1;
 }
 
+/* Choose the number of blocks to write per pass, w, that minimizes
+ * the expected time to bisect a gap of @gap blocks.
+ *
+ * A pass writes w blocks, may reset the drive, and reads at most
+ * ceiling_log2(w + 1) blocks back, so it reduces the gap by a factor of
+ * (w + 1), and the bisection takes ceil(log_(w+1)(@gap)) passes.
+ * The standard deviations of the costs are charged once per pass,
+ * so that noisy costs favor fewer passes.
+ * Unlike estimate_n_bisect_blocks(), w does not need to be of
+ * the form 2^m - 1.
+ */
+static uint64_t cost_model_n_bisect_blocks(const struct cost_model *cm,
+	struct bisect_stats *pstats, uint64_t gap)
+{
+	double w_fixed, w_per_block, w_std_dev;
+	double r_fixed, r_per_block, r_std_dev;
+	double z_fixed, z_per_unit, z_std_dev;
+	double best_time = 0, log_gap = log(gap);
+	uint64_t w, max_w, best_w = 1;
+
+	/* Gather more samples with the heuristic. */
+	if (!fit_solve(&cm->write, &w_fixed, &w_per_block, &w_std_dev) ||
+		cm->write.n < 3 ||
+		!fit_solve(&cm->read, &r_fixed, &r_per_block, &r_std_dev) ||
+		!fit_solve(&cm->reset, &z_fixed, &z_per_unit, &z_std_dev))
+		return estimate_n_bisect_blocks(pstats);
+
+	/* Bound the maximum number of blocks per pass to limit
+	 * the necessary amount of memory struct safe_device pre-allocates.
+	 */
+	max_w = (1 << MAX_N_BLOCK_ORDER) - 1;
+	if (max_w > gap - 1)
+		max_w = gap - 1;
+
+	for (w = 1; w <= max_w; w++) {
+		int reads = ceiling_log2(w + 1);
+		double passes = ceil(log_gap / log(w + 1.) - 1e-9);
+		double pass_time =
+			w_fixed + w_per_block * w + w_std_dev +
+			z_fixed + z_std_dev +
+			r_fixed + r_per_block * reads + r_std_dev;
+		double time = passes * pass_time;
+		if (w == 1 || time < best_time) {
+			best_time = time;
+			best_w = w;
+		}
+	}
+	return best_w;
+}
+
 /* Write blocks whose offsets are after @left_pos and before @right_pos. */
 static int write_bisect_blocks(struct device *dev,
 	uint64_t left_pos, uint64_t right_pos, uint64_t n_blocks,
 	uint64_t salt, uint64_t *pa, uint64_t *pb, uint64_t *pmax_idx)
 {
-	uint64_t pos, last_pos;
+	uint64_t pos, last_pos, *positions;
+	int i, ret;
 
 	assert(n_blocks >= 1);
 
@@ -179,10 +567,14 @@ static int write_bisect_blocks(struct device *dev,
 	assert(last_pos < right_pos);
 
 	/* Write test blocks. */
-	for (pos = *pb; pos <= last_pos; pos += *pa)
-		if (write_blocks(dev, pos, pos, salt))
-			return true;
-	return false;
+	positions = malloc((*pmax_idx + 1) * sizeof(*positions));
+	if (!positions)
+		return true;
+	for (pos = *pb, i = 0; pos <= last_pos; pos += *pa, i++)
+		positions[i] = pos;
+	ret = write_scattered_blocks(dev, positions, i, salt);
+	free(positions);
+	return ret;
 }
 
 static int is_block_good(struct device *dev, uint64_t pos, int *pis_good,
@@ -190,33 +582,89 @@ static int is_block_good(struct device *dev, uint64_t pos, int *pis_good,
 {
 	const int block_size = dev_get_block_size(dev);
 	const int block_order = dev_get_block_order(dev);
-	char stack[align_head(block_order) + block_size];
-	char *probe_blk = align_mem(stack, block_order);
 	uint64_t found_offset;
+	char *probe_blk;
+	size_t mark;
+	int ret = true;
+
+	probe_blk = get_buffer(dev, block_size, &mark);
+	if (!probe_blk)
+		return true;
 
 	if (dev_read_blocks(dev, probe_blk, pos, pos) &&
 		dev_read_blocks(dev, probe_blk, pos, pos))
-		return true;
+		goto out;
 
 	*pis_good = !validate_buffer_with_block(probe_blk, block_order,
 			&found_offset, salt) &&
 		found_offset == (pos << block_order);
-	return false;
+	ret = false;
+
+out:
+	put_buffer(dev, mark);
+	return ret;
+}
+
+/* Find the first of the @n @positions, which must be in increasing
+ * order, whose block is bad. *@pbad_idx is @n if all blocks are good.
+ */
+static int find_first_bad_block(struct device *dev,
+	const uint64_t *positions, int n, uint64_t salt, int *pbad_idx)
+{
+	const int block_order = dev_get_block_order(dev);
+	const int block_size = dev_get_block_size(dev);
+	const int per_call = BIG_BLOCK_SIZE_BYTE >> block_order;
+	char *buffer;
+	size_t mark;
+	int i, j, ret = true;
+
+	buffer = get_buffer(dev, BIG_BLOCK_SIZE_BYTE, &mark);
+	if (!buffer)
+		return true;
+
+	for (i = 0; i < n; i += per_call) {
+		int m = n - i < per_call ? n - i : per_call;
+		char *probe_blk = buffer;
+
+		if (dev_readv_blocks(dev, buffer, positions + i, m) &&
+			dev_readv_blocks(dev, buffer, positions + i, m))
+			goto out;
+
+		for (j = 0; j < m; j++) {
+			uint64_t found_offset;
+			if (validate_buffer_with_block(probe_blk, block_order,
+					&found_offset, salt) ||
+				found_offset != positions[i + j] << block_order) {
+				*pbad_idx = i + j;
+				ret = false;
+				goto out;
+			}
+			probe_blk += block_size;
+		}
+	}
+	*pbad_idx = n;
+	ret = false;
+
+out:
+	put_buffer(dev, mark);
+	return ret;
 }
 
 static int probe_bisect_blocks(struct device *dev,
 	uint64_t *pleft_pos, uint64_t *pright_pos, uint64_t salt,
-	uint64_t a, uint64_t b, uint64_t max_idx)
+	uint64_t a, uint64_t b, uint64_t max_idx, int *pn_reads)
 {
 	/* Signed variables. */
 	int64_t left_idx = 0;
 	int64_t right_idx = max_idx;
+	*pn_reads = 0;
 	while (left_idx <= right_idx) {
 		int64_t idx = (left_idx + right_idx) / 2;
 		uint64_t pos = a * idx + b;
 		int is_good;
 		if (is_block_good(dev, pos, &is_good, salt))
 			return true;
+		(*pn_reads)++;
 		if (is_good) {
 			left_idx = idx + 1;
 			*pleft_pos = pos;
@@ -228,42 +676,69 @@ static int probe_bisect_blocks(struct device *dev,
 	return false;
 }
 
+struct checkpointer {
+	struct probe_checkpoint	*cp;
+	probe_checkpoint_cb	cb;
+	void			*arg;
+};
+
+static void take_checkpoint(struct checkpointer *ckp,
+	uint64_t left_pos, uint64_t right_pos, int in_bisect)
+{
+	ckp->cp->left_pos = left_pos;
+	ckp->cp->right_pos = right_pos;
+	ckp->cp->in_bisect = in_bisect;
+	if (ckp->cb)
+		ckp->cb(ckp->cp, ckp->arg);
+}
+
 /* This function assumes that the block at @left_pos is good, and
  *	that the block at @*pright_pos is bad.
  */
 static int bisect(struct device *dev, struct bisect_stats *pstats,
+	struct cost_model *cm, struct reset_cache *rc,
 	uint64_t left_pos, uint64_t *pright_pos, uint64_t reset_pos,
-	uint64_t cache_size_block, int need_reset, uint64_t salt)
+	uint64_t cache_size_block, int need_reset, uint64_t salt,
+	struct checkpointer *ckp)
 {
 	uint64_t gap = *pright_pos - left_pos;
-	struct timeval t1, t2;
+	uint64_t t1, t2;
 
 	assert(*pright_pos > left_pos);
 	while (gap >= 2) {
-		uint64_t a, b, max_idx;
-		uint64_t n_blocks = estimate_n_bisect_blocks(pstats);
+		uint64_t a, b, max_idx, n_blocks;
+		int n_reads;
+
+		n_blocks = cm->enabled
+			? cost_model_n_bisect_blocks(cm, pstats, gap)
+			: estimate_n_bisect_blocks(pstats);
 
-		assert(!gettimeofday(&t1, NULL));
+		t1 = now_ns();
 		if (write_bisect_blocks(dev, left_pos, *pright_pos, n_blocks,
 			salt, &a, &b, &max_idx))
 			return true;
-		assert(!gettimeofday(&t2, NULL));
+		t2 = now_ns();
 		pstats->write_count += max_idx + 1;
-		pstats->write_time_us += diff_timeval_us(&t1, &t2);
+		pstats->write_time_us += (t2 - t1) / 1000;
+		fit_add(&cm->write, max_idx + 1, (t2 - t1) / 1000.);
 
 		/* Reset. */
-		assert(!gettimeofday(&t1, NULL));
-		if (high_level_reset(dev, reset_pos,
+		t1 = now_ns();
+		if (high_level_reset(dev, rc, reset_pos,
 			cache_size_block, need_reset, salt))
 			return true;
-		assert(!gettimeofday(&t2, NULL));
+		t2 = now_ns();
 		pstats->reset_count++;
-		pstats->reset_time_us += diff_timeval_us(&t1, &t2);
+		pstats->reset_time_us += (t2 - t1) / 1000;
+		fit_add(&cm->reset, 0, (t2 - t1) / 1000.);
 
+		t1 = now_ns();
 		if (probe_bisect_blocks(dev, &left_pos, pright_pos, salt,
-			 a, b, max_idx))
+			 a, b, max_idx, &n_reads))
 			return true;
+		fit_add_since(&cm->read, n_reads, t1);
 
+		take_checkpoint(ckp, left_pos, *pright_pos, true);
 		gap = *pright_pos - left_pos;
 	}
 	assert(gap == 1);
@@ -275,40 +750,58 @@ static int count_good_blocks(struct device *dev, uint64_t *pcount,
 {
 	const int block_size = dev_get_block_size(dev);
 	const int block_order = dev_get_block_order(dev);
-	char stack[align_head(block_order) + BIG_BLOCK_SIZE_BYTE];
-	char *buffer = align_mem(stack, block_order);
-	uint64_t expected_sector_offset = first_pos << block_order;
-	uint64_t start_pos = first_pos;
-	uint64_t step = (BIG_BLOCK_SIZE_BYTE >> block_order) - 1;
+	const uint64_t step = (BIG_BLOCK_SIZE_BYTE >> block_order) - 1;
+	struct dev_queue *q;
+	char *buffers;
+	uint64_t next_pos = first_pos;
 	uint64_t count = 0;
+	size_t mark;
+	int n_submitted = 0;
+	int ret = true;
 
 	assert(BIG_BLOCK_SIZE_BYTE >= block_size);
 
-	while (start_pos <= last_pos) {
-		char *probe_blk = buffer;
-		uint64_t pos, next_pos = start_pos + step;
-
-		if (next_pos > last_pos)
-			next_pos = last_pos;
-		if (dev_read_blocks(dev, buffer, start_pos, next_pos) &&
-			dev_read_blocks(dev, buffer, start_pos, next_pos))
-			return true;
-
-		for (pos = start_pos; pos <= next_pos; pos++) {
-			uint64_t found_sector_offset;
-			if (!validate_buffer_with_block(probe_blk, block_order,
-					&found_sector_offset, salt) &&
-				expected_sector_offset == found_sector_offset)
-				count++;
-			expected_sector_offset += block_size;
-			probe_blk += block_size;
+	buffers = get_scan_buffers(dev, &mark);
+	if (!buffers)
+		return true;
+	q = create_dev_queue(dev, PROBE_QUEUE_DEPTH);
+	if (!q)
+		goto buffers;
+
+	while (next_pos <= last_pos || dev_queue_pending(q)) {
+		uint64_t start_pos, end_pos;
+		char *probe_blk;
+
+		if (next_pos <= last_pos && !dev_queue_is_full(q)) {
+			end_pos = next_pos + step;
+			if (end_pos > last_pos)
+				end_pos = last_pos;
+			dev_queue_submit_read(q, buffers +
+				(n_submitted % PROBE_QUEUE_DEPTH) *
+				BIG_BLOCK_SIZE_BYTE, next_pos, end_pos);
+			n_submitted++;
+			next_pos = end_pos + 1;
+			continue;
 		}
 
-		start_pos = next_pos + 1;
+		if (dev_queue_complete(q, &probe_blk, &start_pos, &end_pos) &&
+			dev_read_blocks(dev, probe_blk, start_pos, end_pos))
+			goto out;
+
+		count += validate_buffer_with_blocks(probe_blk, block_order,
+			end_pos - start_pos + 1, start_pos << block_order, salt,
+			NULL, NULL, NULL);
 	}
 
 	*pcount = count;
-	return false;
+	ret = false;
+
+out:
+	/* The queue must go first because it waits for pending requests. */
+	free_dev_queue(q);
+buffers:
+	put_buffer(dev, mark);
+	return ret;
 }
 
 static int assess_reset_effect(struct device *dev,
@@ -357,14 +850,20 @@ static int assess_reset_effect(struct device *dev,
 	return false;
 }
 
-static inline uint64_t uint64_rand(void)
+/* Every probe has its own generator, @rng, so that probes can run
+ * in parallel. This generator is SplitMix64.
+ */
+static uint64_t uint64_rand(uint64_t *rng)
 {
-	return ((uint64_t)rand() << 32) | rand();
+	uint64_t z = (*rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
 }
 
-static uint64_t uint64_rand_range(uint64_t a, uint64_t b)
+static uint64_t uint64_rand_range(uint64_t *rng, uint64_t a, uint64_t b)
 {
-	uint64_t r = uint64_rand();
+	uint64_t r = uint64_rand(rng);
 	assert(a <= b);
 	return a + (r % (b - a + 1));
 }
@@ -373,7 +872,7 @@ static uint64_t uint64_rand_range(uint64_t a, uint64_t b)
 
 static int probabilistic_test(struct device *dev,
 	uint64_t first_pos, uint64_t last_pos, int *pfound_a_bad_block,
-	uint64_t salt)
+	uint64_t salt, uint64_t *rng)
 {
 	uint64_t gap;
 	int i, n, is_linear;
@@ -404,7 +903,7 @@ static int probabilistic_test(struct device *dev,
 	for (i = 0; i < n; i++) {
 		uint64_t sample_pos = is_linear
 			? first_pos + i
-			: uint64_rand_range(first_pos, last_pos);
+			: uint64_rand_range(rng, first_pos, last_pos);
 		int is_good;
 
 		if (is_block_good(dev, sample_pos, &is_good, salt))
@@ -428,10 +927,10 @@ static int uint64_cmp(const void *pa, const void *pb)
 	return *pia - *pib;
 }
 
-static int find_a_bad_block(struct device *dev,
+static int find_a_bad_block(struct device *dev, struct reset_cache *rc,
 	uint64_t left_pos, uint64_t *pright_pos, int *found_a_bad_block,
 	uint64_t reset_pos, uint64_t cache_size_block, int need_reset,
-	uint64_t salt)
+	uint64_t salt, uint64_t *rng)
 {
 	/* We need to list all sampled blocks because
 	 * we need a sorted array; read the code to find the why.
@@ -440,8 +939,8 @@ static int find_a_bad_block(struct device *dev,
 	 * after writing them.
 	 */
 	uint64_t samples[N_BLOCK_SAMPLES];
-	uint64_t gap, prv_sample;
-	int n, i;
+	uint64_t gap;
+	int n, i, j, bad_idx;
 
 	if (*pright_pos <= left_pos + 1)
 		goto not_found;
@@ -463,7 +962,7 @@ static int find_a_bad_block(struct device *dev,
 	} else {
 		n = N_BLOCK_SAMPLES;
 		for (i = 0; i < n; i++)
-			samples[i] = uint64_rand_range(left_pos + 1,
+			samples[i] = uint64_rand_range(rng, left_pos + 1,
 				*pright_pos - 1);
 
 		/* Sort entries of @samples to minimize reads.
@@ -473,39 +972,30 @@ static int find_a_bad_block(struct device *dev,
 		 */
 		qsort(samples, n, sizeof(uint64_t), uint64_cmp);
 
+		/* Drop repeated samples. */
+		for (i = 1, j = 1; i < n; i++)
+			if (samples[i] != samples[j - 1])
+				samples[j++] = samples[i];
+		n = j;
+
 		/* Write @samples. */
-		prv_sample = left_pos;
-		for (i = 0; i < n; i++) {
-			if (samples[i] == prv_sample)
-				continue;
-			prv_sample = samples[i];
-			if (write_blocks(dev, prv_sample, prv_sample, salt))
-				return true;
-		}
+		if (write_scattered_blocks(dev, samples, n, salt))
+			return true;
 	}
 
 	/* Reset. */
-	if (high_level_reset(dev, reset_pos,
+	if (high_level_reset(dev, rc, reset_pos,
 		cache_size_block, need_reset, salt))
 		return true;
 
 	/* Test @samples. */
-	prv_sample = left_pos;
-	for (i = 0; i < n; i++) {
-		int is_good;
-
-		if (samples[i] == prv_sample)
-			continue;
-
-		prv_sample = samples[i];
-		if (is_block_good(dev, prv_sample, &is_good, salt))
-			return true;
-		if (!is_good) {
-			/* Found the leftmost bad block. */
-			*pright_pos = prv_sample;
-			*found_a_bad_block = true;
-			return false;
-		}
+	if (find_first_bad_block(dev, samples, n, salt, &bad_idx))
+		return true;
+	if (bad_idx < n) {
+		/* Found the leftmost bad block. */
+		*pright_pos = samples[bad_idx];
+		*found_a_bad_block = true;
+		return false;
 	}
 
 not_found:
@@ -517,14 +1007,16 @@ not_found:
 #define MIN_CACHE_SIZE_BYTE	(1ULL << 20)
 #define MAX_CACHE_SIZE_BYTE	(1ULL << 30)
 
-static int find_cache_size(struct device *dev,
+static int find_cache_size(struct device *dev, struct cost_model *cm,
 	uint64_t left_pos, uint64_t *pright_pos, uint64_t *pcache_size_block,
-	int *pneed_reset, int *pgood_drive, const uint64_t salt)
+	int *pneed_reset, int *pgood_drive, const uint64_t salt,
+	uint64_t *rng)
 {
 	const int block_order = dev_get_block_order(dev);
 	uint64_t write_target = MIN_CACHE_SIZE_BYTE >> block_order;
 	uint64_t final_write_target = MAX_CACHE_SIZE_BYTE >> block_order;
 	uint64_t first_pos, last_pos, end_pos;
+	uint64_t t1;
 	int done;
 
 	/*
@@ -558,8 +1050,13 @@ static int find_cache_size(struct device *dev,
 		goto good;
 	}
 
+	t1 = now_ns();
 	if (write_blocks(dev, first_pos, last_pos, salt))
 		goto bad;
+	/* These writes are the first samples of the cost model. */
+	fit_add_since(&cm->write, last_pos - first_pos + 1, t1);
+	if (dev_flush(dev))
+		goto bad;
 
 	if (assess_reset_effect(dev, pcache_size_block,
 		pneed_reset, &done, first_pos, end_pos, salt))
@@ -589,11 +1086,15 @@ static int find_cache_size(struct device *dev,
 		/* Write @write_target blocks before
 		 * the previously written blocks.
 		 */
+		t1 = now_ns();
 		if (write_blocks(dev, first_pos, last_pos, salt))
 			goto bad;
+		fit_add_since(&cm->write, last_pos - first_pos + 1, t1);
+		if (dev_flush(dev))
+			goto bad;
 
 		if (probabilistic_test(dev, first_pos, end_pos,
-			&found_a_bad_block, salt))
+			&found_a_bad_block, salt, rng))
 			goto bad;
 		if (found_a_bad_block) {
 			if (assess_reset_effect(dev, pcache_size_block,
@@ -621,13 +1122,17 @@ bad:
 	return true;
 }
 
-static int find_wrap(struct device *dev,
+static int find_wrap(struct device *dev, struct cost_model *cm,
+	struct reset_cache *rc,
 	uint64_t left_pos, uint64_t *pright_pos,
 	uint64_t reset_pos, uint64_t cache_size_block, int need_reset,
 	uint64_t salt)
 {
 	uint64_t offset, high_bit, pos = left_pos + 1;
-	int is_good, block_order;
+	uint64_t t1;
+	int is_good, block_order, ret;
+	char *probe_blk;
+	size_t mark;
 
 	/*
 	 *	Basis
@@ -640,11 +1145,18 @@ static int find_wrap(struct device *dev,
 	if (pos >= *pright_pos)
 		return false;
 
-	if (write_blocks(dev, pos, pos, salt) ||
-		high_level_reset(dev, reset_pos,
-			cache_size_block, need_reset, salt) ||
-		is_block_good(dev, pos, &is_good, salt) ||
-		!is_good)
+	if (write_blocks(dev, pos, pos, salt))
+		return true;
+	t1 = now_ns();
+	if (high_level_reset(dev, rc, reset_pos,
+		cache_size_block, need_reset, salt))
+		return true;
+	fit_add_since(&cm->reset, 0, t1);
+	t1 = now_ns();
+	if (is_block_good(dev, pos, &is_good, salt))
+		return true;
+	fit_add_since(&cm->read, 1, t1);
+	if (!is_good)
 		return true;
 
 	/*
@@ -658,27 +1170,31 @@ static int find_wrap(struct device *dev,
 		high_bit <<= 1;
 	pos += high_bit;
 
+	probe_blk = get_buffer(dev, 1 << block_order, &mark);
+	if (!probe_blk)
+		return true;
+	ret = false;
 	while (pos < *pright_pos) {
-		char stack[align_head(block_order) + (1 << block_order)];
-		char *probe_blk = align_mem(stack, block_order);
 		uint64_t found_offset;
 
 		if (dev_read_blocks(dev, probe_blk, pos, pos) &&
-			dev_read_blocks(dev, probe_blk, pos, pos))
-			return true;
+			dev_read_blocks(dev, probe_blk, pos, pos)) {
+			ret = true;
+			break;
+		}
 
 		if (!validate_buffer_with_block(probe_blk, block_order,
 			&found_offset, salt) &&
 			found_offset == offset) {
 			*pright_pos = high_bit;
-			return false;
+			break;
 		}
 
 		high_bit <<= 1;
 		pos = high_bit + left_pos + 1;
 	}
-
-	return false;
+	put_buffer(dev, mark);
+	return ret;
 }
 
 uint64_t probe_device_max_blocks(struct device *dev)
@@ -721,16 +1237,26 @@ uint64_t probe_device_max_blocks(struct device *dev)
 
 int probe_device(struct device *dev, uint64_t *preal_size_byte,
 	uint64_t *pannounced_size_byte, int *pwrap,
-	uint64_t *pcache_size_block, int *pneed_reset, int *pblock_order)
+	uint64_t *pcache_size_block, int *pneed_reset, int *pblock_order,
+	int strategy, const struct probe_checkpoint *resume,
+	probe_checkpoint_cb checkpoint, void *arg)
 {
 	const uint64_t dev_size_byte = dev_get_size_byte(dev);
 	const int block_order = dev_get_block_order(dev);
-	struct bisect_stats stats;
-	uint64_t salt, cache_size_block;
-	uint64_t left_pos, right_pos, mid_drive_pos, reset_pos;
-	int need_reset, good_drive, wrap, found_a_bad_block;
+	struct probe_checkpoint cp;
+	struct cost_model cm;
+	struct reset_cache rc;
+	struct checkpointer ckp = {
+		.cp	= &cp,
+		.cb	= checkpoint,
+		.arg	= arg,
+	};
+	uint64_t left_pos, right_pos, mid_drive_pos;
+	int good_drive, found_a_bad_block;
 
 	assert(block_order <= 20);
+	init_cost_model(&cm, strategy);
+	init_reset_cache(&rc);
 
 	/* @left_pos must point to a good block.
 	 * We just point to the last block of the first 1MB of the card
@@ -750,11 +1276,21 @@ int probe_device(struct device *dev, uint64_t *preal_size_byte,
 	 * @left_pos points to a good block, and @right_pos to a bad block.
 	 */
 	if (left_pos >= right_pos) {
-		cache_size_block = 0;
-		need_reset = false;
+		cp.cache_size_block = 0;
+		cp.need_reset = false;
 		goto bad;
 	}
 
+	if (resume) {
+		assert(resume->dev_size_byte == dev_size_byte);
+		assert(resume->block_order == block_order);
+		assert(left_pos < resume->right_pos &&
+			resume->right_pos <= right_pos);
+		cp = *resume;
+		right_pos = cp.right_pos;
+		goto search;
+	}
+
 	/* I, Michel Machado, define that any drive with less than
 	 * this number of blocks is fake.
 	 */
@@ -763,41 +1299,53 @@ int probe_device(struct device *dev, uint64_t *preal_size_byte,
 	assert(left_pos < mid_drive_pos);
 	assert(mid_drive_pos < right_pos);
 
-	/* This call is needed due to rand(). */
-	srand(time(NULL));
+	cp.dev_size_byte = dev_size_byte;
+	cp.block_order = block_order;
 
-	salt = uint64_rand();
+	/* The address of @dev tells apart probes started
+	 * in the same second.
+	 */
+	cp.rng = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)dev;
+
+	cp.salt = uint64_rand(&cp.rng);
 
-	if (find_cache_size(dev, mid_drive_pos - 1, &right_pos,
-		&cache_size_block, &need_reset, &good_drive, salt))
+	if (find_cache_size(dev, &cm, mid_drive_pos - 1, &right_pos,
+		&cp.cache_size_block, &cp.need_reset, &good_drive, cp.salt,
+		&cp.rng))
 		goto bad;
 	assert(mid_drive_pos <= right_pos);
-	reset_pos = right_pos;
+	cp.reset_pos = right_pos;
 
-	if (find_wrap(dev, left_pos, &right_pos,
-		reset_pos, cache_size_block, need_reset, salt))
+	if (find_wrap(dev, &cm, &rc, left_pos, &right_pos,
+		cp.reset_pos, cp.cache_size_block, cp.need_reset, cp.salt))
+		goto bad;
+	cp.wrap = ceiling_log2(right_pos << block_order);
+
+	init_bisect_stats(&cp.stats);
+	if (!good_drive && mid_drive_pos < right_pos)
+		right_pos = mid_drive_pos;
+	take_checkpoint(&ckp, left_pos, right_pos, !good_drive);
+
+search:
+	if (cp.in_bisect &&
+		bisect(dev, &cp.stats, &cm, &rc, cp.left_pos, &right_pos,
+			cp.reset_pos, cp.cache_size_block, cp.need_reset,
+			cp.salt, &ckp))
 		goto bad;
-	wrap = ceiling_log2(right_pos << block_order);
-
-	init_bisect_stats(&stats);
-	if (!good_drive) {
-		if (mid_drive_pos < right_pos)
-			right_pos = mid_drive_pos;
-		if (bisect(dev, &stats, left_pos, &right_pos,
-			reset_pos, cache_size_block, need_reset, salt))
-			goto bad;
-	}
 
 	do {
-		if (find_a_bad_block(dev, left_pos, &right_pos,
-			&found_a_bad_block, reset_pos, cache_size_block,
-			need_reset, salt))
+		if (find_a_bad_block(dev, &rc, left_pos, &right_pos,
+			&found_a_bad_block, cp.reset_pos, cp.cache_size_block,
+			cp.need_reset, cp.salt, &cp.rng))
 			goto bad;
 
-		if (found_a_bad_block &&
-			bisect(dev, &stats, left_pos, &right_pos,
-				reset_pos, cache_size_block, need_reset, salt))
-			goto bad;
+		if (found_a_bad_block) {
+			take_checkpoint(&ckp, left_pos, right_pos, true);
+			if (bisect(dev, &cp.stats, &cm, &rc, left_pos,
+				&right_pos, cp.reset_pos, cp.cache_size_block,
+				cp.need_reset, cp.salt, &ckp))
+				goto bad;
+		}
 	} while (found_a_bad_block);
 
 	if (right_pos == left_pos + 1) {
@@ -806,7 +1354,7 @@ int probe_device(struct device *dev, uint64_t *preal_size_byte,
 	}
 
 	*preal_size_byte = right_pos << block_order;
-	*pwrap = wrap;
+	*pwrap = cp.wrap;
 	goto out;
 
 bad:
@@ -815,8 +1363,9 @@ bad:
 
 out:
 	*pannounced_size_byte = dev_size_byte;
-	*pcache_size_block = cache_size_block;
-	*pneed_reset = need_reset;
+	*pcache_size_block = cp.cache_size_block;
+	*pneed_reset = cp.need_reset;
 	*pblock_order = block_order;
+	free_reset_cache(&rc);
 	return false;
 }
@@ -7,8 +7,75 @@
 
 uint64_t probe_device_max_blocks(struct device *dev);
 
+/* How the bisections choose the number of blocks written per pass. */
+enum probe_strategy {
+	/* Derive it from the mean times of writes and resets. */
+	PS_HEURISTIC = 0,
+	/* Minimize the expected time of the bisection, which comes from
+	 * models of the costs of reads, writes, and resets that are
+	 * fitted throughout the probe.
+	 */
+	PS_COST_MODEL,
+	PS_MAX
+};
+
+const char *probe_strategy_to_name(enum probe_strategy strategy);
+/* Return -1 if @name is unknown. */
+int probe_strategy_from_name(const char *name);
+
+/* Statistics used by bisect() in order to optimize the proportion
+ * between writes and resets.
+ */
+struct bisect_stats {
+	int		write_count;
+	int		reset_count;
+	uint64_t	write_time_us;
+	uint64_t	reset_time_us;
+};
+
+/* State of a probe that is needed to resume it.
+ *
+ * Checkpoints are only taken after the cache and the wrap of the drive
+ * are known, and their only goal is to spare repeating the bisections,
+ * so a probe resumed from a checkpoint must be destructive;
+ * the blocks saved by a safe device do not survive an interruption.
+ */
+struct probe_checkpoint {
+	/* Geometry of the probed device; a checkpoint only applies to
+	 * a device with the same geometry.
+	 */
+	uint64_t		dev_size_byte;
+	int			block_order;
+
+	uint64_t		salt;
+	uint64_t		rng;
+	uint64_t		cache_size_block;
+	int			need_reset;
+	int			wrap;
+	uint64_t		reset_pos;
+
+	/* The block at @left_pos is good, and the block at @right_pos
+	 * is bad. @left_pos is only meaningful when @in_bisect is true.
+	 */
+	uint64_t		left_pos;
+	uint64_t		right_pos;
+	int			in_bisect;
+
+	struct bisect_stats	stats;
+};
+
+typedef void (*probe_checkpoint_cb)(const struct probe_checkpoint *cp,
+	void *arg);
+
+/* @strategy is one of enum probe_strategy.
+ * If @resume is not NULL, the probe continues from @resume.
+ * If @checkpoint is not NULL, it is called with @arg whenever
+ * the probe makes progress.
+ */
 int probe_device(struct device *dev, uint64_t *preal_size_byte,
 	uint64_t *pannounced_size_byte, int *pwrap,
-	uint64_t *pcache_size_block, int *pneed_reset, int *pblock_order);
+	uint64_t *pcache_size_block, int *pneed_reset, int *pblock_order,
+	int strategy, const struct probe_checkpoint *resume,
+	probe_checkpoint_cb checkpoint, void *arg);
 
 #endif	/* HEADER_LIBPROBE_H */
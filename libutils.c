@@ -1,6 +1,7 @@
 #include <stdio.h>	/* For fprintf().	*/
 #include <stdlib.h>	/* For strtoll().	*/
 #include <stdbool.h>
+#include <string.h>	/* For memset().	*/
 #include <assert.h>
 
 #include "libutils.h"
@@ -131,6 +132,62 @@ int usec_to_str(uint64_t usec, char *str)
 	return tot;
 }
 
+static int lat_bucket(uint64_t value)
+{
+	int e;
+	if (value < (1ULL << LAT_SUB_BITS))
+		return value;
+	e = ilog2(value);
+	return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) |
+		((value >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* Greatest value that falls in bucket @i. */
+static uint64_t lat_bucket_top(int i)
+{
+	int group = i >> LAT_SUB_BITS;
+	uint64_t sub = i & ((1 << LAT_SUB_BITS) - 1);
+	if (group == 0)
+		return sub;
+	return (((1ULL << LAT_SUB_BITS) + sub + 1) << (group - 1)) - 1;
+}
+
+void lat_init(struct lat_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void lat_add(struct lat_histogram *h, uint64_t value, uint64_t weight)
+{
+	h->buckets[lat_bucket(value)] += weight;
+	h->count += weight;
+	if (weight > 0 && value > h->max)
+		h->max = value;
+}
+
+uint64_t lat_percentile(const struct lat_histogram *h, double p)
+{
+	uint64_t target, acc = 0;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	/* Round up. */
+	target = p * h->count;
+	if (target < p * h->count)
+		target++;
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < LAT_N_BUCKETS; i++) {
+		acc += h->buckets[i];
+		if (acc >= target) {
+			uint64_t top = lat_bucket_top(i);
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->max;
+}
+
 void *align_mem(void *p, int order)
 {
 	uintptr_t ip = (uintptr_t)p;
@@ -192,49 +249,3 @@ long long arg_to_ll_bytes(const struct argp_state *state,
 		argp_error(state, "`%s' is not an integer", arg);
 	return ll;
 }
-
-static inline uint64_t next_random_number(uint64_t random_number)
-{
-	return random_number * 4294967311ULL + 17;
-}
-
-void fill_buffer_with_block(void *buf, int block_order, uint64_t offset,
-	uint64_t salt)
-{
-	uint64_t *int64_array = buf;
-	int i, num_int64 = 1 << (block_order - 3);
-	uint64_t random_number = offset ^ salt;
-
-	assert(block_order >= 9);
-
-	/* The offset is known by drives,
-	 * so one doesn't have to encrypt it.
-	 * Please don't add @salt here!
-	 */
-	int64_array[0] = offset;
-
-	/* Thanks to @salt, a drive has to guess the seed. */
-	for (i = 1; i < num_int64; i++)
-		int64_array[i] = random_number =
-			next_random_number(random_number);
-}
-
-int validate_buffer_with_block(const void *buf, int block_order,
-	uint64_t *pfound_offset, uint64_t salt)
-{
-	const uint64_t *int64_array = buf;
-	int i, num_int64 = 1 << (block_order - 3);
-	uint64_t found_offset = int64_array[0];
-	uint64_t random_number = found_offset ^ salt;
-
-	assert(block_order >= 9);
-
-	for (i = 1; i < num_int64; i++) {
-		random_number = next_random_number(random_number);
-		if (int64_array[i] != random_number)
-			return true;
-	}
-
-	*pfound_offset = found_offset;
-	return false;
-}
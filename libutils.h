@@ -2,6 +2,8 @@
 #define HEADER_LIBUTILS_H
 
 #include <stdint.h>
+#include <assert.h>
+#include <time.h>	/* For clock_gettime().		*/
 #include <argp.h>	/* For struct argp_state.	*/
 #include <sys/time.h>	/* For struct timeval.		*/
 
@@ -23,6 +25,36 @@ const char *adjust_unit(double *ptr_bytes);
 
 int usec_to_str(uint64_t usec, char *str);
 
+/*
+ * Latency histograms.
+ *
+ * Every power of two is split into 2^LAT_SUB_BITS buckets of
+ * equal width, so the width of a bucket is at most 1/16 of
+ * the values it holds, whatever their magnitude.
+ */
+
+#define LAT_SUB_BITS	4
+#define LAT_N_BUCKETS	((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+struct lat_histogram {
+	/* Total weight of the samples. */
+	uint64_t	count;
+	uint64_t	max;
+	uint64_t	buckets[LAT_N_BUCKETS];
+};
+
+void lat_init(struct lat_histogram *h);
+
+/* Add @weight samples of @value to @h. */
+void lat_add(struct lat_histogram *h, uint64_t value, uint64_t weight);
+
+/* Return a value that at least the fraction @p of the samples
+ * don't exceed, e.g. @p = 0.99 for the 99th percentile.
+ * The result is exact up to the width of a bucket, and
+ * never greater than the maximum.
+ */
+uint64_t lat_percentile(const struct lat_histogram *h, double p);
+
 /*
  * The functions align_head() and align_mem() are used to align pointers.
  *
@@ -47,14 +79,6 @@ void print_header(FILE *f, const char *name);
 
 long long arg_to_ll_bytes(const struct argp_state *state, const char *arg);
 
-/* Dependent on the byte order of the processor (i.e. endianness). */
-void fill_buffer_with_block(void *buf, int block_order, uint64_t offset,
-	uint64_t salt);
-
-/* Dependent on the byte order of the processor (i.e. endianness). */
-int validate_buffer_with_block(const void *buf, int block_order,
-	uint64_t *pfound_offset, uint64_t salt);
-
 static inline uint64_t diff_timeval_us(const struct timeval *t1,
 	const struct timeval *t2)
 {
@@ -62,4 +86,19 @@ static inline uint64_t diff_timeval_us(const struct timeval *t1,
 		t2->tv_usec - t1->tv_usec;
 }
 
+/* clock_gettime(2) is POSIX, so only files that ask for it get now_ns(). */
+#if _POSIX_C_SOURCE >= 199309L
+
+/* Nanoseconds of the monotonic clock, which, unlike gettimeofday(2),
+ * doesn't jump when the system time is adjusted.
+ */
+static inline uint64_t now_ns(void)
+{
+	struct timespec t;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+#endif
+
 #endif	/* HEADER_LIBUTILS_H */
@@ -0,0 +1,661 @@
+#define _POSIX_C_SOURCE 200112L
+#define _XOPEN_SOURCE 600
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "libpattern.h"
+#include "libarena.h"
+#include "libverify.h"
+
+#define TOLERANCE	2
+
+uint64_t fill_buffer(void *buf, size_t size, uint64_t offset)
+{
+	const int num_int64 = SECTOR_SIZE >> 3;
+	uint8_t *p, *ptr_end;
+
+	assert(size > 0);
+	assert(size % SECTOR_SIZE == 0);
+
+	p = buf;
+	ptr_end = p + size;
+	while (p < ptr_end) {
+		uint64_t *sector = (uint64_t *)p;
+		sector[0] = offset;
+		pattern_fill(sector + 1, num_int64 - 1, offset);
+		p += SECTOR_SIZE;
+		offset += SECTOR_SIZE;
+	}
+
+	return offset;
+}
+
+static void check_sector(char *_sector, uint64_t expected_offset,
+	struct file_stats *stats)
+{
+	uint64_t *sector = (uint64_t *)_sector;
+	const int num_int64 = SECTOR_SIZE >> 3;
+	int error_count = pattern_count_mismatches(sector + 1, num_int64 - 1,
+		sector[0], TOLERANCE);
+
+	if (expected_offset == sector[0]) {
+		if (error_count == 0)
+			stats->secs_ok++;
+		else if (error_count <= TOLERANCE)
+			stats->secs_changed++;
+		else
+			stats->secs_corrupted++;
+	} else if (error_count <= TOLERANCE)
+		stats->secs_overwritten++;
+	else
+		stats->secs_corrupted++;
+}
+
+uint64_t check_buffer(char *buf, size_t size, uint64_t expected_offset,
+	struct file_stats *stats)
+{
+	char *beyond_buf = buf + size;
+
+	assert(size % SECTOR_SIZE == 0);
+
+	while (buf < beyond_buf) {
+		check_sector(buf, expected_offset, stats);
+		buf += SECTOR_SIZE;
+		expected_offset += SECTOR_SIZE;
+	}
+	return expected_offset;
+}
+
+/* *@pdirect is cleared if @fd has to stop bypassing the page cache. */
+static ssize_t read_all(int fd, char *buf, size_t count, int *pdirect)
+{
+	size_t done = 0;
+	do {
+		ssize_t rc = read(fd, buf + done, count - done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Direct I/O rejects unaligned reads with EINVAL;
+			 * retry through the page cache.
+			 */
+			if (errno == EINVAL && !stop_direct_io(fd)) {
+				*pdirect = false;
+				continue;
+			}
+			return - errno;
+		}
+		if (rc == 0)
+			break;
+		done += rc;
+	} while (done < count);
+	return done;
+}
+
+static void check_slot(struct pipe_slot *slot, void *arg)
+{
+	struct checker *checker = arg;
+	struct file_stats *stats = &checker->slot_stats[slot->index];
+	zero_fstats(stats);
+	check_buffer(slot->buf, slot->size, slot->offset, stats);
+}
+
+static inline void add_fstats(struct file_stats *stats,
+	const struct file_stats *more)
+{
+	stats->secs_ok += more->secs_ok;
+	stats->secs_corrupted += more->secs_corrupted;
+	stats->secs_changed += more->secs_changed;
+	stats->secs_overwritten += more->secs_overwritten;
+}
+
+/* Collect the result of @slot, if any, into @stats. */
+static void collect_slot(struct checker *checker, struct pipe_slot *slot,
+	struct file_stats *stats)
+{
+	if (slot->state == PSS_DONE)
+		add_fstats(stats, &checker->slot_stats[slot->index]);
+}
+
+/* Wait for all pending checks, and collect their results into @stats. */
+static void drain_checker(struct checker *checker, struct file_stats *stats)
+{
+	int i, n = pipe_n_slots(checker->pl);
+	for (i = 0; i < n; i++) {
+		struct pipe_slot *slot = pipe_get(checker->pl);
+		collect_slot(checker, slot, stats);
+		pipe_put(checker->pl, slot);
+	}
+}
+
+static ssize_t check_piped_chunk(int fd, uint64_t *p_expected_offset,
+	uint64_t chunk_size, struct file_stats *stats,
+	struct checker *checker, int *pdirect)
+{
+	ssize_t tot_bytes_read = 0;
+
+	while (chunk_size > 0) {
+		size_t turn_size = chunk_size <= MAX_BUFFER_SIZE
+			? chunk_size : MAX_BUFFER_SIZE;
+		struct pipe_slot *slot = pipe_get(checker->pl);
+		ssize_t bytes_read;
+
+		collect_slot(checker, slot, stats);
+		bytes_read = read_all(fd, slot->buf, turn_size, pdirect);
+
+		if (bytes_read <= 0) {
+			pipe_put(checker->pl, slot);
+			if (bytes_read == 0)
+				break;
+			stats->bytes_read += tot_bytes_read;
+			return bytes_read;
+		}
+
+		tot_bytes_read += bytes_read;
+		chunk_size -= bytes_read;
+		slot->size = bytes_read;
+		slot->offset = *p_expected_offset;
+		*p_expected_offset += bytes_read;
+		pipe_submit(checker->pl, slot);
+	}
+
+	stats->bytes_read += tot_bytes_read;
+	return tot_bytes_read;
+}
+
+/*
+ * Checking straight from memory mappings.
+ *
+ * Files are mapped one window at a time, and the pages of a window are
+ * dropped once it has been checked, so the memory footprint is bounded
+ * even though nothing is copied.
+ *
+ * When the kernel cannot fill in a page because of an I/O error,
+ * the access raises SIGBUS. The handler jumps back to
+ * check_mapped_piece(), which discards the partial results of
+ * the piece, and the piece is read again with read(2), so the error is
+ * accounted exactly as in the read path.
+ */
+
+#define MAP_WINDOW_SIZE	(64 << 20)
+
+static sigjmp_buf sigbus_env;
+static volatile sig_atomic_t sigbus_armed;
+static struct sigaction old_sigbus_act;
+
+static void sigbus_handler(int signum)
+{
+	if (sigbus_armed) {
+		sigbus_armed = 0;
+		siglongjmp(sigbus_env, 1);
+	}
+	/* This SIGBUS is not ours. */
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+/* Map the @size bytes at @pos of @fd; a @size of zero means up to
+ * the end of the file.
+ */
+static void start_mapping(int fd, struct checker *checker, uint64_t pos,
+	uint64_t size)
+{
+	if (!size) {
+		struct stat st;
+		assert(!fstat(fd, &st));
+		size = st.st_size - pos;
+	}
+	checker->map = NULL;
+	checker->file_size = pos + size;
+	checker->file_pos = pos;
+}
+
+static void unmap_window(int fd, struct checker *checker)
+{
+	if (!checker->map)
+		return;
+	assert(!munmap(checker->map, checker->map_len));
+	/* Behind the window, the pages are only wasting the cache. */
+	posix_fadvise(fd, checker->map_start, checker->map_len,
+		POSIX_FADV_DONTNEED);
+	checker->map = NULL;
+}
+
+/* Make sure that the window at @checker->file_pos is mapped.
+ * Return zero, or -errno on failure.
+ */
+static int map_window(int fd, struct checker *checker)
+{
+	uint64_t pos = checker->file_pos;
+	void *map;
+
+	if (checker->map && pos >= checker->map_start &&
+		pos < checker->map_start + checker->map_len)
+		return 0;
+	unmap_window(fd, checker);
+
+	checker->map_start = pos & ~((uint64_t)MAP_WINDOW_SIZE - 1);
+	checker->map_len = checker->file_size - checker->map_start <
+		MAP_WINDOW_SIZE ? checker->file_size - checker->map_start
+		: MAP_WINDOW_SIZE;
+	map = mmap(NULL, checker->map_len, PROT_READ, MAP_SHARED, fd,
+		checker->map_start);
+	if (map == MAP_FAILED)
+		return - errno;
+	checker->map = map;
+	posix_madvise(map, checker->map_len, POSIX_MADV_SEQUENTIAL);
+	return 0;
+}
+
+/* Check @size bytes at @piece. If an I/O error interrupts the check,
+ * return false and leave @stats as it was.
+ */
+static bool check_mapped_piece(char *piece, size_t size,
+	uint64_t expected_offset, struct file_stats *stats)
+{
+	struct file_stats saved = *stats;
+
+	if (sigsetjmp(sigbus_env, 1)) {
+		*stats = saved;
+		return false;
+	}
+	sigbus_armed = 1;
+	check_buffer(piece, size, expected_offset, stats);
+	sigbus_armed = 0;
+	return true;
+}
+
+static ssize_t check_mapped_chunk(int fd, uint64_t *p_expected_offset,
+	uint64_t chunk_size, struct file_stats *stats,
+	struct checker *checker, int *pdirect)
+{
+	ssize_t tot_bytes_read = 0;
+
+	while (chunk_size > 0 && checker->file_pos < checker->file_size) {
+		uint64_t pos = checker->file_pos;
+		uint64_t window_left;
+		size_t turn_size;
+		int rc = map_window(fd, checker);
+
+		if (rc < 0) {
+			stats->bytes_read += tot_bytes_read;
+			return rc;
+		}
+
+		window_left = checker->map_start + checker->map_len - pos;
+		turn_size = chunk_size <= MAX_BUFFER_SIZE
+			? chunk_size : MAX_BUFFER_SIZE;
+		if (turn_size > window_left)
+			turn_size = window_left;
+
+		if (!check_mapped_piece(checker->map + (pos -
+				checker->map_start), turn_size,
+				*p_expected_offset, stats)) {
+			/* Let read(2) sort out the I/O error. */
+			ssize_t bytes_read;
+			assert(lseek(fd, pos, SEEK_SET) == (off_t)pos);
+			bytes_read = read_all(fd, checker->buf, turn_size,
+				pdirect);
+			if (bytes_read < 0) {
+				stats->bytes_read += tot_bytes_read;
+				return bytes_read;
+			}
+			if (bytes_read == 0)
+				break;
+			turn_size = bytes_read;
+			check_buffer(checker->buf, turn_size,
+				*p_expected_offset, stats);
+		}
+
+		checker->file_pos += turn_size;
+		*p_expected_offset += turn_size;
+		tot_bytes_read += turn_size;
+		chunk_size -= turn_size;
+	}
+
+	stats->bytes_read += tot_bytes_read;
+	return tot_bytes_read;
+}
+
+static ssize_t check_chunk(int fd, uint64_t *p_expected_offset,
+	uint64_t chunk_size, struct file_stats *stats,
+	struct checker *checker, int *pdirect)
+{
+	ssize_t tot_bytes_read = 0;
+
+	if (checker->pl)
+		return check_piped_chunk(fd, p_expected_offset, chunk_size,
+			stats, checker, pdirect);
+	if (checker->use_mmap)
+		return check_mapped_chunk(fd, p_expected_offset, chunk_size,
+			stats, checker, pdirect);
+
+	while (chunk_size > 0) {
+		size_t turn_size = chunk_size <= MAX_BUFFER_SIZE
+			? chunk_size : MAX_BUFFER_SIZE;
+		ssize_t bytes_read = read_all(fd, checker->buf, turn_size,
+			pdirect);
+
+		if (bytes_read < 0) {
+			stats->bytes_read += tot_bytes_read;
+			return bytes_read;
+		}
+
+		if (bytes_read == 0)
+			break;
+
+		tot_bytes_read += bytes_read;
+		chunk_size -= bytes_read;
+		*p_expected_offset = check_buffer(checker->buf, bytes_read,
+			*p_expected_offset, stats);
+	}
+
+	stats->bytes_read += tot_bytes_read;
+	return tot_bytes_read;
+}
+
+static inline void print_status(const struct file_stats *stats)
+{
+	printf("%7" PRIu64 "/%9" PRIu64 "/%7" PRIu64 "/%7" PRIu64,
+		stats->secs_ok, stats->secs_corrupted, stats->secs_changed,
+		stats->secs_overwritten);
+}
+
+/* Validate the @size bytes at @pos of @fd, which hold file @number;
+ * a @size of zero means up to the end of @fd.
+ * *@pdirect is cleared if the page cache has to be used.
+ */
+static int validate_fd(int fd, uint64_t pos, uint64_t size, int number,
+	struct flow *fw, struct file_stats *stats, struct checker *checker,
+	int *pdirect)
+{
+	int saved_errno;
+	ssize_t bytes_read;
+	uint64_t expected_offset, remaining = size;
+
+	zero_fstats(stats);
+
+	/* If the kernel follows our advice, f3read won't ever read from cache
+	 * even when testing small memory cards without a remount, and
+	 * we should have a better reading-speed measurement.
+	 */
+	assert(!fdatasync(fd));
+	assert(!posix_fadvise(fd, pos, size, POSIX_FADV_DONTNEED));
+
+	/* Help the kernel to help us. */
+	assert(!posix_fadvise(fd, pos, size, POSIX_FADV_SEQUENTIAL));
+
+	if (checker->use_mmap)
+		start_mapping(fd, checker, pos, size);
+	else
+		assert(lseek(fd, pos, SEEK_SET) == (off_t)pos);
+
+	saved_errno = 0;
+	expected_offset = (uint64_t)number * checker->h2w_size;
+	start_measurement(fw);
+	while (true) {
+		uint64_t chunk_size = get_rem_chunk_size(fw);
+		if (size && chunk_size > remaining)
+			chunk_size = remaining;
+		bytes_read = chunk_size > 0 ? check_chunk(fd, &expected_offset,
+			chunk_size, stats, checker, pdirect) : 0;
+		if (bytes_read == 0)
+			break;
+		if (bytes_read < 0) {
+			saved_errno = - bytes_read;
+			break;
+		}
+		remaining -= bytes_read;
+		if (measure(fd, fw, bytes_read) < 0) {
+			saved_errno = errno;
+			break;
+		}
+	}
+	if (end_measurement(fd, fw) < 0) {
+		/* If a write failure has happened before, preserve it. */
+		if (!saved_errno)
+			saved_errno = errno;
+	}
+	if (checker->pl)
+		drain_checker(checker, stats);
+	if (checker->use_mmap)
+		unmap_window(fd, checker);
+	stats->read_all = bytes_read == 0;
+	return saved_errno;
+}
+
+static int open_h2w_file(const char *path, int number, int *pdirect)
+{
+	char *full_fn;
+	const char *filename;
+	int fd;
+
+	full_fn = full_fn_from_number(&filename, path, number);
+	assert(full_fn);
+#ifdef __CYGWIN__
+	/* We don't need write access, but some kernels require that
+	 * the file descriptor passed to fdatasync(2) to be writable.
+	 */
+	fd = open_file(full_fn, O_RDWR, pdirect);
+#else
+	fd = open_file(full_fn, O_RDONLY, pdirect);
+#endif
+	if (fd < 0)
+		err(errno, "Can't open file %s", full_fn);
+	free(full_fn);
+	return fd;
+}
+
+int validate_file(const char *path, int number, struct flow *fw,
+	struct file_stats *stats, struct checker *checker, int *pdirect)
+{
+	int fd = open_h2w_file(path, number, pdirect);
+	int saved_errno = validate_fd(fd, 0, 0, number, fw, stats, checker,
+		pdirect);
+	close(fd);
+	return saved_errno;
+}
+
+int validate_region(int fd, uint64_t dev_size, int number, struct flow *fw,
+	struct file_stats *stats, struct checker *checker, int *pdirect)
+{
+	return validate_fd(fd, (uint64_t)number * checker->h2w_size,
+		raw_region_size(dev_size, checker->h2w_size, number), number,
+		fw, stats, checker, pdirect);
+}
+
+/* Validate the @size bytes at @pos of @fd, whose sectors are expected
+ * from @expected_offset on, with plain reads into @checker->buf.
+ * Unlike validate_fd(), the measurement of @fw is left to the caller,
+ * so it spans many chunks.
+ */
+static int validate_fd_chunk(int fd, uint64_t pos, uint64_t size,
+	uint64_t expected_offset, struct flow *fw, struct file_stats *stats,
+	struct checker *checker, int *pdirect)
+{
+	zero_fstats(stats);
+	stats->read_all = true;
+
+	/* See validate_fd(). */
+	assert(!fdatasync(fd));
+	assert(!posix_fadvise(fd, pos, size, POSIX_FADV_DONTNEED));
+	assert(lseek(fd, pos, SEEK_SET) == (off_t)pos);
+
+	while (size > 0) {
+		uint64_t turn_size = get_rem_chunk_size(fw);
+		ssize_t bytes_read;
+
+		if (turn_size > size)
+			turn_size = size;
+		if (turn_size > MAX_BUFFER_SIZE)
+			turn_size = MAX_BUFFER_SIZE;
+		bytes_read = read_all(fd, checker->buf, turn_size, pdirect);
+		if (bytes_read < 0) {
+			stats->read_all = false;
+			return - bytes_read;
+		}
+		if (bytes_read == 0)
+			break;
+
+		expected_offset = check_buffer(checker->buf, bytes_read,
+			expected_offset, stats);
+		stats->bytes_read += bytes_read;
+		size -= bytes_read;
+		if (measure(fd, fw, bytes_read) < 0)
+			return errno;
+	}
+	return 0;
+}
+
+int validate_file_chunk(const char *path, int number, uint64_t pos,
+	uint64_t size, struct flow *fw, struct file_stats *stats,
+	struct checker *checker, int *pdirect)
+{
+	int fd = open_h2w_file(path, number, pdirect);
+	int saved_errno = validate_fd_chunk(fd, pos, size,
+		(uint64_t)number * checker->h2w_size + pos, fw, stats,
+		checker, pdirect);
+	close(fd);
+	return saved_errno;
+}
+
+int validate_region_chunk(int fd, int number, uint64_t pos, uint64_t size,
+	struct flow *fw, struct file_stats *stats, struct checker *checker,
+	int *pdirect)
+{
+	const uint64_t offset = (uint64_t)number * checker->h2w_size + pos;
+	return validate_fd_chunk(fd, offset, size, offset, fw, stats,
+		checker, pdirect);
+}
+
+void print_file_status(const struct file_stats *stats, int saved_errno)
+{
+	print_status(stats);
+	if (!stats->read_all) {
+		assert(saved_errno);
+		printf(" - NOT fully read due to \"%s\"",
+			strerror(saved_errno));
+	} else if (saved_errno) {
+		printf(" - %s", strerror(saved_errno));
+	}
+	printf("\n");
+}
+
+static void report(const char *prefix, uint64_t i)
+{
+	double f = (double) (i * SECTOR_SIZE);
+	const char *unit = adjust_unit(&f);
+	printf("%s %.2f %s (%" PRIu64 " sectors)\n", prefix, f, unit, i);
+}
+
+void add_to_totals(struct read_totals *totals, const struct file_stats *stats)
+{
+	totals->tot_ok += stats->secs_ok;
+	totals->tot_corrupted += stats->secs_corrupted;
+	totals->tot_changed += stats->secs_changed;
+	totals->tot_overwritten += stats->secs_overwritten;
+	totals->tot_size += stats->bytes_read;
+	totals->and_read_all = totals->and_read_all && stats->read_all;
+}
+
+void print_totals(const struct read_totals *totals)
+{
+	assert(totals->tot_size == SECTOR_SIZE *
+		(totals->tot_ok + totals->tot_corrupted +
+		totals->tot_changed + totals->tot_overwritten));
+
+	report("\n  Data OK:", totals->tot_ok);
+	report("Data LOST:", totals->tot_corrupted + totals->tot_changed +
+		totals->tot_overwritten);
+	report("\t       Corrupted:", totals->tot_corrupted);
+	report("\tSlightly changed:", totals->tot_changed);
+	report("\t     Overwritten:", totals->tot_overwritten);
+}
+
+
+static inline void pr_avg_speed(double speed)
+{
+	const char *unit = adjust_unit(&speed);
+	printf("Average reading speed: %.2f %s/s\n", speed, unit);
+}
+
+void print_read_speed(struct flow *fw, const struct timeval *t1,
+	const struct timeval *t2)
+{
+	if (has_enough_measurements(fw)) {
+		pr_avg_speed(get_avg_speed(fw));
+	} else {
+		/* If the drive is too fast for the measurements above,
+		 * try a coarse approximation of the reading speed.
+		 */
+		int64_t total_time_ms = delay_ms(t1, t2);
+		if (total_time_ms > 0) {
+			pr_avg_speed(get_avg_speed_given_time(fw,
+				total_time_ms));
+		} else {
+			printf("Reading speed not available\n");
+		}
+	}
+}
+
+void init_checker(struct checker *checker, int threads, int use_mmap,
+	uint64_t h2w_size, int arena_flags)
+{
+	checker->h2w_size = h2w_size;
+	checker->arena = NULL;
+	checker->buf = NULL;
+	checker->pl = NULL;
+	checker->slot_stats = NULL;
+	checker->use_mmap = use_mmap;
+	checker->map = NULL;
+	if (use_mmap) {
+		struct sigaction act;
+		assert(threads == 0);
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = sigbus_handler;
+		sigemptyset(&act.sa_mask);
+		assert(!sigaction(SIGBUS, &act, &old_sigbus_act));
+	}
+	if (threads > 0) {
+		checker->pl = create_pipeline(threads, MAX_BUFFER_SIZE,
+			arena_flags, check_slot, checker);
+		if (!checker->pl)
+			errx(1, "Can't create %i threads", threads);
+		checker->slot_stats = malloc(pipe_n_slots(checker->pl) *
+			sizeof(*checker->slot_stats));
+		assert(checker->slot_stats);
+	} else {
+		checker->arena = create_arena(MAX_BUFFER_SIZE, arena_flags);
+		if (!checker->arena)
+			errx(1, "Out of memory");
+		checker->buf = arena_alloc(checker->arena, MAX_BUFFER_SIZE,
+			DIRECT_IO_ORDER);
+		assert(checker->buf);
+	}
+}
+
+void free_checker(struct checker *checker)
+{
+	if (checker->pl)
+		free_pipeline(checker->pl);
+	free(checker->slot_stats);
+	if (checker->arena)
+		free_arena(checker->arena);
+	if (checker->use_mmap)
+		assert(!sigaction(SIGBUS, &old_sigbus_act, NULL));
+}
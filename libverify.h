@@ -0,0 +1,145 @@
+#ifndef HEADER_LIBVERIFY_H
+#define HEADER_LIBVERIFY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "libflow.h"
+#include "libpipe.h"
+#include "libarena.h"
+
+/* Validation of .h2w files, shared by f3read and f3write --verify. */
+
+struct file_stats {
+	uint64_t secs_ok;
+	uint64_t secs_corrupted;
+	uint64_t secs_changed;
+	uint64_t secs_overwritten;
+
+	uint64_t bytes_read;
+	int read_all;
+};
+
+static inline void zero_fstats(struct file_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+/* How sectors are checked. */
+struct checker {
+	/* Size of the .h2w files; see DEFAULT_FILE_SIZE. */
+	uint64_t		h2w_size;
+	/* Aligned buffer used when there are no workers, and
+	 * the arena that holds it.
+	 */
+	struct arena		*arena;
+	char			*buf;
+	/* Workers checking sectors; NULL if there are none. */
+	struct pipeline		*pl;
+	/* Per-slot results of the workers; see check_slot(). */
+	struct file_stats	*slot_stats;
+
+	/* Check files straight from memory mappings; see
+	 * check_mapped_chunk().
+	 */
+	int			use_mmap;
+	/* Window of the file being checked that is mapped at @map;
+	 * NULL if none.
+	 */
+	char			*map;
+	uint64_t		map_start;
+	size_t			map_len;
+	/* Size of the file being checked, and next position to check. */
+	uint64_t		file_size;
+	uint64_t		file_pos;
+};
+
+/* The sectors of .h2w files start with their offset in the file,
+ * and the chain that follows is seeded by the offset.
+ *
+ * Fill the @size bytes of @buf with the sectors at @offset, and
+ * return the offset that follows them.
+ */
+uint64_t fill_buffer(void *buf, size_t size, uint64_t offset);
+
+/* Add the sectors in @buf, expected at @expected_offset, to @stats,
+ * and return the offset that follows them.
+ */
+uint64_t check_buffer(char *buf, size_t size, uint64_t expected_offset,
+	struct file_stats *stats);
+
+/* Set up @checker with @threads worker threads; 0 means none.
+ * If @use_mmap is true, @threads must be zero, and files are checked
+ * from memory mappings instead of being copied with read(2).
+ * @h2w_size is the size of the files written by f3write.
+ * The buffers come from arenas created with @arena_flags.
+ */
+void init_checker(struct checker *checker, int threads, int use_mmap,
+	uint64_t h2w_size, int arena_flags);
+void free_checker(struct checker *checker);
+
+/* Validate file @number in @path, and store the result in @stats.
+ * @fw measures the reading speed, and @pdirect works as in open_file();
+ * it is also cleared when a read gives up direct I/O halfway.
+ *
+ * Return zero, or the error that stopped the validation.
+ */
+int validate_file(const char *path, int number, struct flow *fw,
+	struct file_stats *stats, struct checker *checker, int *pdirect);
+
+/* Validate region @number of the raw device @fd of @dev_size bytes
+ * as validate_file() validates file @number.
+ */
+int validate_region(int fd, uint64_t dev_size, int number, struct flow *fw,
+	struct file_stats *stats, struct checker *checker, int *pdirect);
+
+/* Validate the @size bytes at @pos of file @number in @path as
+ * validate_file() does, but with plain reads into the buffer of
+ * @checker, which must have been set up without workers and
+ * memory mappings.
+ * @fw must be measuring; see start_measurement().
+ */
+int validate_file_chunk(const char *path, int number, uint64_t pos,
+	uint64_t size, struct flow *fw, struct file_stats *stats,
+	struct checker *checker, int *pdirect);
+
+/* Validate the @size bytes at @pos of region @number of the raw device
+ * @fd as validate_file_chunk() validates files.
+ */
+int validate_region_chunk(int fd, int number, uint64_t pos, uint64_t size,
+	struct flow *fw, struct file_stats *stats, struct checker *checker,
+	int *pdirect);
+
+/* Print the counts of @stats, and, if any, @saved_errno returned by
+ * validate_file(). The line is ended.
+ */
+void print_file_status(const struct file_stats *stats, int saved_errno);
+
+struct read_totals {
+	uint64_t	tot_ok;
+	uint64_t	tot_corrupted;
+	uint64_t	tot_changed;
+	uint64_t	tot_overwritten;
+	uint64_t	tot_size;
+	int		and_read_all;
+};
+
+static inline void zero_totals(struct read_totals *totals)
+{
+	memset(totals, 0, sizeof(*totals));
+	totals->and_read_all = 1;
+}
+
+void add_to_totals(struct read_totals *totals, const struct file_stats *stats);
+
+/* Print how much data is OK and how much is lost. */
+void print_totals(const struct read_totals *totals);
+
+/* Print the average reading speed of @fw. If @fw doesn't have enough
+ * measurements, the reading is assumed to have taken from @t1 to @t2.
+ */
+void print_read_speed(struct flow *fw, const struct timeval *t1,
+	const struct timeval *t2);
+
+#endif	/* HEADER_LIBVERIFY_H */
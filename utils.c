@@ -15,9 +15,13 @@
 #include <ctype.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <err.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "version.h"
 #include "utils.h"
@@ -88,85 +92,161 @@ static inline bool include_this_file(const char *filename,
 	return start_at <= *number && *number <= end_at;
 }
 
-static long count_files(const char *path, long start_at, long end_at)
+/* Files are stat'ed by up to this many threads because, on network
+ * file systems and slow media, most of the time of a stat is waiting.
+ */
+#define MAX_STAT_THREADS	8
+
+/* Each thread stats at least this many files, otherwise creating
+ * the thread costs more than it saves.
+ */
+#define MIN_STATS_PER_THREAD	64
+
+struct stat_job {
+	int			dirfd;
+	struct h2w_file		*files;
+	long			n_files;
+	/* This job stats the files @first, @first + @stride, ... */
+	long			first;
+	long			stride;
+	/* First file that failed, and its error; -1 if none. */
+	long			failed;
+	int			saved_errno;
+	pthread_t		thread;
+};
+
+static void *stat_files(void *arg)
 {
-	DIR *dir = opendir(path);
-	struct dirent *entry;
-	long dummy, total = 0;
-
-	if (!dir)
-		err(errno, "Can't open path %s at %s()", path, __func__);
-
-	entry = readdir(dir);
-	while (entry) {
-		if (include_this_file(entry->d_name, start_at, end_at, &dummy))
-			total++;
-		entry = readdir(dir);
+	struct stat_job *job = arg;
+	long i;
+
+	job->failed = -1;
+	for (i = job->first; i < job->n_files; i += job->stride) {
+		struct h2w_file *file = &job->files[i];
+		char filename[32];
+		struct stat st;
+
+		assert(snprintf(filename, sizeof(filename), "%li.h2w",
+			file->number + 1) < (int)sizeof(filename));
+		if (fstatat(job->dirfd, filename, &st, 0) < 0) {
+			job->saved_errno = errno;
+			job->failed = i;
+			break;
+		}
+		if ((st.st_mode & S_IFMT) != S_IFREG) {
+			job->saved_errno = EINVAL;
+			job->failed = i;
+			break;
+		}
+		assert(st.st_size >= 0);
+		file->size = st.st_size;
 	}
-	closedir(dir);
-
-	return total;
+	return NULL;
 }
 
-/* Don't call this function directly, use ls_my_files() instead. */
-static long *__ls_my_files(const char *path, long start_at, long end_at,
-	long *pcount)
+/* Fill the sizes of the @n_files @files of the directory @dirfd. */
+static void stat_my_files(const char *path, int dirfd,
+	struct h2w_file *files, long n_files)
 {
-	long total_files = count_files(path, start_at, end_at);
-	DIR *dir;
-	struct dirent *entry;
-	long *ret, index;
-
-	assert(total_files >= 0);
-	ret = malloc(sizeof(*ret) * (total_files + 1));
-	assert(ret);
+	struct stat_job jobs[MAX_STAT_THREADS];
+	long n_jobs = n_files / MIN_STATS_PER_THREAD;
+	long i;
+	int ret;
 
-	dir = opendir(path);
-	if (!dir)
-		err(errno, "Can't open path %s at %s()", path, __func__);
+	if (n_jobs > MAX_STAT_THREADS)
+		n_jobs = MAX_STAT_THREADS;
+	if (n_jobs < 1)
+		n_jobs = 1;
+
+	for (i = 0; i < n_jobs; i++) {
+		struct stat_job *job = &jobs[i];
+		job->dirfd = dirfd;
+		job->files = files;
+		job->n_files = n_files;
+		job->first = i;
+		job->stride = n_jobs;
+	}
 
-	entry = readdir(dir);
-	index = 0;
-	while (entry) {
-		long number;
-		if (include_this_file(entry->d_name, start_at, end_at,
-				&number)) {
-			if (index >= total_files) {
-				/* The folder @path received more files
-				 * before we finished scanning it.
-				 */
-				closedir(dir);
-				free(ret);
-				return NULL;
-			}
-			ret[index++] = number;
+	/* The calling thread runs the first job. */
+	for (i = 1; i < n_jobs; i++) {
+		/* pthread_create() returns the error instead of
+		 * setting errno, which err() prints.
+		 */
+		ret = pthread_create(&jobs[i].thread, NULL, stat_files,
+			&jobs[i]);
+		if (ret) {
+			errno = ret;
+			err(ret, "Can't create threads to stat files");
 		}
-
-		entry = readdir(dir);
 	}
-	closedir(dir);
-
-	ret[index] = -1;
-	*pcount = index;
-	return ret;
+	stat_files(&jobs[0]);
+	for (i = 1; i < n_jobs; i++)
+		assert(!pthread_join(jobs[i].thread, NULL));
+
+	for (i = 0; i < n_jobs; i++) {
+		const struct stat_job *job = &jobs[i];
+		if (job->failed < 0)
+			continue;
+		errno = job->saved_errno;
+		if (errno == EINVAL)
+			err(errno, "File %s/%li.h2w is not a regular file",
+				path, files[job->failed].number + 1);
+		err(errno, "Can't stat file %s/%li.h2w", path,
+			files[job->failed].number + 1);
+	}
 }
 
 /* To be used with qsort(3). */
-static int cmpintp(const void *p1, const void *p2)
+static int cmp_h2w_files(const void *p1, const void *p2)
 {
-	return *(const long *)p1 - *(const long *)p2;
+	const struct h2w_file *f1 = p1;
+	const struct h2w_file *f2 = p2;
+	return (f1->number > f2->number) - (f1->number < f2->number);
 }
 
-const long *ls_my_files(const char *path, long start_at, long end_at)
+const struct h2w_file *ls_my_files(const char *path, long start_at,
+	long end_at, int with_size)
 {
-	long *ret, my_count;
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+	struct h2w_file *files = NULL;
+	long n = 0, max_n = 0;
 
-	do {
-		ret = __ls_my_files(path, start_at, end_at, &my_count);
-	} while (!ret);
+	if (!dir)
+		err(errno, "Can't open path %s at %s()", path, __func__);
+
+	/* A single pass is enough because, unlike a count followed by
+	 * a second pass, the array grows with the files found.
+	 */
+	for (entry = readdir(dir); entry; entry = readdir(dir)) {
+		long number;
+
+		if (!include_this_file(entry->d_name, start_at, end_at,
+				&number))
+			continue;
+		/* One more entry for the end of the list. */
+		if (n + 1 >= max_n) {
+			max_n = max_n ? 2 * max_n : 64;
+			files = realloc(files, max_n * sizeof(*files));
+			assert(files);
+		}
+		files[n].number = number;
+		files[n].size = 0;
+		n++;
+	}
+	if (!files) {
+		files = malloc(sizeof(*files));
+		assert(files);
+	}
 
-	qsort(ret, my_count, sizeof(*ret), cmpintp);
-	return ret;
+	qsort(files, n, sizeof(*files), cmp_h2w_files);
+	if (with_size)
+		stat_my_files(path, dirfd(dir), files, n);
+	closedir(dir);
+
+	files[n].number = -1;
+	files[n].size = 0;
+	return files;
 }
 
 long arg_to_long(const struct argp_state *state, const char *arg)
@@ -189,6 +269,128 @@ void print_header(FILE *f, const char *name)
 	"\n", name);
 }
 
+FILE *open_stats_file(const char *filename)
+{
+	FILE *f;
+	if (!filename)
+		return NULL;
+	f = fopen(filename, "w");
+	if (!f)
+		err(errno, "Can't open file %s", filename);
+	return f;
+}
+
+void close_stats_file(FILE *f, const char *filename)
+{
+	if (f && fclose(f))
+		err(errno, "Can't write file %s", filename);
+}
+
+int open_file(const char *pathname, int flags, int *pdirect)
+{
+	const mode_t mode = S_IRUSR | S_IWUSR;
+	int fd;
+
+#if defined(O_DIRECT)
+	if (*pdirect) {
+		fd = open(pathname, flags | O_DIRECT, mode);
+		/* Linux reports that a file system doesn't support
+		 * O_DIRECT with EINVAL.
+		 */
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+		*pdirect = false;
+	}
+	return open(pathname, flags, mode);
+#elif defined(F_NOCACHE)
+	fd = open(pathname, flags, mode);
+	if (fd >= 0 && *pdirect && fcntl(fd, F_NOCACHE, 1))
+		*pdirect = false;
+	return fd;
+#else
+	UNUSED(fd);
+	*pdirect = false;
+	return open(pathname, flags, mode);
+#endif
+}
+
+int open_raw_device(const char *pathname, int flags, int *pdirect,
+	uint64_t *psize, uint64_t *ptail)
+{
+	struct stat st;
+	off_t size;
+	int fd, saved_errno;
+
+	fd = open_file(pathname, flags, pdirect);
+	if (fd < 0)
+		return -1;
+
+	saved_errno = EINVAL;
+	if (fstat(fd, &st))
+		goto error;
+	if (!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode) &&
+		!S_ISREG(st.st_mode))
+		goto error;
+
+	/* Unlike st_size, this works for block devices too. */
+	size = lseek(fd, 0, SEEK_END);
+	if (size < SECTOR_SIZE || lseek(fd, 0, SEEK_SET)) {
+		saved_errno = size < 0 ? errno : ENOSPC;
+		goto error;
+	}
+	/* Image files may end with a partial sector,
+	 * which cannot be written or read with the rest.
+	 */
+	*psize = size - size % SECTOR_SIZE;
+	if (ptail)
+		*ptail = size % SECTOR_SIZE;
+	return fd;
+
+error:
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+void pr_raw_tail(uint64_t tail)
+{
+	if (tail)
+		printf("The last %i bytes of the device do not fill a sector, so they are ignored\n",
+			(int)tail);
+}
+
+int preallocate_file(int fd, uint64_t size)
+{
+#ifdef __linux__
+	/* Unlike posix_fallocate(3), fallocate(2) does not fall back to
+	 * writing the whole file, which would double the writing.
+	 * Keeping the size of the file makes a file that is not fully
+	 * written as short as it would be without preallocation.
+	 */
+	return fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) ? errno : 0;
+#else
+	UNUSED(fd);
+	UNUSED(size);
+	return EOPNOTSUPP;
+#endif
+}
+
+int stop_direct_io(int fd)
+{
+#if defined(O_DIRECT)
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || !(flags & O_DIRECT))
+		return -1;
+	return fcntl(fd, F_SETFL, flags & ~O_DIRECT) ? -1 : 0;
+#else
+	/* F_NOCACHE imposes no alignment, so nothing ever fails
+	 * because of it.
+	 */
+	UNUSED(fd);
+	return -1;
+#endif
+}
+
 #if __APPLE__ && __MACH__
 
 /* This function is a _rough_ approximation of fdatasync(2). */
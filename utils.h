@@ -26,15 +26,93 @@ static inline int64_t delay_ms(const struct timeval *t1,
 
 void msleep(double wait_ms);
 
-const long *ls_my_files(const char *path, long start_at, long end_at);
+/* A .h2w file, or a region of a raw device. */
+struct h2w_file {
+	long		number;
+	uint64_t	size;
+};
+
+/* Return the .h2w files of @path numbered from @start_at to @end_at
+ * sorted by number, and followed by an entry whose number is -1.
+ * If @with_size is true, the sizes of the files are filled in, and
+ * the files must be regular files; otherwise, the sizes are zero.
+ * Caller must free(3) the returned pointer.
+ */
+const struct h2w_file *ls_my_files(const char *path, long start_at,
+	long end_at, int with_size);
 
 void print_header(FILE *f, const char *name);
 
-static inline uint64_t random_number(uint64_t prv_number)
+/* Open the file of --stats-file @filename for writing, or return NULL
+ * if @filename is NULL. Exit on failure.
+ */
+FILE *open_stats_file(const char *filename);
+
+/* Close @f, which may be NULL, and exit if the stats did not reach
+ * @filename.
+ */
+void close_stats_file(FILE *f, const char *filename);
+
+/* Buffers used with direct I/O must be aligned to this many bytes. */
+#define DIRECT_IO_ORDER	12
+#define DIRECT_IO_ALIGN	(1 << DIRECT_IO_ORDER)
+
+/* Open @pathname as open(2) does; files are created with mode 0600.
+ * If *@pdirect is true, the file is accessed bypassing the page cache.
+ * When direct I/O is not available, the file is opened through
+ * the page cache, and *@pdirect is cleared.
+ */
+int open_file(const char *pathname, int flags, int *pdirect);
+
+/* Size of .h2w files, and of the regions of raw devices, unless
+ * option --file-size says otherwise.
+ * File @number holds the sectors at offset @number times this size.
+ */
+#define DEFAULT_FILE_SIZE	GIGABYTES
+
+/* Largest value of option --file-size in MB. */
+#define MAX_FILE_SIZE_MB	(1 << 20)
+
+/* Allocate the first @size bytes of @fd without changing its size, so
+ * the file system can lay the file out in one go.
+ * Return zero, or the error; EOPNOTSUPP if the file system or
+ * the platform doesn't support it.
+ */
+int preallocate_file(int fd, uint64_t size);
+
+/* Open the block device, or image file, @pathname as open_file() does,
+ * and store its size in *@psize. @pathname must exist.
+ * The size is rounded down to a multiple of SECTOR_SIZE, and
+ * the number of bytes left out goes to *@ptail when @ptail is not NULL.
+ * On failure, return -1 and set errno.
+ */
+int open_raw_device(const char *pathname, int flags, int *pdirect,
+	uint64_t *psize, uint64_t *ptail);
+
+/* Tell the user that the last @tail bytes of a raw device are ignored. */
+void pr_raw_tail(uint64_t tail);
+
+/* Number of regions of @region_size bytes of a raw device of @size
+ * bytes; the last region is shorter if @size is not a multiple of
+ * @region_size.
+ */
+static inline long raw_n_regions(uint64_t size, uint64_t region_size)
 {
-	return prv_number * 4294967311ULL + 17;
+	return (size + region_size - 1) / region_size;
 }
 
+static inline uint64_t raw_region_size(uint64_t size, uint64_t region_size,
+	long number)
+{
+	uint64_t start = (uint64_t)number * region_size;
+	return size - start < region_size ? size - start : region_size;
+}
+
+/* Make @fd go through the page cache from now on.
+ * Return 0 if @fd was bypassing the page cache, and -1 otherwise.
+ */
+int stop_direct_io(int fd);
+
 #define UNUSED(x)	((void)x)
 
 long arg_to_long(const struct argp_state *state, const char *arg);